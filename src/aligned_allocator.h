@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+#include <new>
+#include <vector>
+
+// Cache lines are 64 bytes on all supported CPUs, which also covers the widest SIMD loads (AVX-512)
+const size_t c_cacheLineSize = 64;
+
+/* A std::vector allocator that aligns the storage to ALIGNMENT bytes, e.g. for buffers that are
+streamed through SIMD kernels or written by one thread and read by another */
+template <typename T, size_t ALIGNMENT = c_cacheLineSize>
+struct AlignedAllocator
+{
+    typedef T value_type;
+
+    template <typename U>
+    struct rebind
+    {
+        typedef AlignedAllocator<U, ALIGNMENT> other;
+    };
+
+    AlignedAllocator () = default;
+
+    template <typename U>
+    AlignedAllocator (const AlignedAllocator<U, ALIGNMENT>&) {}
+
+    T* allocate (size_t count)
+    {
+        return static_cast<T*>(::operator new(count * sizeof(T), std::align_val_t(ALIGNMENT)));
+    }
+
+    void deallocate (T* pointer, size_t)
+    {
+        ::operator delete(pointer, std::align_val_t(ALIGNMENT));
+    }
+
+    template <typename U>
+    bool operator == (const AlignedAllocator<U, ALIGNMENT>&) const { return true; }
+
+    template <typename U>
+    bool operator != (const AlignedAllocator<U, ALIGNMENT>&) const { return false; }
+};
+
+template <typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T>>;
@@ -0,0 +1,318 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <cmath>
+#include <random>
+#include <vector>
+#include <algorithm>
+#include "simd_kernels.h"
+
+// The size of the normalized digits, see NormalizeDigit()
+const size_t c_normalizedImageSize = 28;
+const size_t c_normalizedDigitSize = 20;
+
+/* The random distortions applied by the ImageAugmenter. Every image gets its own random values,
+uniformly distributed in the given ranges */
+struct AugmentationSettings
+{
+    // Translation in pixels, in x and y independently
+    float m_maxShift = 2.0f;
+
+    // Rotation around the image center in degrees, either way
+    float m_maxRotation = 10.0f;
+
+    // The image is scaled by a factor in [1 - m_maxScale, 1 + m_maxScale]
+    float m_maxScale = 0.1f;
+
+    // Horizontal shear, x is moved by up to m_maxShear * y
+    float m_maxShear = 0.1f;
+
+    /* Elastic distortion (Simard et al., 2003): every pixel is moved by a random displacement field that is smoothed
+    by a Gaussian with a standard deviation of m_elasticSigma pixels and then scaled by m_elasticAlpha. The defaults are
+    the values of the paper, an alpha of 0 turns the elastic distortion off */
+    float m_elasticAlpha = 34.0f;
+    float m_elasticSigma = 4.0f;
+};
+
+/* Generates randomly distorted versions of images in memory, so every epoch trains on new variations of the digits
+without storing any of them. The distortion of an image only depends on a seed, the epoch and the position of the item,
+so training stays reproducible no matter which thread augments which image.
+
+An image is warped by a random affine transformation (shift, rotation, scale, shear) plus an optional elastic
+displacement field and resampled with bilinear interpolation. The smoothing of the displacement field dominates the
+cost, it runs as a separable Gaussian where every filter tap is one SIMD MultiplyAdd over the whole padded field. */
+class ImageAugmenter
+{
+public:
+    ImageAugmenter (size_t rows, size_t columns, const AugmentationSettings& settings = AugmentationSettings())
+        : m_rows(rows)
+        , m_columns(columns)
+        , m_settings(settings)
+    {
+        // The Gaussian is cut off at 2 sigma
+        m_radius = size_t(std::ceil(2.0f * std::max(settings.m_elasticSigma, 0.5f)));
+        m_kernel.resize(2 * m_radius + 1);
+        float sum = 0.0f;
+        for (size_t i = 0; i < m_kernel.size(); ++i)
+        {
+            float x = float(i) - float(m_radius);
+            m_kernel[i] = std::exp(-x * x / (2.0f * settings.m_elasticSigma * settings.m_elasticSigma));
+            sum += m_kernel[i];
+        }
+        for (float& weight : m_kernel)
+            weight /= sum;
+
+        m_paddedColumns = m_columns + 2 * m_radius;
+    }
+
+    size_t ImageRows () const { return m_rows; }
+    size_t ImageColumns () const { return m_columns; }
+    size_t ImageSize () const { return m_rows * m_columns; }
+    const AugmentationSettings& Settings () const { return m_settings; }
+
+    /* Distorts the rows x columns float pixels of an image in place. The scratch memory is thread local,
+    so any number of threads can augment images at the same time */
+    void Augment (float* image, uint32_t seed, uint32_t epoch, size_t item) const
+    {
+        std::minstd_rand random(ItemSeed(seed, epoch, item));
+        auto uniform = [&random] (float range) { return std::uniform_real_distribution<float>(-range, range)(random); };
+
+        thread_local std::vector<float> source;
+        thread_local std::vector<float> displacementX;
+        thread_local std::vector<float> displacementY;
+        source.assign(image, image + ImageSize());
+
+        /* The affine transformation maps a destination pixel to the position it is sampled from. Its random
+        parameters are symmetric, so drawing the inverse transformation directly gives the same distribution */
+        const float pi = 3.14159265358979f;
+        float angle = uniform(m_settings.m_maxRotation) * pi / 180.0f;
+        float scale = 1.0f + uniform(m_settings.m_maxScale);
+        float shear = uniform(m_settings.m_maxShear);
+        float shiftX = uniform(m_settings.m_maxShift);
+        float shiftY = uniform(m_settings.m_maxShift);
+        float a = std::cos(angle) * scale;
+        float b = (std::cos(angle) * shear - std::sin(angle)) * scale;
+        float c = std::sin(angle) * scale;
+        float d = (std::sin(angle) * shear + std::cos(angle)) * scale;
+
+        bool elastic = m_settings.m_elasticAlpha > 0.0f;
+        if (elastic)
+        {
+            RandomField(uint32_t(random()), displacementX);
+            RandomField(uint32_t(random()), displacementY);
+        }
+
+        const float centerX = 0.5f * float(m_columns - 1);
+        const float centerY = 0.5f * float(m_rows - 1);
+        for (size_t y = 0; y < m_rows; ++y)
+        {
+            float relativeY = float(y) - centerY;
+            for (size_t x = 0; x < m_columns; ++x)
+            {
+                float relativeX = float(x) - centerX;
+                float sourceX = a * relativeX + b * relativeY + centerX - shiftX;
+                float sourceY = c * relativeX + d * relativeY + centerY - shiftY;
+                if (elastic)
+                {
+                    size_t fieldIndex = FieldIndex(x, y);
+                    sourceX += m_settings.m_elasticAlpha * displacementX[fieldIndex];
+                    sourceY += m_settings.m_elasticAlpha * displacementY[fieldIndex];
+                }
+                image[y * m_columns + x] = SampleBilinear(source.data(), m_columns, m_rows, sourceX, sourceY);
+            }
+        }
+    }
+
+    // The value at a fractional position, interpolated between the four neighbors. Pixels outside the image are zero
+    static float SampleBilinear (const float* image, size_t width, size_t height, float x, float y)
+    {
+        // Positions left of or above the image would round the wrong way when converted to an integer
+        if (!(x > -1.0f && y > -1.0f && x < float(width) && y < float(height)))
+            return 0.0f;
+
+        long x0 = long(x + 1.0f) - 1;
+        long y0 = long(y + 1.0f) - 1;
+        float fractionX = x - float(x0);
+        float fractionY = y - float(y0);
+
+        float topLeft, topRight, bottomLeft, bottomRight;
+        if (x0 >= 0 && y0 >= 0 && x0 + 1 < long(width) && y0 + 1 < long(height))
+        {
+            const float* pixel = &image[y0 * long(width) + x0];
+            topLeft = pixel[0];
+            topRight = pixel[1];
+            bottomLeft = pixel[width];
+            bottomRight = pixel[width + 1];
+        }
+        else
+        {
+            auto pixel = [&] (long px, long py) { return (px >= 0 && py >= 0 && px < long(width) && py < long(height)) ? image[py * long(width) + px] : 0.0f; };
+            topLeft = pixel(x0, y0);
+            topRight = pixel(x0 + 1, y0);
+            bottomLeft = pixel(x0, y0 + 1);
+            bottomRight = pixel(x0 + 1, y0 + 1);
+        }
+
+        float top = topLeft + fractionX * (topRight - topLeft);
+        float bottom = bottomLeft + fractionX * (bottomRight - bottomLeft);
+        return top + fractionY * (bottom - top);
+    }
+
+private:
+
+    // Mixes the seed, the epoch and the item into one 32 bit value (splitmix64 finalizer)
+    static uint32_t ItemSeed (uint32_t seed, uint32_t epoch, size_t item)
+    {
+        uint64_t z = (uint64_t(seed) << 32 | epoch) + 0x9E3779B97F4A7C15ull * (uint64_t(item) + 1);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        z ^= z >> 31;
+
+        // minstd_rand must not be seeded with 0 (mod 2^31 - 1)
+        return uint32_t(z % 2147483646u) + 1;
+    }
+
+    /* The field is stored with m_radius zero columns left and right of every row, m_radius zero rows above and below
+    and m_radius extra values at both ends, so every filter tap can read the whole field shifted by up to m_radius
+    positions in either direction */
+    size_t FieldIndex (size_t x, size_t y) const
+    {
+        return m_radius + (y + m_radius) * m_paddedColumns + (x + m_radius);
+    }
+
+    size_t FieldSize () const
+    {
+        return 2 * m_radius + (m_rows + 2 * m_radius) * m_paddedColumns;
+    }
+
+    /* Fills field with uniform noise in [-1, 1] that is smoothed by the Gaussian. The noise is a hash of the seed and
+    the pixel index instead of a sequential random generator, which makes the loop vectorizable */
+    void RandomField (uint32_t seed, std::vector<float>& field) const
+    {
+        thread_local std::vector<float> smoothed;
+        field.assign(FieldSize(), 0.0f);
+        smoothed.assign(FieldSize(), 0.0f);
+
+        for (size_t y = 0; y < m_rows; ++y)
+        {
+            float* row = &field[FieldIndex(0, y)];
+            uint32_t rowSeed = seed + uint32_t(y * m_columns) * 0x9E3779B9u;
+            for (size_t x = 0; x < m_columns; ++x)
+            {
+                uint32_t hash = rowSeed + uint32_t(x) * 0x9E3779B9u;
+                hash = (hash ^ (hash >> 16)) * 0x7FEB352Du;
+                hash = (hash ^ (hash >> 15)) * 0x846CA68Bu;
+                hash ^= hash >> 16;
+                row[x] = float(int32_t(hash)) * (1.0f / 2147483648.0f);
+            }
+        }
+
+        const SimdKernels& kernels = GetSimdKernels();
+        const size_t rowsBegin = FieldIndex(0, 0) - m_radius;
+        const size_t rowsCount = m_rows * m_paddedColumns;
+
+        // Horizontal pass over all rows at once, the padding columns keep the rows apart
+        for (size_t tap = 0; tap < m_kernel.size(); ++tap)
+            kernels.MultiplyAdd(&smoothed[rowsBegin], m_kernel[tap], &field[rowsBegin + tap - m_radius], rowsCount);
+
+        // The padding columns picked up values of the neighboring rows, they have to be zero for the vertical pass
+        for (size_t y = 0; y < m_rows; ++y)
+        {
+            float* row = &smoothed[rowsBegin + y * m_paddedColumns];
+            std::fill(row, row + m_radius, 0.0f);
+            std::fill(row + m_radius + m_columns, row + m_paddedColumns, 0.0f);
+        }
+
+        // Vertical pass, a tap shifts the whole field by whole rows
+        std::fill(field.begin(), field.end(), 0.0f);
+        for (size_t tap = 0; tap < m_kernel.size(); ++tap)
+            kernels.MultiplyAdd(&field[rowsBegin], m_kernel[tap], &smoothed[rowsBegin + tap * m_paddedColumns - m_radius * m_paddedColumns], rowsCount);
+    }
+
+private:
+
+    size_t                  m_rows;
+    size_t                  m_columns;
+    AugmentationSettings    m_settings;
+
+    // The normalized Gaussian of the elastic distortion
+    std::vector<float>      m_kernel;
+    size_t                  m_radius = 0;
+    size_t                  m_paddedColumns = 0;
+};
+
+/* The preprocessing of the web demo (see demonstration.html) in C++, for a drawing of any size with values in [0, 1]:
+the bounding box of the ink is made square and scaled down to 20x20 pixels, which are placed in a 28x28 image so that
+the center of mass of the ink lands on the image center. The MNIST digits were prepared the same way, so this turns
+drawings with any position and size into inputs that look like the training data.
+destination receives 28x28 values and must not overlap image. Returns false if there is no ink at all */
+inline bool NormalizeDigit (const float* image, size_t width, size_t height, float* destination, float threshold = 0.0f)
+{
+    std::fill(destination, destination + c_normalizedImageSize * c_normalizedImageSize, 0.0f);
+
+    // Bounding box of the ink
+    size_t minX = width, minY = height, maxX = 0, maxY = 0;
+    for (size_t y = 0; y < height; ++y)
+    {
+        for (size_t x = 0; x < width; ++x)
+        {
+            if (image[y * width + x] > threshold)
+            {
+                minX = std::min(minX, x);
+                maxX = std::max(maxX, x);
+                minY = std::min(minY, y);
+                maxY = std::max(maxY, y);
+            }
+        }
+    }
+    if (minX > maxX)
+        return false;
+
+    // Make the smaller side of the bounding box bigger to turn it into a square with the same center
+    float boxSize = float(std::max(maxX - minX, maxY - minY) + 1);
+    float boxX = 0.5f * float(minX + maxX + 1) - 0.5f * boxSize;
+    float boxY = 0.5f * float(minY + maxY + 1) - 0.5f * boxSize;
+
+    /* Scale the box to 20x20. Every target pixel averages samplesPerSide x samplesPerSide bilinear samples of its area,
+    like the repeated halving of the web demo this keeps thin strokes of large drawings from disappearing */
+    float digit[c_normalizedDigitSize * c_normalizedDigitSize];
+    const float step = boxSize / float(c_normalizedDigitSize);
+    const size_t samplesPerSide = std::max<size_t>(1, size_t(std::ceil(step)));
+    float sumX = 0.0f, sumY = 0.0f, sum = 0.0f;
+    for (size_t y = 0; y < c_normalizedDigitSize; ++y)
+    {
+        for (size_t x = 0; x < c_normalizedDigitSize; ++x)
+        {
+            float value = 0.0f;
+            for (size_t sy = 0; sy < samplesPerSide; ++sy)
+            {
+                for (size_t sx = 0; sx < samplesPerSide; ++sx)
+                {
+                    float sourceX = boxX + step * (float(x) + (float(sx) + 0.5f) / float(samplesPerSide)) - 0.5f;
+                    float sourceY = boxY + step * (float(y) + (float(sy) + 0.5f) / float(samplesPerSide)) - 0.5f;
+                    value += ImageAugmenter::SampleBilinear(image, width, height, sourceX, sourceY);
+                }
+            }
+            value /= float(samplesPerSide * samplesPerSide);
+            digit[y * c_normalizedDigitSize + x] = value;
+
+            sumX += float(x) * value;
+            sumY += float(y) * value;
+            sum += value;
+        }
+    }
+    if (sum <= 0.0f)
+        return false;
+
+    // Move the center of mass of the 20x20 digit to the center of the 28x28 image
+    const float border = 0.5f * float(c_normalizedImageSize - c_normalizedDigitSize);
+    const float offsetX = border + 0.5f * float(c_normalizedDigitSize) - sumX / sum;
+    const float offsetY = border + 0.5f * float(c_normalizedDigitSize) - sumY / sum;
+    for (size_t y = 0; y < c_normalizedImageSize; ++y)
+    {
+        for (size_t x = 0; x < c_normalizedImageSize; ++x)
+            destination[y * c_normalizedImageSize + x] = ImageAugmenter::SampleBilinear(digit, c_normalizedDigitSize, c_normalizedDigitSize, float(x) - offsetX, float(y) - offsetY);
+    }
+    return true;
+}
@@ -0,0 +1,284 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "aligned_allocator.h"
+#include "data_loader.h"
+#include "profiler.h"
+
+/* A minibatch gathered by the BatchPrefetcher. The rows are contiguous [size x inputs] floats, a sparse batch (see
+BatchPrefetcher::SetSparseInputs()) may only have the nonzero inputs and no dense rows */
+struct PrefetchedBatch
+{
+    const float*        m_inputs = nullptr;
+    const SparseRows*   m_sparseInputs = nullptr;
+    const uint8_t*      m_labels = nullptr;
+    size_t              m_size = 0;
+
+    // The position of the first item in the order given to BatchPrefetcher::Start()
+    size_t              m_firstItem = 0;
+};
+
+// How long the consumer waited for its input, collected from Start() until the last batch
+struct PrefetchStats
+{
+    size_t m_batches = 0;
+
+    // The number of batches that were not ready yet when the consumer asked for them
+    size_t m_stalls = 0;
+
+    // Time the consumer spent waiting in Next() and the whole time from Start() until the last batch
+    double m_waitSeconds = 0.0;
+    double m_totalSeconds = 0.0;
+
+    // Time spent gathering (and transforming) items, summed over all producer threads
+    double m_gatherSeconds = 0.0;
+
+    double WaitFraction () const { return m_totalSeconds > 0.0 ? m_waitSeconds / m_totalSeconds : 0.0; }
+};
+
+/* Gathers the items of a dataset in a given (e.g. shuffled) order into minibatches on background threads, so the
+random accesses into the dataset and the uint8 to float conversion overlap with the training on the previous batch.
+
+Every producer thread owns two of the batch slots (double buffering): while the consumer works on one batch the
+producer fills the next one. Producer t fills the batches t, t + threads, t + 2 * threads, ..., so the batches reach
+the consumer in order no matter which thread finishes first. The slots are cache line aligned and a batch is one
+contiguous [batch x inputs] matrix, the consumer only sees sequential memory.
+
+With zero threads the batches are gathered by Next() on the calling thread, which shows the cost of an
+unoverlapped input pipeline in the statistics. */
+class BatchPrefetcher
+{
+public:
+    /* Called on the producer thread for every item after it was converted to float, e.g. to augment the image.
+    position is the position of the item in the order given to Start() */
+    typedef std::function<void (float* input, size_t inputCount, size_t position)> InputTransform;
+
+    explicit BatchPrefetcher (size_t threadCount = 1)
+        : m_threadCount(threadCount)
+    {
+    }
+
+    ~BatchPrefetcher ()
+    {
+        Stop();
+    }
+
+    BatchPrefetcher (const BatchPrefetcher&) = delete;
+    BatchPrefetcher& operator = (const BatchPrefetcher&) = delete;
+
+    // Must be set before Start(), the transform is called from several threads at once
+    void SetTransform (InputTransform transform) { m_transform = std::move(transform); }
+
+    /* Batches with at most maxDensity nonzero inputs are handed out as SparseRows. Without a transform they are built
+    straight from the uint8 pixels and the dense rows are only filled for denser batches. 0 (the default) gathers dense
+    rows only. Must be set before Start() */
+    void SetSparseInputs (float maxDensity) { m_maxSparseDensity = maxDensity; }
+
+    /* Starts gathering count items in the given order, padded with zeros to inputCount values per item.
+    order and data must stay valid until the last batch was returned or Stop() was called */
+    void Start (const MNISTData& data, const size_t* order, size_t count, size_t batchSize, size_t inputCount)
+    {
+        Stop();
+
+        m_data = &data;
+        m_order = order;
+        m_count = count;
+        m_batchSize = std::max<size_t>(batchSize, 1);
+        m_inputCount = inputCount;
+        m_batchCount = (count + m_batchSize - 1) / m_batchSize;
+        m_nextBatch = 0;
+        m_stop = false;
+        m_stats = PrefetchStats();
+        m_start = std::chrono::steady_clock::now();
+
+        m_slots.resize(std::max<size_t>(2 * m_threadCount, 1));
+        for (size_t slotIndex = 0; slotIndex < m_slots.size(); ++slotIndex)
+        {
+            Slot& slot = m_slots[slotIndex];
+            slot.m_inputs.resize(m_batchSize * m_inputCount);
+            slot.m_labels.resize(m_batchSize);
+            slot.m_batchIndex = slotIndex;
+            slot.m_ready = false;
+        }
+
+        for (size_t threadIndex = 0; threadIndex < m_threadCount; ++threadIndex)
+            m_threads.emplace_back([this, threadIndex] () { ProducerLoop(threadIndex); });
+    }
+
+    /* Returns the next batch in order, or nullptr after the last one. The batch stays valid until
+    the next call, which hands its slot back to the producer */
+    const PrefetchedBatch* Next ()
+    {
+        if (m_nextBatch > 0)
+            ReleaseSlot(m_nextBatch - 1);
+        if (m_nextBatch >= m_batchCount)
+            return nullptr;
+
+        PROFILE_ZONE(c_inputWaitZone);
+        Slot& slot = m_slots[m_nextBatch % m_slots.size()];
+        auto waitStart = std::chrono::steady_clock::now();
+        if (m_threads.empty())
+        {
+            Gather(slot, m_nextBatch);
+            ++m_stats.m_stalls;
+        }
+        else
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if (!slot.m_ready)
+            {
+                ++m_stats.m_stalls;
+                m_readyCondition.wait(lock, [&] () { return slot.m_ready; });
+            }
+        }
+        auto now = std::chrono::steady_clock::now();
+        m_stats.m_waitSeconds += std::chrono::duration<double>(now - waitStart).count();
+        m_stats.m_totalSeconds = std::chrono::duration<double>(now - m_start).count();
+        ++m_stats.m_batches;
+
+        ++m_nextBatch;
+        return &slot.m_batch;
+    }
+
+    // Ends the producer threads, the batches that were not consumed yet are dropped
+    void Stop ()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_freeCondition.notify_all();
+        for (std::thread& thread : m_threads)
+            thread.join();
+        m_threads.clear();
+    }
+
+    // Only consistent while no batch is being produced, i.e. after the last batch or Stop()
+    const PrefetchStats& Stats () const { return m_stats; }
+
+private:
+
+    struct Slot
+    {
+        AlignedVector<float>    m_inputs;
+        SparseRows              m_sparseInputs;
+        AlignedVector<uint8_t>  m_labels;
+        PrefetchedBatch         m_batch;
+
+        // The batch this slot holds or is going to hold next, protected by m_mutex
+        size_t                  m_batchIndex = 0;
+        bool                    m_ready = false;
+    };
+
+    // Converts the items of a batch into the slot, runs without the lock
+    void Gather (Slot& slot, size_t batchIndex)
+    {
+        PROFILE_ZONE(c_gatherZone);
+        auto start = std::chrono::steady_clock::now();
+
+        size_t firstItem = batchIndex * m_batchSize;
+        size_t size = std::min(m_batchSize, m_count - firstItem);
+        const bool gatherSparse = m_maxSparseDensity > 0.0f;
+        bool gatherDense = true;
+        slot.m_sparseInputs.Clear();
+        if (gatherSparse && !m_transform)
+        {
+            for (size_t itemIndex = 0; itemIndex < size; ++itemIndex)
+                m_data->GetSparseImage(m_order[firstItem + itemIndex], slot.m_sparseInputs, m_inputCount, slot.m_labels[itemIndex]);
+            gatherDense = slot.m_sparseInputs.Density(m_inputCount) > m_maxSparseDensity;
+        }
+
+        // A transformed item can only be compressed after the transform
+        if (gatherDense)
+        {
+            for (size_t itemIndex = 0; itemIndex < size; ++itemIndex)
+            {
+                float* input = &slot.m_inputs[itemIndex * m_inputCount];
+                m_data->GetImage(m_order[firstItem + itemIndex], input, m_inputCount, slot.m_labels[itemIndex]);
+                if (m_transform)
+                {
+                    PROFILE_ZONE(c_augmentZone);
+                    m_transform(input, m_inputCount, firstItem + itemIndex);
+                    if (gatherSparse)
+                        slot.m_sparseInputs.AppendRow(input, m_inputCount);
+                }
+            }
+        }
+        bool sparse = gatherSparse && slot.m_sparseInputs.Rows() == size && slot.m_sparseInputs.Density(m_inputCount) <= m_maxSparseDensity;
+
+        slot.m_batch.m_inputs = gatherDense ? slot.m_inputs.data() : nullptr;
+        slot.m_batch.m_sparseInputs = sparse ? &slot.m_sparseInputs : nullptr;
+        slot.m_batch.m_labels = slot.m_labels.data();
+        slot.m_batch.m_size = size;
+        slot.m_batch.m_firstItem = firstItem;
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stats.m_gatherSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    void ProducerLoop (size_t threadIndex)
+    {
+        for (size_t batchIndex = threadIndex; batchIndex < m_batchCount; batchIndex += m_threadCount)
+        {
+            Slot& slot = m_slots[batchIndex % m_slots.size()];
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_freeCondition.wait(lock, [&] () { return m_stop || (slot.m_batchIndex == batchIndex && !slot.m_ready); });
+                if (m_stop)
+                    return;
+            }
+
+            Gather(slot, batchIndex);
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                slot.m_ready = true;
+            }
+            m_readyCondition.notify_one();
+        }
+    }
+
+    // The consumer is done with a batch, its slot can take the batch that is m_slots.size() batches later
+    void ReleaseSlot (size_t batchIndex)
+    {
+        Slot& slot = m_slots[batchIndex % m_slots.size()];
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            slot.m_ready = false;
+            slot.m_batchIndex = batchIndex + m_slots.size();
+        }
+        m_freeCondition.notify_all();
+    }
+
+private:
+
+    const size_t                            m_threadCount;
+    InputTransform                          m_transform;
+    float                                   m_maxSparseDensity = 0.0f;
+
+    // The current pass over the data
+    const MNISTData*                        m_data = nullptr;
+    const size_t*                           m_order = nullptr;
+    size_t                                  m_count = 0;
+    size_t                                  m_batchSize = 0;
+    size_t                                  m_inputCount = 0;
+    size_t                                  m_batchCount = 0;
+    size_t                                  m_nextBatch = 0;
+
+    std::vector<Slot>                       m_slots;
+    std::vector<std::thread>                m_threads;
+    std::mutex                              m_mutex;
+    std::condition_variable                 m_readyCondition;
+    std::condition_variable                 m_freeCondition;
+    bool                                    m_stop = false;
+
+    PrefetchStats                           m_stats;
+    std::chrono::steady_clock::time_point   m_start;
+};
@@ -0,0 +1,489 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <random>
+#include <string>
+#include <vector>
+#include "neural_network.h"
+#include "latency_histogram.h"
+
+/* Measures the hot paths of training and inference on synthetic data with fixed seeds, so it runs without the MNIST files:
+
+    benchmark [--quick] [--filter <text>] [--threads <n>] [--json <file>] [--baseline <file>] [--tolerance <percent>]
+
+Every benchmark calls its operation repeatedly for a fixed time and records the latency of every call. The forward and
+backward passes run for several hidden layer and batch sizes; the gradient accumulation and the weight update (plain,
+with momentum and with Adam) run over the whole parameter arena, loading and gathering over a synthetic dataset and the
+epoch benchmarks train on it, synchronously and with Hogwild updates. The -sparse passes get the batches as their
+nonzero pixels (see SparseRows), like training does.
+
+--json writes the results in a format that --baseline reads back. With --baseline every benchmark is compared with the
+stored throughput, the exit code is 5 if one of them got slower by more than --tolerance percent (default 10).
+--filter only runs the benchmarks whose name contains the text, --threads trains the epochs on a thread pool.
+
+Before measuring anything, the sharded training is checked on a minibatch size that does not divide the image count
+(see CheckShortMinibatches()), the exit code is 6 if that fails. */
+
+typedef std::chrono::steady_clock Clock;
+
+const char* c_benchmarkImagesFileName = "benchmark-images.idx3-ubyte";
+const char* c_benchmarkLabelsFileName = "benchmark-labels.idx1-ubyte";
+
+const uint32_t c_benchmarkSeed = 1;
+
+// The shapes that are benchmarked, the batch sizes cover single inference up to large evaluation blocks
+const char* c_benchmarkTopologies[] = { "785-30-10", "785-100-10", "785-300-10" };
+const size_t c_benchmarkBatchSizes[] = { 1, 10, 64, 256 };
+
+struct Options
+{
+    bool m_quick = false;
+    const char* m_filter = nullptr;
+    size_t m_threads = 1;
+    const char* m_jsonFileName = nullptr;
+    const char* m_baselineFileName = nullptr;
+    double m_tolerance = 10.0;
+};
+
+struct BenchmarkResult
+{
+    std::string m_name;
+
+    // What the throughput counts: images or parameters
+    std::string m_unit;
+    uint64_t m_calls = 0;
+    double m_throughput = 0.0;
+    double m_meanMicroseconds = 0.0;
+    double m_p50Microseconds = 0.0;
+    double m_p90Microseconds = 0.0;
+    double m_p99Microseconds = 0.0;
+};
+
+Options g_options;
+std::vector<BenchmarkResult> g_results;
+
+/* Runs the private batch passes of a network on a workspace of its own. The network does not change
+except for the weight update, which uses a learning rate too small to matter */
+class NetworkBenchmark
+{
+public:
+    NetworkBenchmark (NeuralNetwork& network, size_t batchSize)
+        : m_network(network)
+    {
+        m_workspace.Resize(network, batchSize, true);
+        m_shard.Resize(network, batchSize, true);
+    }
+
+    void Forward (const float* inputs, size_t batchSize)
+    {
+        m_network.ForwardBatch(m_workspace, inputs, batchSize);
+    }
+
+    void Backward (const float* inputs, const uint8_t* labels, size_t batchSize)
+    {
+        m_network.BackwardBatch(m_workspace, inputs, labels, batchSize);
+    }
+
+    // The passes on the nonzero inputs only, the backward pass needs the first layer in its training layout
+    void ForwardSparse (const SparseRows& inputs, size_t batchSize)
+    {
+        m_network.ForwardBatch(m_workspace, nullptr, batchSize, &inputs);
+    }
+
+    void BackwardSparse (const SparseRows& inputs, const uint8_t* labels, size_t batchSize)
+    {
+        m_network.BackwardBatch(m_workspace, nullptr, labels, batchSize, &inputs);
+    }
+
+    void BeginTrainingLayout () { m_network.BeginTrainingLayout(); }
+    void EndTrainingLayout () { m_network.EndTrainingLayout(); }
+
+    // Adds the derivatives of a second shard, one step of the reduction of a minibatch
+    void Accumulate ()
+    {
+        m_workspace.AddDerivatives(m_shard);
+    }
+
+    void Update ()
+    {
+        MultiplyAdd(m_network.m_parameters.data(), -1e-12f, m_workspace.m_gradients.data(), m_network.m_parameters.size());
+    }
+
+    // The same update as one fused pass of an optimizer with state
+    void Update (Optimizer& optimizer)
+    {
+        optimizer.Step(m_network.m_parameters.data(), m_workspace.m_gradients.data(), 1, 1e-12f);
+    }
+
+    size_t ParameterCount () const { return m_network.m_parameters.size(); }
+
+private:
+    NeuralNetwork& m_network;
+    NeuralNetwork::Workspace m_workspace;
+    NeuralNetwork::Workspace m_shard;
+};
+
+bool Selected (const std::string& name)
+{
+    return !g_options.m_filter || name.find(g_options.m_filter) != std::string::npos;
+}
+
+/* Calls the operation until the time is up (and at least a few times), after one call to warm up.
+itemsPerCall is the number of images or parameters one call processes */
+template <typename FUNCTION>
+void Measure (const std::string& name, const char* unit, double itemsPerCall, const FUNCTION& operation)
+{
+    if (!Selected(name))
+        return;
+
+    const double seconds = g_options.m_quick ? 0.05 : 0.25;
+    const uint64_t minCalls = 3;
+
+    operation();
+
+    LatencyHistogram latencies;
+    Clock::time_point start = Clock::now();
+    Clock::time_point end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+    Clock::time_point now = start;
+    while (now < end || latencies.Count() < minCalls)
+    {
+        operation();
+        Clock::time_point done = Clock::now();
+        latencies.Record(done - now);
+        now = done;
+    }
+    double elapsed = std::chrono::duration<double>(now - start).count();
+
+    BenchmarkResult result;
+    result.m_name = name;
+    result.m_unit = unit;
+    result.m_calls = latencies.Count();
+    result.m_throughput = itemsPerCall * double(latencies.Count()) / elapsed;
+    result.m_meanMicroseconds = latencies.Mean() / 1000.0;
+    result.m_p50Microseconds = double(latencies.Percentile(0.50)) / 1000.0;
+    result.m_p90Microseconds = double(latencies.Percentile(0.90)) / 1000.0;
+    result.m_p99Microseconds = double(latencies.Percentile(0.99)) / 1000.0;
+    g_results.push_back(result);
+
+    printf("%-36s %14.0f %-10s %10.2f %10.2f %10.2f %10.2f\n", name.c_str(), result.m_throughput, unit,
+        result.m_meanMicroseconds, result.m_p50Microseconds, result.m_p90Microseconds, result.m_p99Microseconds);
+    fflush(stdout);
+}
+
+// Writes an IDX image and label file pair with random digits, about a fifth of the pixels are ink like in MNIST
+bool WriteSyntheticData (size_t imageCount)
+{
+    std::mt19937 random(c_benchmarkSeed);
+    std::uniform_int_distribution<int> ink(1, 255);
+    std::uniform_int_distribution<int> label(0, 9);
+    std::bernoulli_distribution isInk(0.2);
+
+    auto writeHeader = [] (FILE* file, uint32_t magic, const std::vector<uint32_t>& sizes)
+    {
+        std::vector<uint32_t> header(1, magic);
+        header.insert(header.end(), sizes.begin(), sizes.end());
+        for (uint32_t value : header)
+        {
+            uint8_t bytes[4] = { uint8_t(value >> 24), uint8_t(value >> 16), uint8_t(value >> 8), uint8_t(value) };
+            fwrite(bytes, 1, 4, file);
+        }
+    };
+
+    FILE* images = fopen(c_benchmarkImagesFileName, "wb");
+    FILE* labels = fopen(c_benchmarkLabelsFileName, "wb");
+    bool ok = images && labels;
+    if (ok)
+    {
+        writeHeader(images, 0x00000803, { uint32_t(imageCount), 28, 28 });
+        writeHeader(labels, 0x00000801, { uint32_t(imageCount) });
+
+        std::vector<uint8_t> pixels(28 * 28);
+        for (size_t imageIndex = 0; imageIndex < imageCount; ++imageIndex)
+        {
+            for (uint8_t& pixel : pixels)
+                pixel = isInk(random) ? uint8_t(ink(random)) : 0;
+            uint8_t digit = uint8_t(label(random));
+            ok &= fwrite(pixels.data(), 1, pixels.size(), images) == pixels.size();
+            ok &= fwrite(&digit, 1, 1, labels) == 1;
+        }
+    }
+    if (images)
+        fclose(images);
+    if (labels)
+        fclose(labels);
+    return ok;
+}
+
+/* Trains a few images whose count leaves a short last minibatch, on more threads than a minibatch has shards. The last
+minibatch is then split into fewer and larger shards than the full ones. Splitting must not change the result beyond
+the rounding of the sums, with the sparse and the dense first layer. A build with -fsanitize=address also catches a
+shard that outgrows its workspace */
+bool CheckShortMinibatches ()
+{
+    const size_t imageCount = 17;
+    const size_t miniBatchSize = 10;
+    MNISTData data;
+    if (!data.AddFiles(c_benchmarkImagesFileName, c_benchmarkLabelsFileName, 0, imageCount))
+        return false;
+
+    NetworkTopology topology;
+    topology.Parse(c_benchmarkTopologies[0]);
+    ThreadPool threadPool(8);
+    for (bool sparseInputs : { true, false })
+    {
+        NeuralNetwork single(topology, c_benchmarkSeed);
+        NeuralNetwork sharded(topology, c_benchmarkSeed);
+        sharded.SetThreadPool(&threadPool);
+        for (NeuralNetwork* network : { &single, &sharded })
+        {
+            network->SetSparseInputs(sparseInputs);
+            network->Train(data, miniBatchSize, 0.1f);
+        }
+
+        float maxDifference = 0.0f;
+        for (size_t i = 0; i < single.Parameters().size(); ++i)
+            maxDifference = std::max(maxDifference, std::abs(single.Parameters()[i] - sharded.Parameters()[i]));
+        if (maxDifference > 1e-4f || sharded.TrainingStatistics().m_items != imageCount)
+        {
+            printf("Training %zu images in minibatches of %zu on %zu threads (%s inputs) differs from one thread by %g!\n",
+                imageCount, miniBatchSize, threadPool.ThreadCount(), sparseInputs ? "sparse" : "dense", maxDifference);
+            return false;
+        }
+    }
+    return true;
+}
+
+void BenchmarkNetworks (const MNISTData& data)
+{
+    ThreadPool threadPool(g_options.m_threads);
+
+    // The epochs train on the first part of the dataset only, so the slow networks still get a few measurements
+    MNISTData epochData;
+    epochData.AddFiles(c_benchmarkImagesFileName, c_benchmarkLabelsFileName, 0, g_options.m_quick ? 2000 : 10000);
+
+    for (const char* topologyText : c_benchmarkTopologies)
+    {
+        NetworkTopology topology;
+        topology.Parse(topologyText);
+        NeuralNetwork network(topology, c_benchmarkSeed);
+        const size_t inputs = network.Inputs();
+
+        for (size_t batchSize : c_benchmarkBatchSizes)
+        {
+            // The first images of the dataset as one [batch x inputs] matrix
+            std::vector<float> batchInputs(batchSize * inputs);
+            std::vector<uint8_t> labels(batchSize);
+            for (size_t batchIndex = 0; batchIndex < batchSize; ++batchIndex)
+                data.GetImage(batchIndex, &batchInputs[batchIndex * inputs], inputs, labels[batchIndex]);
+
+            NetworkBenchmark benchmark(network, batchSize);
+            std::string suffix = std::string("/") + topologyText + "/batch-" + std::to_string(batchSize);
+
+            Measure("forward" + suffix, "images", double(batchSize), [&] () { benchmark.Forward(batchInputs.data(), batchSize); });
+
+            // The backward pass works on the activations of the forward pass, which stay in the workspace
+            benchmark.Forward(batchInputs.data(), batchSize);
+            Measure("backward" + suffix, "images", double(batchSize), [&] () { benchmark.Backward(batchInputs.data(), labels.data(), batchSize); });
+
+            // The same batch as its nonzero pixels, which is how Train() and Evaluate() see the MNIST images
+            SparseRows sparseInputs;
+            for (size_t batchIndex = 0; batchIndex < batchSize; ++batchIndex)
+                sparseInputs.AppendRow(&batchInputs[batchIndex * inputs], inputs);
+            Measure("forward-sparse" + suffix, "images", double(batchSize), [&] () { benchmark.ForwardSparse(sparseInputs, batchSize); });
+
+            benchmark.BeginTrainingLayout();
+            benchmark.ForwardSparse(sparseInputs, batchSize);
+            Measure("backward-sparse" + suffix, "images", double(batchSize), [&] () { benchmark.BackwardSparse(sparseInputs, labels.data(), batchSize); });
+            benchmark.EndTrainingLayout();
+        }
+
+        NetworkBenchmark benchmark(network, 1);
+        std::string suffix = std::string("/") + topologyText;
+        Measure("accumulate" + suffix, "parameters", double(benchmark.ParameterCount()), [&] () { benchmark.Accumulate(); });
+        Measure("update" + suffix, "parameters", double(benchmark.ParameterCount()), [&] () { benchmark.Update(); });
+        for (OptimizerType type : { c_momentumOptimizer, c_adamOptimizer })
+        {
+            OptimizerSettings settings;
+            settings.m_type = type;
+            Optimizer optimizer;
+            optimizer.SetSettings(settings);
+            optimizer.Reset(benchmark.ParameterCount());
+            Measure(std::string("update-") + OptimizerName(type) + suffix, "parameters", double(benchmark.ParameterCount()), [&] () { benchmark.Update(optimizer); });
+        }
+
+        // One full epoch with the default minibatch size, including the shuffling and the prefetching
+        network.SetThreadPool(g_options.m_threads > 1 ? &threadPool : nullptr);
+        Measure("epoch" + suffix + "/batch-10", "images", double(epochData.NumImages()), [&] () { network.Train(epochData, 10, 0.1f); });
+
+        // The same epoch without the barrier per minibatch, every thread updates the parameters on its own
+        network.SetTrainingMode(c_hogwildTraining);
+        Measure("epoch-hogwild" + suffix, "images", double(epochData.NumImages()), [&] () { network.Train(epochData, 10, 0.1f); });
+        network.SetTrainingMode(c_synchronousTraining);
+    }
+}
+
+void BenchmarkData (size_t imageCount)
+{
+    Measure("load/" + std::to_string(imageCount), "images", double(imageCount), [&] ()
+    {
+        MNISTData data;
+        data.AddFiles(c_benchmarkImagesFileName, c_benchmarkLabelsFileName);
+    });
+
+    // Converts every image to float in a random order, what the minibatch gathering does in every epoch
+    MNISTData data;
+    data.AddFiles(c_benchmarkImagesFileName, c_benchmarkLabelsFileName);
+    std::vector<size_t> order(data.NumImages());
+    for (size_t i = 0; i < order.size(); ++i)
+        order[i] = i;
+    std::mt19937 random(c_benchmarkSeed);
+    std::shuffle(order.begin(), order.end(), random);
+
+    std::vector<float> input(785);
+    Measure("gather/" + std::to_string(imageCount), "images", double(imageCount), [&] ()
+    {
+        uint8_t label;
+        for (size_t imageIndex : order)
+            data.GetImage(imageIndex, input.data(), input.size(), label);
+    });
+}
+
+bool WriteJSON (const char* fileName)
+{
+    FILE* file = fopen(fileName, "wt");
+    if (!file)
+    {
+        printf("Could not open '%s' for writing!\n", fileName);
+        return false;
+    }
+
+    // One result per line, ReadBaseline() depends on that
+    fprintf(file, "{\n  \"simd\": \"%s\",\n  \"threads\": %zu,\n  \"quick\": %s,\n  \"results\": [\n", GetSimdKernels().m_name, g_options.m_threads, g_options.m_quick ? "true" : "false");
+    for (size_t i = 0; i < g_results.size(); ++i)
+    {
+        const BenchmarkResult& result = g_results[i];
+        fprintf(file, "    {\"name\": \"%s\", \"unit\": \"%s\", \"calls\": %llu, \"throughput\": %.1f, \"mean_us\": %.3f, \"p50_us\": %.3f, \"p90_us\": %.3f, \"p99_us\": %.3f}%s\n",
+            result.m_name.c_str(), result.m_unit.c_str(), (unsigned long long)result.m_calls, result.m_throughput,
+            result.m_meanMicroseconds, result.m_p50Microseconds, result.m_p90Microseconds, result.m_p99Microseconds,
+            i + 1 < g_results.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+    return true;
+}
+
+// Reads the names and throughputs of a file written by WriteJSON()
+bool ReadBaseline (const char* fileName, std::vector<BenchmarkResult>& baseline)
+{
+    FILE* file = fopen(fileName, "rt");
+    if (!file)
+    {
+        printf("Could not open the baseline '%s'!\n", fileName);
+        return false;
+    }
+
+    char line[1024];
+    while (fgets(line, sizeof(line), file))
+    {
+        char name[256];
+        char unit[32];
+        unsigned long long calls;
+        BenchmarkResult result;
+        if (sscanf(line, " {\"name\": \"%255[^\"]\", \"unit\": \"%31[^\"]\", \"calls\": %llu, \"throughput\": %lf", name, unit, &calls, &result.m_throughput) == 4)
+        {
+            result.m_name = name;
+            result.m_unit = unit;
+            result.m_calls = calls;
+            baseline.push_back(result);
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+// Prints the change of every benchmark against the baseline and returns the number of regressions
+size_t CompareWithBaseline (const std::vector<BenchmarkResult>& baseline)
+{
+    printf("\nComparison with '%s' (tolerance %0.1f%%):\n", g_options.m_baselineFileName, g_options.m_tolerance);
+    size_t regressions = 0;
+    for (const BenchmarkResult& result : g_results)
+    {
+        auto it = std::find_if(baseline.begin(), baseline.end(), [&] (const BenchmarkResult& stored) { return stored.m_name == result.m_name; });
+        if (it == baseline.end() || it->m_throughput <= 0.0)
+        {
+            printf("%-36s %14s\n", result.m_name.c_str(), "new");
+            continue;
+        }
+
+        double change = 100.0 * (result.m_throughput / it->m_throughput - 1.0);
+        bool regression = change < -g_options.m_tolerance;
+        regressions += regression;
+        printf("%-36s %+13.1f%%%s\n", result.m_name.c_str(), change, regression ? "  REGRESSION" : "");
+    }
+    return regressions;
+}
+
+int main (int argc, char** argv)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--quick") == 0)
+            g_options.m_quick = true;
+        else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+            g_options.m_filter = argv[++i];
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            g_options.m_threads = size_t(std::max(atol(argv[++i]), 1L));
+        else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+            g_options.m_jsonFileName = argv[++i];
+        else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc)
+            g_options.m_baselineFileName = argv[++i];
+        else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc)
+            g_options.m_tolerance = atof(argv[++i]);
+        else
+        {
+            printf("Unknown argument '%s'.\n", argv[i]);
+            return 1;
+        }
+    }
+
+    // Read the baseline first, so a wrong file name fails before the benchmarks ran
+    std::vector<BenchmarkResult> baseline;
+    if (g_options.m_baselineFileName && !ReadBaseline(g_options.m_baselineFileName, baseline))
+        return 2;
+
+    const size_t imageCount = g_options.m_quick ? 10000 : 60000;
+    if (!WriteSyntheticData(imageCount))
+    {
+        printf("Could not write the synthetic data!\n");
+        return 3;
+    }
+
+    MNISTData data;
+    if (!data.AddFiles(c_benchmarkImagesFileName, c_benchmarkLabelsFileName))
+        return 3;
+
+    if (!CheckShortMinibatches())
+    {
+        remove(c_benchmarkImagesFileName);
+        remove(c_benchmarkLabelsFileName);
+        return 6;
+    }
+
+    printf("%s kernels, %zu synthetic images, %zu training thread(s)\n\n", GetSimdKernels().m_name, imageCount, g_options.m_threads);
+    printf("%-36s %14s %-10s %10s %10s %10s %10s\n", "benchmark", "throughput", "per second", "mean us", "p50 us", "p90 us", "p99 us");
+
+    BenchmarkData(imageCount);
+    BenchmarkNetworks(data);
+
+    data.Clear();
+    remove(c_benchmarkImagesFileName);
+    remove(c_benchmarkLabelsFileName);
+
+    if (g_options.m_jsonFileName && !WriteJSON(g_options.m_jsonFileName))
+        return 4;
+
+    if (g_options.m_baselineFileName && CompareWithBaseline(baseline) > 0)
+    {
+        printf("\nSome benchmarks are slower than the baseline!\n");
+        return 5;
+    }
+    return 0;
+}
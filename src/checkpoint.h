@@ -0,0 +1,372 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "mapped_file.h"
+#include "simd_kernels.h"
+#include "layer_topology.h"
+
+/* Binary checkpoint of a trained network. The file is little-endian and laid out as:
+
+    CheckpointHeader (128 bytes)
+    CheckpointLayer table, one entry per layer
+    float32 parameter arena with packed rows (see ComputeLayout()), starting at a 64 byte aligned offset
+    optional float32 arena with the parameters of the best epoch so far (see CheckpointTraining), same layout,
+    at a 64 byte aligned offset
+    optional CheckpointOptimizer block at a 64 byte aligned offset, followed by the state of the optimizer
+    (its slots of parameter count floats each) at the next 64 byte aligned offset
+
+The arena is written with a single copy (the network packs its padded rows first, see CopyParameters()), and a mapped
+file can be used directly by the inference code without parsing or copying anything. The checksum covers everything after the header.
+Only files of c_checkpointVersion are read. */
+
+const uint32_t c_checkpointMagic = 0x4B43524E; // "NRCK"
+const uint32_t c_checkpointVersion = 4;
+const uint32_t c_checkpointFloat32 = 1;
+const size_t c_checkpointAlignment = 64;
+
+// Whether the training that wrote a checkpoint is still going on
+enum CheckpointTrainingState : uint32_t
+{
+    c_trainingRunning,
+    c_trainingFinished,
+    c_trainingStoppedEarly
+};
+
+/* The state of the training around the epochs, so that resuming a training neither starts the patience of EarlyStopping
+from zero nor trains past the end. Once the training ended, the parameter arena holds the parameters of m_bestEpoch */
+struct CheckpointTraining
+{
+    // CheckpointTrainingState
+    uint32_t m_state;
+
+    // The epoch with the lowest validation cost so far and its scores, 0 if nothing was validated yet
+    uint32_t m_bestEpoch;
+    float m_bestCost;
+    float m_bestAccuracy;
+    uint32_t m_epochsWithoutImprovement;
+};
+
+struct CheckpointHeader
+{
+    uint32_t m_magic;
+    uint32_t m_version;
+    uint32_t m_dataType;
+
+    // Topology of the network, the layers are described by the layer table
+    uint32_t m_inputs;
+    uint32_t m_layerCount;
+
+    // Training state, so that training can be resumed where it stopped
+    uint32_t m_seed;
+    uint32_t m_epoch;
+
+    // Byte offsets from the start of the file
+    uint32_t m_layerTableOffset;
+    uint32_t m_parametersOffset;
+
+    // 0 if the file has no optimizer state
+    uint32_t m_optimizerOffset;
+
+    uint64_t m_parameterCount;
+    uint64_t m_fileSize;
+    uint64_t m_checksum;
+
+    CheckpointTraining m_training;
+
+    // 0 if the parameter arena holds the best parameters or nothing was validated yet
+    uint32_t m_bestParametersOffset;
+
+    uint32_t m_reserved[10];
+};
+static_assert(sizeof(CheckpointHeader) == 2 * c_checkpointAlignment, "The checkpoint header should fill exactly two alignment units");
+
+// One entry of the layer table, the offsets are in floats from the start of the parameter arena
+struct CheckpointLayer
+{
+    uint32_t m_neurons;
+    uint32_t m_activation;
+    uint32_t m_weightsOffset;
+    uint32_t m_biasesOffset;
+};
+
+// The state of the optimizer that trained the network, so that momentum and Adam resume where they stopped
+struct CheckpointOptimizer
+{
+    // OptimizerType, see optimizer.h
+    uint32_t m_type;
+
+    // The number of arrays of parameter count floats that follow the block
+    uint32_t m_stateSlots;
+
+    // The number of updates so far
+    uint64_t m_steps;
+};
+static_assert(sizeof(CheckpointOptimizer) <= c_checkpointAlignment, "The optimizer block should fit into one alignment unit");
+
+// 64 bit FNV-1a hash, used to detect damaged or truncated checkpoint files
+inline uint64_t CheckpointChecksum (const uint8_t* data, size_t size)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < size; ++i)
+        hash = (hash ^ data[i]) * 0x100000001b3ull;
+    return hash;
+}
+
+inline size_t AlignCheckpointOffset (size_t offset)
+{
+    return (offset + c_checkpointAlignment - 1) / c_checkpointAlignment * c_checkpointAlignment;
+}
+
+/* Writes the topology, the training state and the parameter arena in the packed layout of ComputeLayout() to a file, and with
+an optimizer block its m_stateSlots arrays in optimizerState. bestParameters is an arena of the same layout, only needed
+while the training runs and the best epoch is not the current one. The file is first written under a temporary name and
+then renamed, so a crash while saving never destroys the previous checkpoint */
+inline bool WriteCheckpoint (const char* fileName, const NetworkTopology& topology, uint32_t seed, uint32_t epoch, const float* parameters, size_t parameterCount,
+                             const CheckpointOptimizer* optimizer = nullptr, const float* optimizerState = nullptr,
+                             const CheckpointTraining* training = nullptr, const float* bestParameters = nullptr)
+{
+    std::vector<LayerLayout> layout;
+    if (ComputeLayout(topology, layout, false) != parameterCount)
+    {
+        printf("The parameters do not match the topology %s.\n", topology.ToString().c_str());
+        return false;
+    }
+
+    CheckpointHeader header = {};
+    header.m_magic = c_checkpointMagic;
+    header.m_version = c_checkpointVersion;
+    header.m_dataType = c_checkpointFloat32;
+    header.m_inputs = uint32_t(topology.m_inputs);
+    header.m_layerCount = uint32_t(layout.size());
+    header.m_seed = seed;
+    header.m_epoch = epoch;
+    header.m_layerTableOffset = uint32_t(sizeof(CheckpointHeader));
+    size_t tableEnd = sizeof(CheckpointHeader) + layout.size() * sizeof(CheckpointLayer);
+    header.m_parametersOffset = uint32_t(AlignCheckpointOffset(tableEnd));
+    header.m_parameterCount = parameterCount;
+    if (training)
+        header.m_training = *training;
+    size_t fileSize = header.m_parametersOffset + parameterCount * sizeof(float);
+    if (bestParameters)
+    {
+        header.m_bestParametersOffset = uint32_t(AlignCheckpointOffset(fileSize));
+        fileSize = header.m_bestParametersOffset + parameterCount * sizeof(float);
+    }
+    if (optimizer)
+    {
+        header.m_optimizerOffset = uint32_t(AlignCheckpointOffset(fileSize));
+        fileSize = header.m_optimizerOffset + c_checkpointAlignment + optimizer->m_stateSlots * parameterCount * sizeof(float);
+    }
+
+    // Build the whole file in memory, it is only as large as the network and the state of its optimizer
+    std::vector<uint8_t> file(fileSize, 0);
+    for (size_t layerIndex = 0; layerIndex < layout.size(); ++layerIndex)
+    {
+        CheckpointLayer layer;
+        layer.m_neurons = uint32_t(layout[layerIndex].m_neurons);
+        layer.m_activation = uint32_t(layout[layerIndex].m_activation);
+        layer.m_weightsOffset = uint32_t(layout[layerIndex].m_weightsOffset);
+        layer.m_biasesOffset = uint32_t(layout[layerIndex].m_biasesOffset);
+        memcpy(&file[header.m_layerTableOffset + layerIndex * sizeof(CheckpointLayer)], &layer, sizeof(CheckpointLayer));
+    }
+    memcpy(&file[header.m_parametersOffset], parameters, parameterCount * sizeof(float));
+    if (bestParameters)
+        memcpy(&file[header.m_bestParametersOffset], bestParameters, parameterCount * sizeof(float));
+    if (optimizer)
+    {
+        memcpy(&file[header.m_optimizerOffset], optimizer, sizeof(CheckpointOptimizer));
+        if (optimizer->m_stateSlots > 0)
+            memcpy(&file[header.m_optimizerOffset + c_checkpointAlignment], optimizerState, optimizer->m_stateSlots * parameterCount * sizeof(float));
+    }
+
+    header.m_fileSize = file.size();
+    header.m_checksum = CheckpointChecksum(&file[sizeof(CheckpointHeader)], file.size() - sizeof(CheckpointHeader));
+    memcpy(&file[0], &header, sizeof(CheckpointHeader));
+
+    std::string temporaryFileName = std::string(fileName) + ".tmp";
+    FILE* out = fopen(temporaryFileName.c_str(), "wb");
+    if (!out)
+    {
+        printf("Could not open %s for writing.\n", temporaryFileName.c_str());
+        return false;
+    }
+    bool written = fwrite(file.data(), file.size(), 1, out) == 1;
+    written = (fclose(out) == 0) && written;
+    if (!written)
+    {
+        printf("Could not write %s.\n", temporaryFileName.c_str());
+        remove(temporaryFileName.c_str());
+        return false;
+    }
+
+#ifdef _WIN32
+    // rename() does not replace an existing file on Windows
+    remove(fileName);
+#endif
+    if (rename(temporaryFileName.c_str(), fileName) != 0)
+    {
+        printf("Could not rename %s to %s.\n", temporaryFileName.c_str(), fileName);
+        return false;
+    }
+    return true;
+}
+
+/* A checkpoint file mapped into memory. After Open() succeeded, the weights and biases of every layer can be used
+in place, and Classify() runs the network straight on the mapped parameters */
+class CheckpointFile
+{
+public:
+    // Verifying the checksum touches every page of the file, inference processes that trust the file can skip it
+    bool Open (const char* fileName, bool verifyChecksum = true)
+    {
+        if (!m_file.Open(fileName))
+        {
+            printf("Could not open %s for reading.\n", fileName);
+            return false;
+        }
+
+        if (m_file.Size() < sizeof(CheckpointHeader))
+        {
+            printf("%s is too small to be a checkpoint.\n", fileName);
+            return false;
+        }
+        memcpy(&m_header, m_file.Data(), sizeof(CheckpointHeader));
+
+        if (m_header.m_magic != c_checkpointMagic || m_header.m_version != c_checkpointVersion || m_header.m_dataType != c_checkpointFloat32)
+        {
+            printf("%s is not a supported checkpoint file.\n", fileName);
+            return false;
+        }
+
+        if (m_header.m_fileSize != m_file.Size())
+        {
+            printf("%s has %zu bytes, the header expects %llu.\n", fileName, m_file.Size(), (unsigned long long)m_header.m_fileSize);
+            return false;
+        }
+
+        if (!ReadLayerTable())
+        {
+            printf("%s contains an invalid layer table or offset.\n", fileName);
+            return false;
+        }
+
+        if (verifyChecksum && CheckpointChecksum(m_file.Data() + sizeof(CheckpointHeader), m_file.Size() - sizeof(CheckpointHeader)) != m_header.m_checksum)
+        {
+            printf("The checksum of %s does not match, the file is damaged.\n", fileName);
+            return false;
+        }
+        return true;
+    }
+
+    const NetworkTopology& Topology () const { return m_topology; }
+    uint32_t Seed () const { return m_header.m_seed; }
+    uint32_t Epoch () const { return m_header.m_epoch; }
+    const CheckpointTraining& Training () const { return m_header.m_training; }
+
+    // The packed arena of the best epoch, only if HasBestParameters()
+    bool HasBestParameters () const { return m_header.m_bestParametersOffset != 0; }
+    const float* BestParameters () const { return (const float*)(m_file.Data() + m_header.m_bestParametersOffset); }
+
+    // The state of the optimizer, only if HasOptimizerState()
+    bool HasOptimizerState () const { return m_header.m_optimizerOffset != 0; }
+    const CheckpointOptimizer& Optimizer () const { return m_optimizer; }
+    const float* OptimizerState (size_t slot) const
+    {
+        return (const float*)(m_file.Data() + m_header.m_optimizerOffset + c_checkpointAlignment) + slot * m_header.m_parameterCount;
+    }
+
+    // The [neurons x inputs] weights and the biases of a layer
+    const float* Weights (size_t layerIndex) const { return (const float*)(m_file.Data() + m_weightsOffsets[layerIndex]); }
+    const float* Biases (size_t layerIndex) const { return (const float*)(m_file.Data() + m_biasesOffsets[layerIndex]); }
+    size_t LayerInputs (size_t layerIndex) const { return layerIndex == 0 ? m_topology.m_inputs : m_topology.m_layers[layerIndex - 1].m_neurons; }
+
+    /* Evaluates the network for input values (Topology().m_inputs of them) and returns the detected label.
+    outputs receives the activations of the last layer. Can be called from several threads at once */
+    uint8_t Classify (const float* input, float* outputs) const
+    {
+        const SimdKernels& kernels = GetSimdKernels();
+        thread_local std::vector<float> layerInputs;
+        thread_local std::vector<float> layerOutputs;
+        layerInputs.assign(input, input + m_topology.m_inputs);
+
+        for (size_t layerIndex = 0; layerIndex < m_topology.m_layers.size(); ++layerIndex)
+        {
+            const LayerTopology& layer = m_topology.m_layers[layerIndex];
+            const float* weights = Weights(layerIndex);
+            size_t inputs = LayerInputs(layerIndex);
+
+            layerOutputs.resize(layer.m_neurons);
+            for (size_t neuronIndex = 0; neuronIndex < layer.m_neurons; ++neuronIndex)
+                layerOutputs[neuronIndex] = kernels.DotProduct(layerInputs.data(), weights + neuronIndex * inputs, inputs);
+            ApplyActivation(layer.m_activation, layerOutputs.data(), Biases(layerIndex), layer.m_neurons);
+            std::swap(layerInputs, layerOutputs);
+        }
+
+        std::copy(layerInputs.begin(), layerInputs.end(), outputs);
+        return uint8_t(std::max_element(layerInputs.begin(), layerInputs.end()) - layerInputs.begin());
+    }
+
+private:
+
+    bool ReadLayerTable ()
+    {
+        size_t tableEnd = size_t(m_header.m_layerTableOffset) + size_t(m_header.m_layerCount) * sizeof(CheckpointLayer);
+        size_t parametersEnd = size_t(m_header.m_parametersOffset) + m_header.m_parameterCount * sizeof(float);
+        if (m_header.m_layerCount == 0 || m_header.m_training.m_state > c_trainingStoppedEarly || tableEnd > m_file.Size() || m_header.m_parametersOffset % c_checkpointAlignment != 0 || parametersEnd > m_file.Size())
+            return false;
+
+        m_topology.m_inputs = m_header.m_inputs;
+        m_topology.m_layers.resize(m_header.m_layerCount);
+        m_weightsOffsets.resize(m_header.m_layerCount);
+        m_biasesOffsets.resize(m_header.m_layerCount);
+        for (size_t layerIndex = 0; layerIndex < m_header.m_layerCount; ++layerIndex)
+        {
+            CheckpointLayer layer;
+            memcpy(&layer, m_file.Data() + m_header.m_layerTableOffset + layerIndex * sizeof(CheckpointLayer), sizeof(CheckpointLayer));
+            m_topology.m_layers[layerIndex].m_neurons = layer.m_neurons;
+            m_topology.m_layers[layerIndex].m_activation = ActivationFunction(std::min<uint32_t>(layer.m_activation, c_activationFunctionCount));
+
+            size_t weightCount = size_t(layer.m_neurons) * LayerInputs(layerIndex);
+            if (layer.m_weightsOffset + weightCount > m_header.m_parameterCount || layer.m_biasesOffset + size_t(layer.m_neurons) > m_header.m_parameterCount)
+                return false;
+            m_weightsOffsets[layerIndex] = m_header.m_parametersOffset + size_t(layer.m_weightsOffset) * sizeof(float);
+            m_biasesOffsets[layerIndex] = m_header.m_parametersOffset + size_t(layer.m_biasesOffset) * sizeof(float);
+        }
+
+        if (HasBestParameters())
+        {
+            if (m_header.m_bestParametersOffset % c_checkpointAlignment != 0 || m_header.m_bestParametersOffset < parametersEnd)
+                return false;
+            parametersEnd = size_t(m_header.m_bestParametersOffset) + m_header.m_parameterCount * sizeof(float);
+            if (parametersEnd > m_file.Size())
+                return false;
+        }
+
+        if (HasOptimizerState())
+        {
+            if (m_header.m_optimizerOffset % c_checkpointAlignment != 0 || m_header.m_optimizerOffset < parametersEnd || m_header.m_optimizerOffset + c_checkpointAlignment > m_file.Size())
+                return false;
+            memcpy(&m_optimizer, m_file.Data() + m_header.m_optimizerOffset, sizeof(CheckpointOptimizer));
+            size_t stateEnd = m_header.m_optimizerOffset + c_checkpointAlignment + size_t(m_optimizer.m_stateSlots) * m_header.m_parameterCount * sizeof(float);
+            if (m_optimizer.m_stateSlots > 2 || stateEnd > m_file.Size())
+                return false;
+        }
+        return m_topology.IsValid();
+    }
+
+private:
+
+    MappedFile m_file;
+    CheckpointHeader m_header = {};
+    CheckpointOptimizer m_optimizer = {};
+    NetworkTopology m_topology;
+
+    // Byte offsets of the weights and biases of every layer from the start of the file
+    std::vector<size_t> m_weightsOffsets;
+    std::vector<size_t> m_biasesOffsets;
+};
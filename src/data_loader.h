@@ -2,126 +2,320 @@
 
 #include <cstdio>
 #include <cstdint>
+#include <cstring>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include "mapped_file.h"
+#include "sparse_rows.h"
 
-/* Used to change the byte order. E.g., if the first two uint32_t values are 0x01080000 or 0x03080000.
-The Inline specifier improves program performance by reducing the overhead of function calls and increasing execution speed. */
-inline uint32_t EndianSwap (uint32_t a)
+/* The IDX header values are stored as big-endian uint32 values. E.g., the first uint32 value of a label file is 0x00000801.
+Reading them byte by byte works on any CPU and leaves the mapped file untouched. */
+inline uint32_t ReadBigEndian (const uint8_t* data)
 {
-    return (a<<24) | ((a<<8) & 0x00ff0000) |
-           ((a>>8) & 0x0000ff00) | (a>>24);
+    return (uint32_t(data[0]) << 24) | (uint32_t(data[1]) << 16) |
+           (uint32_t(data[2]) << 8) | uint32_t(data[3]);
 }
  
+/* The header of an IDX file. It starts with the magic number: two zero bytes, the data type (0x08 for uint8)
+and the number of dimensions. One big-endian uint32 per dimension follows, the first one is the item count.
+Label files have one dimension, image files have three (count, rows and columns). */
+struct IDXHeader
+{
+    size_t m_headerSize = 0;
+    size_t m_count = 0;
+    size_t m_rows = 1;
+    size_t m_columns = 1;
+
+    size_t ItemSize () const { return m_rows * m_columns; }
+};
+
+inline bool ReadIDXHeader (const uint8_t* data, size_t size, size_t dimensions, IDXHeader& header)
+{
+    if (size < 4 || data[0] != 0 || data[1] != 0 || data[2] != 0x08 || data[3] != dimensions)
+        return false;
+
+    header.m_headerSize = 4 + 4 * dimensions;
+    if (size < header.m_headerSize)
+        return false;
+
+    header.m_count = ReadBigEndian(data + 4);
+    if (dimensions > 1)
+        header.m_rows = ReadBigEndian(data + 8);
+    if (dimensions > 2)
+        header.m_columns = ReadBigEndian(data + 12);
+    return true;
+}
+
+/* A dataset of labeled uint8 images in IDX format (MNIST, EMNIST, Fashion-MNIST, ...). The image dimensions
+and counts are taken from the file headers. Several pairs of image and label files can be stacked into one dataset.
+
+The files are mapped into memory read-only. The pixels stay uint8 values in the mapped files and are only
+converted to float when an image is requested, see GetImage(). The OS pages the files in and out as needed,
+so the datasets can be much larger than the available memory */
 class MNISTData
 {
 public:
-    MNISTData ()
+    // Loads the standard MNIST training or test files from the working directory
+    bool Load (bool training)
     {
-        m_labelData = nullptr;
-        m_imageData = nullptr;
-        m_imageCount = 0;
-        m_labels = nullptr;
-        m_pixels = nullptr;
+        const char* imagesFileName = training ? "train-images.idx3-ubyte" : "t10k-images.idx3-ubyte";
+        const char* labelsFileName = training ? "train-labels.idx1-ubyte" : "t10k-labels.idx1-ubyte";
+
+        Clear();
+        return AddFiles(imagesFileName, labelsFileName);
     }
  
-    bool Load (bool training)
+    /* Maps an image file and the matching label file and appends their images to the dataset. All stacked files need the
+    same image dimensions. firstImage and imageCount select a range of the files, so one file pair can be split
+    between several processes */
+    bool AddFiles (const char* imagesFileName, const char* labelsFileName, size_t firstImage = 0, size_t imageCount = SIZE_MAX)
     {
-        // Set the expected image count
-        m_imageCount = training ? 60000 : 10000;
+        Shard shard;
+        shard.m_labelFile = std::make_shared<MappedFile>();
+        shard.m_imageFile = std::make_shared<MappedFile>();
  
-        // Read labels
-        const char* labelsFileName = training ? "train-labels.idx1-ubyte" : "t10k-labels.idx1-ubyte";
-        FILE* file = fopen(labelsFileName,"rb");
-        if (!file)
+        // Map labels
+        if (!shard.m_labelFile->Open(labelsFileName))
         {
             printf("Could not open %s for reading.\n", labelsFileName);
             return false;
         }
-        fseek(file, 0, SEEK_END);
-        long fileSize = ftell(file);
-        fseek(file, 0, SEEK_SET);
-        m_labelData = new uint8_t[fileSize];
-        fread(m_labelData, fileSize, 1, file);
-        fclose(file);
  
-        // Read images
-        const char* imagesFileName = training ? "train-images.idx3-ubyte" : "t10k-images.idx3-ubyte";
-        file = fopen(imagesFileName, "rb");
-        if (!file)
+        // Map images
+        if (!shard.m_imageFile->Open(imagesFileName))
         {
             printf("Could not open %s for reading.\n", imagesFileName);
             return false;
         }
-        fseek(file, 0, SEEK_END);
-        fileSize = ftell(file);
-        fseek(file, 0, SEEK_SET);
-        m_imageData = new uint8_t[fileSize];
-        fread(m_imageData, fileSize, 1, file);
-        fclose(file);
  
-        /* Perform endian swapping on the label file's first two uint32 values if required,
-        while the rest of the file contains uint8 values. */ 
-        uint32_t* data = (uint32_t*)m_labelData;
-        if (data[0] == 0x01080000)
+        // Verifying if the label file has the right header and size
+        IDXHeader labelHeader;
+        if (!ReadIDXHeader(shard.m_labelFile->Data(), shard.m_labelFile->Size(), 1, labelHeader) ||
+            shard.m_labelFile->Size() < labelHeader.m_headerSize + labelHeader.m_count)
         {
-            data[0] = EndianSwap(data[0]);
-            data[1] = EndianSwap(data[1]);
+            printf("The label data in %s contains unexpected header values.\n", labelsFileName);
+            return false;
         }
  
-        // Verifying if the label file has the right header
-        if (data[0] != 2049 || data[1] != m_imageCount)
+        // Verifying if the image file has the right header and size
+        IDXHeader imageHeader;
+        if (!ReadIDXHeader(shard.m_imageFile->Data(), shard.m_imageFile->Size(), 3, imageHeader) ||
+            shard.m_imageFile->Size() < imageHeader.m_headerSize + imageHeader.m_count * imageHeader.ItemSize())
         {
-            printf("The label data contains unexpected header values.\n");
+            printf("The image data in %s contains unexpected header values.\n", imagesFileName);
             return false;
         }
-        m_labels = (uint8_t*)&(data[2]);
  
-        /* If necessary, perform endian swapping on the image file's first 
-        four uint32 values. The remaining data consists of uint8 values. */
-        data = (uint32_t*)m_imageData;
-        if (data[0] == 0x03080000)
+        if (labelHeader.m_count != imageHeader.m_count)
         {
-            data[0] = EndianSwap(data[0]);
-            data[1] = EndianSwap(data[1]);
-            data[2] = EndianSwap(data[2]);
-            data[3] = EndianSwap(data[3]);
+            printf("%s has %zu labels for %zu images.\n", labelsFileName, labelHeader.m_count, imageHeader.m_count);
+            return false;
         }
- 
-        // Verifying if the image file has the right header
-        if (data[0] != 2051 || data[1] != m_imageCount || data[2] != 28 || data[3] != 28)
+
+        if (!m_shards.empty() && (imageHeader.m_rows != m_rows || imageHeader.m_columns != m_columns))
         {
-            printf("The label data contains unexpected header values.\n");
+            printf("The images in %s are %zux%zu, the dataset has %zux%zu images.\n", imagesFileName, imageHeader.m_rows, imageHeader.m_columns, m_rows, m_columns);
             return false;
         }
-        m_pixels = (uint8_t*)&(data[4]);
- 
-        // Convert the pixels from uint8 to float
-        m_pixelsFloat.resize(m_imageCount * 28 * 28);
-        for (size_t i = 0; i < 28 * 28 * m_imageCount; ++i)
-            m_pixelsFloat[i] = float(m_pixels[i]) / 255.0f;
- 
+
+        if (firstImage > imageHeader.m_count)
+        {
+            printf("%s has only %zu images.\n", imagesFileName, imageHeader.m_count);
+            return false;
+        }
+        imageCount = std::min(imageCount, imageHeader.m_count - firstImage);
+
+        m_rows = imageHeader.m_rows;
+        m_columns = imageHeader.m_columns;
+
+        shard.m_firstImage = m_imageCount;
+        shard.m_labels = shard.m_labelFile->Data() + labelHeader.m_headerSize + firstImage;
+        shard.m_pixels = shard.m_imageFile->Data() + imageHeader.m_headerSize + firstImage * ImageSize();
+        m_shards.push_back(std::move(shard));
+
+        m_imageCount += imageCount;
         return true;
     }
  
-    ~MNISTData ()
+    /* Moves the last count images into another dataset, e.g. to hold out a validation split that is never trained on.
+    Both datasets share the mapped files, no image is copied */
+    bool SplitOff (size_t count, MNISTData& tail)
     {
-        delete[] m_labelData;
-        delete[] m_imageData;
+        if (count > m_imageCount || &tail == this)
+        {
+            printf("The dataset has %zu images, %zu of them cannot be split off.\n", m_imageCount, count);
+            return false;
+        }
+
+        size_t begin = m_imageCount - count;
+        tail.Clear();
+        tail.m_rows = m_rows;
+        tail.m_columns = m_columns;
+        for (size_t shardIndex = 0; shardIndex < m_shards.size(); ++shardIndex)
+        {
+            const Shard& shard = m_shards[shardIndex];
+            size_t shardEnd = shardIndex + 1 < m_shards.size() ? m_shards[shardIndex + 1].m_firstImage : m_imageCount;
+            if (shardEnd <= begin)
+                continue;
+
+            // The images of this shard that go to the tail, relative to the start of the shard
+            size_t first = std::max(begin, shard.m_firstImage) - shard.m_firstImage;
+            Shard part = shard;
+            part.m_firstImage = tail.m_imageCount;
+            part.m_labels += first;
+            part.m_pixels += first * ImageSize();
+            tail.m_shards.push_back(part);
+            tail.m_imageCount += shardEnd - shard.m_firstImage - first;
+        }
+
+        while (!m_shards.empty() && m_shards.back().m_firstImage >= begin)
+            m_shards.pop_back();
+        m_imageCount = begin;
+        return true;
     }
- 
+
+    void Clear ()
+    {
+        m_shards.clear();
+        m_imageCount = 0;
+        m_rows = 0;
+        m_columns = 0;
+    }
+
     size_t NumImages () const { return m_imageCount; }
+    size_t ImageRows () const { return m_rows; }
+    size_t ImageColumns () const { return m_columns; }
+    size_t ImageSize () const { return m_rows * m_columns; }
  
-    const float* GetImage (size_t index, uint8_t& label) const
+    // Returns the raw pixels of an image, 0 is the background and 255 the ink
+    const uint8_t* GetImage (size_t index, uint8_t& label) const
+    {
+        const Shard& shard = FindShard(index);
+        label = shard.m_labels[index];
+        return &shard.m_pixels[index * ImageSize()];
+    }
+
+    /* Converts the pixels of an image from uint8 to float in [0, 1] and writes them to destination, e.g. a row
+    of a minibatch matrix. If destinationSize is larger than the image, the remaining values are set to zero */
+    void GetImage (size_t index, float* destination, size_t destinationSize, uint8_t& label) const
+    {
+        const uint8_t* pixels = GetImage(index, label);
+        size_t count = std::min(destinationSize, ImageSize());
+        for (size_t i = 0; i < count; ++i)
+            destination[i] = float(pixels[i]) / 255.0f;
+        std::fill(destination + count, destination + destinationSize, 0.0f);
+    }
+
+    /* Appends the nonzero pixels of an image as one row to a sparse matrix, with the values GetImage() would produce.
+    The zero pixels are skipped in the uint8 data, they are never converted. Only the first inputCount pixels are used */
+    void GetSparseImage (size_t index, SparseRows& destination, size_t inputCount, uint8_t& label) const
     {
-        label = m_labels[index];
-        return &m_pixelsFloat[index * 28 * 28];
+        const uint8_t* pixels = GetImage(index, label);
+        size_t count = std::min(inputCount, ImageSize());
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (pixels[i] != 0)
+                destination.Add(uint32_t(i), float(pixels[i]) / 255.0f);
+        }
+        destination.EndRow();
     }
  
 private:
 
-    uint8_t* m_labelData;
-    uint8_t* m_imageData;
-    size_t m_imageCount;
-    uint8_t* m_labels;
-    uint8_t* m_pixels;
-    std::vector<float> m_pixelsFloat;
-};
\ No newline at end of file
+    // The images of one stacked file pair, m_firstImage is the dataset index of its first image. SplitOff() shares the files
+    struct Shard
+    {
+        std::shared_ptr<MappedFile> m_labelFile;
+        std::shared_ptr<MappedFile> m_imageFile;
+        size_t m_firstImage = 0;
+        const uint8_t* m_labels = nullptr;
+        const uint8_t* m_pixels = nullptr;
+    };
+
+    // Finds the shard that holds the image and turns the index into an index within the shard
+    const Shard& FindShard (size_t& index) const
+    {
+        if (m_shards.size() == 1)
+            return m_shards[0];
+
+        auto it = std::upper_bound(m_shards.begin(), m_shards.end(), index, [] (size_t value, const Shard& shard) { return value < shard.m_firstImage; });
+        const Shard& shard = *(it - 1);
+        index -= shard.m_firstImage;
+        return shard;
+    }
+
+private:
+
+    std::vector<Shard> m_shards;
+    size_t m_imageCount = 0;
+    size_t m_rows = 0;
+    size_t m_columns = 0;
+};
+
+/* The datasets given on the command line of a tool: the four paths <training images> <training labels> <test images>
+<test labels>, or an image and a label file after --training and --test. Both options can be repeated to stack several
+file pairs into one dataset, see MNISTData::AddFiles(). Without any of them the MNIST files are loaded */
+class DatasetArguments
+{
+public:
+    // Takes argv[i] and the values that follow it if they name dataset files, i is then at the last value
+    bool Parse (int argc, char** argv, int& i)
+    {
+        if ((strcmp(argv[i], "--training") == 0 || strcmp(argv[i], "--test") == 0) && i + 2 < argc)
+        {
+            std::vector<const char*>& fileNames = (strcmp(argv[i], "--training") == 0) ? m_trainingFileNames : m_testFileNames;
+            fileNames.push_back(argv[++i]);
+            fileNames.push_back(argv[++i]);
+            return true;
+        }
+        if (argv[i][0] == '-')
+            return false;
+        m_paths.push_back(argv[i]);
+        return true;
+    }
+
+    bool Load (MNISTData& training, MNISTData& test) const
+    {
+        std::vector<const char*> trainingFileNames = m_trainingFileNames;
+        std::vector<const char*> testFileNames = m_testFileNames;
+        if (m_paths.size() == 4)
+        {
+            trainingFileNames.insert(trainingFileNames.begin(), m_paths.begin(), m_paths.begin() + 2);
+            testFileNames.insert(testFileNames.begin(), m_paths.begin() + 2, m_paths.end());
+        }
+        else if (!m_paths.empty())
+        {
+            printf("Expected the four paths <training images> <training labels> <test images> <test labels>, not %zu.\n", m_paths.size());
+            return false;
+        }
+
+        if (trainingFileNames.empty() && testFileNames.empty())
+            return training.Load(true) && test.Load(false);
+        if (trainingFileNames.empty() || testFileNames.empty())
+        {
+            printf("Both training and test files are needed.\n");
+            return false;
+        }
+
+        training.Clear();
+        test.Clear();
+        return AddFilePairs(training, trainingFileNames) && AddFilePairs(test, testFileNames);
+    }
+
+private:
+
+    static bool AddFilePairs (MNISTData& data, const std::vector<const char*>& fileNames)
+    {
+        for (size_t i = 0; i + 1 < fileNames.size(); i += 2)
+        {
+            if (!data.AddFiles(fileNames[i], fileNames[i + 1]))
+                return false;
+        }
+        return true;
+    }
+
+    std::vector<const char*> m_paths;
+    std::vector<const char*> m_trainingFileNames;
+    std::vector<const char*> m_testFileNames;
+};
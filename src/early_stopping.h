@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "neural_network.h"
+
+/* Stops the training once the cost on a validation split has not improved for a number of epochs and keeps a copy of
+the parameters of the best epoch, so a network that started to overfit can be rolled back to it. The cost is watched
+rather than the accuracy: it still improves in small steps where the accuracy on a few thousand images only moves
+one image at a time */
+class EarlyStopping
+{
+public:
+    // A patience of 0 never stops the training, the best parameters are still kept
+    explicit EarlyStopping (size_t patience, float minImprovement = 0.0f)
+        : m_patience(patience)
+        , m_minImprovement(minImprovement)
+    {
+    }
+
+    /* Records the validation result of the epoch the network just finished. Returns true if the training should stop
+    because the best cost did not improve by more than minImprovement in the last patience epochs */
+    bool Update (const NeuralNetwork& network, const NeuralNetwork::Evaluation& validation)
+    {
+        if (!m_hasBest || validation.m_cost < m_bestCost - m_minImprovement)
+        {
+            m_hasBest = true;
+            m_bestCost = validation.m_cost;
+            m_bestAccuracy = validation.m_accuracy;
+            m_bestEpoch = network.Epoch();
+            m_bestParameters = network.Parameters();
+            m_epochsWithoutImprovement = 0;
+        }
+        else
+            ++m_epochsWithoutImprovement;
+        return m_patience > 0 && m_epochsWithoutImprovement >= m_patience;
+    }
+
+    // Puts the parameters of the best epoch back into the network, false if there are none or it still has them
+    bool RestoreBest (NeuralNetwork& network) const
+    {
+        if (!m_hasBest || m_bestEpoch == network.Epoch())
+            return false;
+        return network.SetParameters(m_bestParameters);
+    }
+
+    // The state to save with a checkpoint of the network, see NeuralNetwork::SaveCheckpoint()
+    CheckpointTraining CheckpointState (CheckpointTrainingState state) const
+    {
+        CheckpointTraining training = {};
+        training.m_state = state;
+        training.m_bestEpoch = m_hasBest ? m_bestEpoch : 0;
+        training.m_bestCost = m_bestCost;
+        training.m_bestAccuracy = m_bestAccuracy;
+        training.m_epochsWithoutImprovement = uint32_t(m_epochsWithoutImprovement);
+        return training;
+    }
+
+    // The best parameters if the network does not hold them, they have to go into its checkpoint as well
+    const AlignedVector<float>* CheckpointParameters (const NeuralNetwork& network) const
+    {
+        return (m_hasBest && m_bestEpoch != network.Epoch()) ? &m_bestParameters : nullptr;
+    }
+
+    /* Continues with the state that NeuralNetwork::LoadCheckpoint() read, bestParameters is empty when the network
+    itself holds the best parameters */
+    void Resume (const NeuralNetwork& network, const CheckpointTraining& training, const AlignedVector<float>& bestParameters)
+    {
+        m_hasBest = training.m_bestEpoch > 0;
+        m_bestEpoch = training.m_bestEpoch;
+        m_bestCost = training.m_bestCost;
+        m_bestAccuracy = training.m_bestAccuracy;
+        m_bestParameters = bestParameters.empty() ? network.Parameters() : bestParameters;
+        m_epochsWithoutImprovement = training.m_epochsWithoutImprovement;
+    }
+
+    bool HasBest () const { return m_hasBest; }
+    uint32_t BestEpoch () const { return m_bestEpoch; }
+    float BestCost () const { return m_bestCost; }
+    float BestAccuracy () const { return m_bestAccuracy; }
+    size_t EpochsWithoutImprovement () const { return m_epochsWithoutImprovement; }
+
+private:
+
+    const size_t         m_patience;
+    const float          m_minImprovement;
+
+    bool                 m_hasBest = false;
+    uint32_t             m_bestEpoch = 0;
+    float                m_bestCost = 0.0f;
+    float                m_bestAccuracy = 0.0f;
+    AlignedVector<float> m_bestParameters;
+    size_t               m_epochsWithoutImprovement = 0;
+};
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <stddef.h>
+#include <algorithm>
+#include "simd_kernels.h"
+
+/* Cache-blocked single precision matrix products used by the batched training engine.
+All matrices are row-major, "ld" is the distance (in floats) between the starts of two rows.
+When "accumulate" is false the destination matrix is overwritten, otherwise the product is added to it. */
+
+// Tile sizes are chosen so that one tile of each operand fits comfortably into L1/L2 cache
+const size_t c_gemmBlockK = 256;
+const size_t c_gemmBlockN = 16;
+const size_t c_gemmBlockColumns = 512;
+
+// The innermost loops run on the vectorized kernels selected for this CPU
+inline float DotProduct (const float* a, const float* b, size_t count)
+{
+    return GetSimdKernels().DotProduct(a, b, count);
+}
+
+// y += a * x
+inline void MultiplyAdd (float* y, float a, const float* x, size_t count)
+{
+    GetSimdKernels().MultiplyAdd(y, a, x, count);
+}
+
+// y += the sum of values[k] times row indices[k] of a matrix, see SimdKernels::SumScaledRows
+inline void SumScaledRows (float* y, size_t count, const float* rows, size_t stride, const uint32_t* indices, const float* values, size_t rowCount)
+{
+    GetSimdKernels().SumScaledRows(y, count, rows, stride, indices, values, rowCount);
+}
+
+// Row indices[k] of a matrix += values[k] * x, see SimdKernels::AddScaledRows
+inline void AddScaledRows (float* rows, size_t stride, const uint32_t* indices, const float* values, size_t rowCount, const float* x, size_t count)
+{
+    GetSimdKernels().AddScaledRows(rows, stride, indices, values, rowCount, x, count);
+}
+
+inline void ClearMatrix (size_t rows, size_t columns, float* C, size_t ldc)
+{
+    for (size_t i = 0; i < rows; ++i)
+        std::fill(C + i * ldc, C + i * ldc + columns, 0.0f);
+}
+
+/* C[M x N] = A[M x K] * B[N x K]^T
+Every element is a dot product of two contiguous rows, so this is used for the layer
+forward pass where B is the neuron-major weight matrix. */
+inline void GemmNT (size_t M, size_t N, size_t K, const float* A, size_t lda, const float* B, size_t ldb, float* C, size_t ldc, bool accumulate)
+{
+    if (!accumulate)
+        ClearMatrix(M, N, C, ldc);
+
+    for (size_t k0 = 0; k0 < K; k0 += c_gemmBlockK)
+    {
+        size_t kCount = std::min(c_gemmBlockK, K - k0);
+        for (size_t n0 = 0; n0 < N; n0 += c_gemmBlockN)
+        {
+            size_t nEnd = std::min(n0 + c_gemmBlockN, N);
+            for (size_t i = 0; i < M; ++i)
+            {
+                const float* rowA = A + i * lda + k0;
+                float* rowC = C + i * ldc;
+                for (size_t j = n0; j < nEnd; ++j)
+                    rowC[j] += DotProduct(rowA, B + j * ldb + k0, kCount);
+            }
+        }
+    }
+}
+
+/* C[M x N] = A[M x K] * B[K x N]
+Each row of C is built from scaled rows of B. This is how the error is propagated back
+through a neuron-major weight matrix without walking it column by column. */
+inline void GemmNN (size_t M, size_t N, size_t K, const float* A, size_t lda, const float* B, size_t ldb, float* C, size_t ldc, bool accumulate)
+{
+    if (!accumulate)
+        ClearMatrix(M, N, C, ldc);
+
+    for (size_t n0 = 0; n0 < N; n0 += c_gemmBlockColumns)
+    {
+        size_t nCount = std::min(c_gemmBlockColumns, N - n0);
+        for (size_t i = 0; i < M; ++i)
+        {
+            float* rowC = C + i * ldc + n0;
+            for (size_t k = 0; k < K; ++k)
+                MultiplyAdd(rowC, A[i * lda + k], B + k * ldb + n0, nCount);
+        }
+    }
+}
+
+/* C[M x N] = A[K x M]^T * B[K x N]
+This is the sum of K outer products (column i of A times row of B). It is used to accumulate
+the weight derivatives of a whole minibatch directly, without a per-sample gradient matrix. */
+inline void GemmTN (size_t M, size_t N, size_t K, const float* A, size_t lda, const float* B, size_t ldb, float* C, size_t ldc, bool accumulate)
+{
+    if (!accumulate)
+        ClearMatrix(M, N, C, ldc);
+
+    for (size_t n0 = 0; n0 < N; n0 += c_gemmBlockColumns)
+    {
+        size_t nCount = std::min(c_gemmBlockColumns, N - n0);
+        for (size_t i = 0; i < M; ++i)
+        {
+            float* rowC = C + i * ldc + n0;
+            for (size_t k = 0; k < K; ++k)
+            {
+                float a = A[k * lda + i];
+                if (a != 0.0f)
+                    MultiplyAdd(rowC, a, B + k * ldb + n0, nCount);
+            }
+        }
+    }
+}
+
+/* The forward product of a dense layer, Z[M x N] = X[M x K] * W[N x K]^T: M items with tightly packed rows of K inputs,
+N neurons whose weight rows are ldw floats apart. Layers keep a pointer to the kernel that fits their shape */
+typedef void (*DenseForwardKernel) (size_t M, size_t N, size_t K, const float* X, const float* W, size_t ldw, float* Z);
+
+inline void DenseForward (size_t M, size_t N, size_t K, const float* X, const float* W, size_t ldw, float* Z)
+{
+    GemmNT(M, N, K, X, K, W, ldw, Z, N, false);
+}
+
+/* The same product compiled for one layer shape. With constant sizes the block loops of GemmNT have known
+trip counts and the tail handling disappears, so the compiler can unroll them */
+template <size_t INPUTS, size_t NEURONS>
+void DenseForwardFixed (size_t M, size_t, size_t, const float* X, const float* W, size_t ldw, float* Z)
+{
+    GemmNT(M, NEURONS, INPUTS, X, INPUTS, W, ldw, Z, NEURONS, false);
+}
+
+// The shapes of the default MNIST network get their own instantiation, every other shape uses the generic kernel
+inline DenseForwardKernel SelectDenseForwardKernel (size_t inputs, size_t neurons)
+{
+    if (inputs == 785 && neurons == 30)
+        return DenseForwardFixed<785, 30>;
+    if (inputs == 784 && neurons == 30)
+        return DenseForwardFixed<784, 30>;
+    if (inputs == 30 && neurons == 10)
+        return DenseForwardFixed<30, 10>;
+    return DenseForward;
+}
+
+// B[N x M] = A[M x N]^T, in square tiles so that both matrices are walked cache line by cache line
+inline void TransposeMatrix (size_t M, size_t N, const float* A, size_t lda, float* B, size_t ldb)
+{
+    const size_t tile = 16;
+    for (size_t i0 = 0; i0 < M; i0 += tile)
+    {
+        size_t iEnd = std::min(i0 + tile, M);
+        for (size_t j0 = 0; j0 < N; j0 += tile)
+        {
+            size_t jEnd = std::min(j0 + tile, N);
+            for (size_t i = i0; i < iEnd; ++i)
+                for (size_t j = j0; j < jEnd; ++j)
+                    B[j * ldb + i] = A[i * lda + j];
+        }
+    }
+}
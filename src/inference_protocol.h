@@ -0,0 +1,210 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef _WIN32
+    #error "The inference server and the load generator use POSIX sockets"
+#endif
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/* The binary protocol between the inference server and its clients. Both sides run on the same host,
+so the messages are plain structs in host byte order. A client may send several requests without waiting
+for the responses; every response carries the id of its request. */
+
+const uint32_t c_requestMagic = 0x51524944;     // "DIRQ"
+const uint32_t c_responseMagic = 0x53524944;    // "DIRS"
+
+const size_t c_requestImageSize = 28 * 28;
+const size_t c_responseOutputs = 10;
+
+struct InferenceRequest
+{
+    uint32_t m_magic;
+    uint32_t m_id;
+
+    // A 28x28 image, 0 is the background and 255 the ink, same as the MNIST files
+    uint8_t m_pixels[c_requestImageSize];
+};
+
+struct InferenceResponse
+{
+    uint32_t m_magic;
+    uint32_t m_id;
+    uint32_t m_label;
+
+    // The activations of the output neurons
+    float m_outputs[c_responseOutputs];
+};
+
+// Reads or writes exactly size bytes, returns false if the connection was closed or broken
+inline bool ReceiveAll (int socket, void* data, size_t size)
+{
+    uint8_t* bytes = (uint8_t*)data;
+    while (size > 0)
+    {
+        ssize_t received = recv(socket, bytes, size, 0);
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received <= 0)
+            return false;
+        bytes += received;
+        size -= size_t(received);
+    }
+    return true;
+}
+
+inline bool SendAll (int socket, const void* data, size_t size)
+{
+    const uint8_t* bytes = (const uint8_t*)data;
+    while (size > 0)
+    {
+        ssize_t sent = send(socket, bytes, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return false;
+        bytes += sent;
+        size -= size_t(sent);
+    }
+    return true;
+}
+
+/* The address of the server: a Unix domain socket path, or a port on localhost if the path is empty.
+Both the server and the load generator parse it from "--socket <path>" or "--port <number>" */
+struct ServerAddress
+{
+    const char* m_socketPath = "/tmp/digit_recognition.sock";
+    int m_port = 0;
+
+    bool ParseArgument (int argc, char** argv, int& index)
+    {
+        if (strcmp(argv[index], "--socket") == 0 && index + 1 < argc)
+        {
+            m_socketPath = argv[++index];
+            m_port = 0;
+            return true;
+        }
+        if (strcmp(argv[index], "--port") == 0 && index + 1 < argc)
+        {
+            m_port = atoi(argv[++index]);
+            return true;
+        }
+        return false;
+    }
+
+    void Print () const
+    {
+        if (m_port)
+            printf("localhost:%d", m_port);
+        else
+            printf("%s", m_socketPath);
+    }
+};
+
+// Small messages have to leave at once, Nagle's algorithm would hold them back until the previous response is acknowledged
+inline void SetLowLatency (int socket, const ServerAddress& address)
+{
+    if (address.m_port)
+    {
+        int enable = 1;
+        setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    }
+}
+
+// Creates the listening socket of the server, returns -1 on failure
+inline int ListenOn (const ServerAddress& address, int backlog)
+{
+    int server = -1;
+    if (address.m_port)
+    {
+        server = socket(AF_INET, SOCK_STREAM, 0);
+        if (server < 0)
+            return -1;
+
+        int enable = 1;
+        setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+        sockaddr_in socketAddress = {};
+        socketAddress.sin_family = AF_INET;
+        socketAddress.sin_port = htons(uint16_t(address.m_port));
+        socketAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(server, (sockaddr*)&socketAddress, sizeof(socketAddress)) != 0)
+        {
+            close(server);
+            return -1;
+        }
+    }
+    else
+    {
+        server = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (server < 0)
+            return -1;
+
+        sockaddr_un socketAddress = {};
+        socketAddress.sun_family = AF_UNIX;
+        strncpy(socketAddress.sun_path, address.m_socketPath, sizeof(socketAddress.sun_path) - 1);
+        unlink(address.m_socketPath);
+        if (bind(server, (sockaddr*)&socketAddress, sizeof(socketAddress)) != 0)
+        {
+            close(server);
+            return -1;
+        }
+    }
+
+    if (listen(server, backlog) != 0)
+    {
+        close(server);
+        return -1;
+    }
+    return server;
+}
+
+// Connects a client to the server, returns -1 on failure
+inline int ConnectTo (const ServerAddress& address)
+{
+    int client = -1;
+    if (address.m_port)
+    {
+        client = socket(AF_INET, SOCK_STREAM, 0);
+        if (client < 0)
+            return -1;
+
+        sockaddr_in socketAddress = {};
+        socketAddress.sin_family = AF_INET;
+        socketAddress.sin_port = htons(uint16_t(address.m_port));
+        socketAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (connect(client, (sockaddr*)&socketAddress, sizeof(socketAddress)) != 0)
+        {
+            close(client);
+            return -1;
+        }
+    }
+    else
+    {
+        client = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (client < 0)
+            return -1;
+
+        sockaddr_un socketAddress = {};
+        socketAddress.sun_family = AF_UNIX;
+        strncpy(socketAddress.sun_path, address.m_socketPath, sizeof(socketAddress.sun_path) - 1);
+        if (connect(client, (sockaddr*)&socketAddress, sizeof(socketAddress)) != 0)
+        {
+            close(client);
+            return -1;
+        }
+    }
+
+    SetLowLatency(client, address);
+    return client;
+}
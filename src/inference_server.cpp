@@ -0,0 +1,407 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <signal.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include "neural_network.h"
+#include "inference_protocol.h"
+#include "latency_histogram.h"
+
+/* Serves a trained network over a local socket:
+
+    inference_server [--socket <path> | --port <number>] [--checkpoint <file>] [--max-batch <n>] [--deadline-us <n>] [--report-s <n>] [--normalize]
+
+Requests of all connections are collected in one queue and evaluated together by a single batched forward pass.
+A batch is started as soon as one of these holds:
+    - the queue holds max-batch requests,
+    - the oldest request waited deadline-us microseconds,
+    - every connected client has exactly one request waiting for its response, so no more requests can arrive.
+The last rule keeps the latency low under light load, while the batches grow by themselves when many clients send at once.
+A client with several requests in flight (pipelining) may send more at any time, so while one is connected the batches
+wait for the first two rules.
+The responses are handed to a writer thread per connection, so a client that does not read its responses only holds up
+itself; when a response cannot be sent for c_sendTimeoutSeconds the connection is dropped.
+
+With --normalize every image is centered and scaled like the web demo does it (see NormalizeDigit()) before it is
+classified, for clients that send raw drawings instead of MNIST style digits. */
+
+typedef std::chrono::steady_clock Clock;
+
+const time_t c_sendTimeoutSeconds = 1;
+
+NeuralNetwork g_neuralNetwork;
+
+std::atomic<bool> g_stop(false);
+
+void OnSignal (int)
+{
+    g_stop = true;
+}
+
+/* A client connection, served by a reader and a writer thread. The socket is closed when both threads and all queued
+requests of the connection are done */
+struct Connection
+{
+    explicit Connection (int socket) : m_socket(socket) {}
+
+    ~Connection ()
+    {
+        close(m_socket);
+    }
+
+    // The reader received a request, the writer keeps running until its response was taken
+    void Received ()
+    {
+        std::lock_guard<std::mutex> lock(m_writerMutex);
+        ++m_unanswered;
+    }
+
+    // The reader saw the client close the connection
+    void ReaderDone ()
+    {
+        std::lock_guard<std::mutex> lock(m_writerMutex);
+        m_readerDone = true;
+        m_writerCondition.notify_one();
+    }
+
+    // Called by the batcher, only queues the response, so it never waits for the socket
+    void PushResponse (const InferenceResponse& response)
+    {
+        std::lock_guard<std::mutex> lock(m_writerMutex);
+        m_responses.push_back(response);
+        m_writerCondition.notify_one();
+    }
+
+    // Waits for the next response to send, false when the reader is done and every request was answered
+    bool PopResponse (InferenceResponse& response)
+    {
+        std::unique_lock<std::mutex> lock(m_writerMutex);
+        m_writerCondition.wait(lock, [this] () { return !m_responses.empty() || (m_readerDone && m_unanswered == 0); });
+        if (m_responses.empty())
+            return false;
+        response = m_responses.front();
+        m_responses.pop_front();
+        --m_unanswered;
+        return true;
+    }
+
+    int m_socket;
+
+    // Requests that were received and whose response was not sent yet, guarded by the queue mutex
+    size_t m_outstanding = 0;
+    bool m_open = true;
+
+private:
+
+    std::mutex m_writerMutex;
+    std::condition_variable m_writerCondition;
+    std::deque<InferenceResponse> m_responses;
+    size_t m_unanswered = 0;
+    bool m_readerDone = false;
+};
+
+struct QueuedRequest
+{
+    std::shared_ptr<Connection> m_connection;
+    InferenceRequest m_request;
+    Clock::time_point m_arrival;
+};
+
+class RequestQueue
+{
+public:
+    void AddConnection ()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ++m_idleConnections;
+    }
+
+    // The reader thread of a connection saw the client close it
+    void RemoveConnection (Connection& connection)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        connection.m_open = false;
+        if (connection.m_outstanding == 0)
+            --m_idleConnections;
+        m_condition.notify_one();
+    }
+
+    void Push (const std::shared_ptr<Connection>& connection, const InferenceRequest& request, Clock::time_point arrival)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (connection->m_outstanding == 0)
+            --m_idleConnections;
+        else if (connection->m_outstanding == 1)
+            ++m_pipelinedConnections;
+        ++connection->m_outstanding;
+        m_requests.push_back({ connection, request, arrival });
+        m_condition.notify_one();
+    }
+
+    // The writer sent a response, the connection can send again
+    void Answered (Connection& connection)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (--connection.m_outstanding == 0 && connection.m_open)
+            ++m_idleConnections;
+        else if (connection.m_outstanding == 1)
+            --m_pipelinedConnections;
+    }
+
+    // Waits for the next batch, returns false when the server is stopping
+    bool PopBatch (std::vector<QueuedRequest>& batch, size_t maxBatch, Clock::duration deadline)
+    {
+        batch.clear();
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (!g_stop)
+        {
+            if (m_requests.empty())
+            {
+                // Wake up now and then to notice g_stop
+                m_condition.wait_for(lock, std::chrono::milliseconds(100));
+                continue;
+            }
+
+            Clock::time_point due = m_requests.front().m_arrival + deadline;
+            if (m_requests.size() >= maxBatch || (m_idleConnections == 0 && m_pipelinedConnections == 0) || Clock::now() >= due)
+                break;
+            m_condition.wait_until(lock, due);
+        }
+        if (g_stop)
+            return false;
+
+        size_t count = std::min(maxBatch, m_requests.size());
+        for (size_t i = 0; i < count; ++i)
+        {
+            batch.push_back(std::move(m_requests.front()));
+            m_requests.pop_front();
+        }
+        return true;
+    }
+
+private:
+
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::deque<QueuedRequest> m_requests;
+    size_t m_idleConnections = 0;
+
+    // Connections with more than one outstanding request
+    size_t m_pipelinedConnections = 0;
+};
+
+RequestQueue g_requestQueue;
+
+// Receives the requests of one client until it disconnects
+void ReadRequests (std::shared_ptr<Connection> connection)
+{
+    InferenceRequest request;
+    while (!g_stop && ReceiveAll(connection->m_socket, &request, sizeof(request)))
+    {
+        if (request.m_magic != c_requestMagic)
+        {
+            printf("A client sent an invalid request, closing the connection.\n");
+            break;
+        }
+        connection->Received();
+        g_requestQueue.Push(connection, request, Clock::now());
+    }
+
+    g_requestQueue.RemoveConnection(*connection);
+    connection->ReaderDone();
+}
+
+// Sends the responses of one client in the order they were evaluated
+void WriteResponses (std::shared_ptr<Connection> connection)
+{
+    InferenceResponse response;
+    bool connected = true;
+    while (connection->PopResponse(response))
+    {
+        // A client that went away or did not read for c_sendTimeoutSeconds loses the connection and its remaining responses.
+        // The shutdown wakes up the blocked recv() of the reader
+        if (connected && !SendAll(connection->m_socket, &response, sizeof(response)))
+        {
+            printf("Could not send a response, closing the connection.\n");
+            shutdown(connection->m_socket, SHUT_RDWR);
+            connected = false;
+        }
+        g_requestQueue.Answered(*connection);
+    }
+}
+
+void AcceptConnections (int server, const ServerAddress& address)
+{
+    while (!g_stop)
+    {
+        // Poll with a timeout to notice g_stop, closing the socket does not wake up accept() everywhere
+        pollfd listening = { server, POLLIN, 0 };
+        if (poll(&listening, 1, 100) <= 0)
+            continue;
+
+        int client = accept(server, nullptr, nullptr);
+        if (client < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+        SetLowLatency(client, address);
+        timeval sendTimeout = { c_sendTimeoutSeconds, 0 };
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout, sizeof(sendTimeout));
+
+        g_requestQueue.AddConnection();
+        std::shared_ptr<Connection> connection = std::make_shared<Connection>(client);
+        std::thread(ReadRequests, connection).detach();
+        std::thread(WriteResponses, connection).detach();
+    }
+}
+
+int main (int argc, char** argv)
+{
+    ServerAddress address;
+    const char* checkpointFileName = "Checkpoint.bin";
+    size_t maxBatch = 64;
+    long deadlineMicroseconds = 200;
+    long reportSeconds = 10;
+    bool normalize = false;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (address.ParseArgument(argc, argv, i))
+            continue;
+        if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc)
+            checkpointFileName = argv[++i];
+        else if (strcmp(argv[i], "--max-batch") == 0 && i + 1 < argc)
+            maxBatch = std::max(atoi(argv[++i]), 1);
+        else if (strcmp(argv[i], "--deadline-us") == 0 && i + 1 < argc)
+            deadlineMicroseconds = std::max(atol(argv[++i]), 0L);
+        else if (strcmp(argv[i], "--report-s") == 0 && i + 1 < argc)
+            reportSeconds = std::max(atol(argv[++i]), 1L);
+        else if (strcmp(argv[i], "--normalize") == 0)
+            normalize = true;
+        else
+        {
+            printf("Unknown argument '%s'.\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (!g_neuralNetwork.LoadCheckpoint(checkpointFileName))
+    {
+        printf("Could not load the network from '%s'!\n", checkpointFileName);
+        return 2;
+    }
+
+    // The response carries one value per output neuron, and the network needs an input per pixel
+    if (g_neuralNetwork.Outputs() != c_responseOutputs || g_neuralNetwork.Inputs() < c_requestImageSize)
+    {
+        printf("A %s network does not fit the protocol, it needs at least %zu inputs and %zu outputs!\n",
+            g_neuralNetwork.Topology().ToString().c_str(), c_requestImageSize, c_responseOutputs);
+        return 2;
+    }
+
+    int server = ListenOn(address, 128);
+    if (server < 0)
+    {
+        printf("Could not listen on ");
+        address.Print();
+        printf(": %s\n", strerror(errno));
+        return 3;
+    }
+
+    signal(SIGINT, OnSignal);
+    signal(SIGTERM, OnSignal);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("Serving the %s network of epoch %u from '%s' on ", g_neuralNetwork.Topology().ToString().c_str(), g_neuralNetwork.Epoch(), checkpointFileName);
+    address.Print();
+    printf(", batches of up to %zu requests, deadline %ld us%s\n", maxBatch, deadlineMicroseconds, normalize ? ", normalizing the digits" : "");
+    fflush(stdout);
+
+    std::thread acceptor(AcceptConnections, server, address);
+
+    // Batching runs on the main thread, the buffers are reused for every batch
+    std::vector<QueuedRequest> batch;
+    const size_t inputs = g_neuralNetwork.Inputs();
+    std::vector<float> batchInputs(maxBatch * inputs, 0.0f);
+    std::vector<float> batchOutputs(maxBatch * c_responseOutputs);
+    std::vector<uint8_t> labels(maxBatch);
+    float image[c_requestImageSize];
+
+    LatencyHistogram intervalLatencies;
+    LatencyHistogram totalLatencies;
+    size_t intervalBatches = 0;
+    size_t totalBatches = 0;
+    Clock::time_point nextReport = Clock::now() + std::chrono::seconds(reportSeconds);
+
+    while (g_requestQueue.PopBatch(batch, maxBatch, std::chrono::microseconds(deadlineMicroseconds)))
+    {
+        // Same normalization as MNISTData::GetImage(), the inputs past the pixels stay zero
+        for (size_t batchIndex = 0; batchIndex < batch.size(); ++batchIndex)
+        {
+            const uint8_t* pixels = batch[batchIndex].m_request.m_pixels;
+            float* row = &batchInputs[batchIndex * inputs];
+            for (size_t i = 0; i < c_requestImageSize; ++i)
+                row[i] = float(pixels[i]) / 255.0f;
+
+            // An empty drawing stays empty
+            if (normalize)
+            {
+                std::copy_n(row, c_requestImageSize, image);
+                NormalizeDigit(image, c_normalizedImageSize, c_normalizedImageSize, row);
+            }
+        }
+
+        g_neuralNetwork.ForwardPass(batchInputs.data(), batch.size(), batchOutputs.data(), labels.data());
+
+        for (size_t batchIndex = 0; batchIndex < batch.size(); ++batchIndex)
+        {
+            QueuedRequest& queued = batch[batchIndex];
+
+            InferenceResponse response;
+            response.m_magic = c_responseMagic;
+            response.m_id = queued.m_request.m_id;
+            response.m_label = labels[batchIndex];
+            std::copy_n(&batchOutputs[batchIndex * c_responseOutputs], c_responseOutputs, response.m_outputs);
+
+            // The latency ends when the response is handed to the writer of the connection
+            queued.m_connection->PushResponse(response);
+            intervalLatencies.Record(Clock::now() - queued.m_arrival);
+        }
+        batch.clear();
+        ++intervalBatches;
+
+        if (Clock::now() >= nextReport)
+        {
+            if (intervalLatencies.Count() > 0)
+            {
+                printf("Mean batch size %0.1f, ", double(intervalLatencies.Count()) / double(intervalBatches));
+                intervalLatencies.Print("latency in the server");
+                fflush(stdout);
+            }
+            totalLatencies.Merge(intervalLatencies);
+            totalBatches += intervalBatches;
+            intervalLatencies.Clear();
+            intervalBatches = 0;
+            nextReport = Clock::now() + std::chrono::seconds(reportSeconds);
+        }
+    }
+
+    // Stop accepting, the reader and writer threads end with their connections
+    acceptor.join();
+    close(server);
+    if (!address.m_port)
+        unlink(address.m_socketPath);
+
+    totalLatencies.Merge(intervalLatencies);
+    totalBatches += intervalBatches;
+    printf("\n%zu batches, mean batch size %0.1f\n", totalBatches, totalBatches ? double(totalLatencies.Count()) / double(totalBatches) : 0.0);
+    totalLatencies.Print("Latency in the server");
+    return 0;
+}
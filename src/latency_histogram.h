@@ -0,0 +1,130 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <algorithm>
+#include <array>
+#include <chrono>
+
+/* A log-linear histogram of latencies in nanoseconds. Values below 32 ns get their own bucket, above that every power of two
+is split into 16 linear buckets, so any recorded value is known within about 6% while the histogram has a fixed size.
+Recording is a few instructions, so every request can be recorded; histograms of several threads can be merged. */
+class LatencyHistogram
+{
+public:
+    void Record (uint64_t nanoseconds)
+    {
+        ++m_buckets[BucketIndex(nanoseconds)];
+        ++m_count;
+        m_sum += nanoseconds;
+        if (nanoseconds > m_max)
+            m_max = nanoseconds;
+    }
+
+    void Record (std::chrono::steady_clock::duration duration)
+    {
+        Record(uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count()));
+    }
+
+    void Merge (const LatencyHistogram& other)
+    {
+        for (size_t i = 0; i < c_bucketCount; ++i)
+            m_buckets[i] += other.m_buckets[i];
+        m_count += other.m_count;
+        m_sum += other.m_sum;
+        if (other.m_max > m_max)
+            m_max = other.m_max;
+    }
+
+    void Clear ()
+    {
+        *this = LatencyHistogram();
+    }
+
+    uint64_t Count () const { return m_count; }
+    uint64_t Max () const { return m_max; }
+    double Mean () const { return m_count ? double(m_sum) / double(m_count) : 0.0; }
+
+    // Returns an upper bound of the value below which the given fraction (0 to 1) of the recorded values lie
+    uint64_t Percentile (double fraction) const
+    {
+        if (m_count == 0)
+            return 0;
+
+        uint64_t rank = uint64_t(fraction * double(m_count - 1)) + 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < c_bucketCount; ++i)
+        {
+            seen += m_buckets[i];
+            if (seen >= rank)
+                return std::min(BucketUpperBound(i), m_max);
+        }
+        return m_max;
+    }
+
+    // Prints count, mean and the usual percentiles in microseconds, prefixed by a label
+    void Print (const char* label) const
+    {
+        printf("%s: %llu requests, mean %0.1f us, p50 %0.1f us, p90 %0.1f us, p99 %0.1f us, p99.9 %0.1f us, max %0.1f us\n",
+            label, (unsigned long long)m_count, Mean() / 1000.0,
+            Percentile(0.5) / 1000.0, Percentile(0.9) / 1000.0, Percentile(0.99) / 1000.0, Percentile(0.999) / 1000.0, m_max / 1000.0);
+    }
+
+    // Writes every non-empty bucket as a CSV line: upper bound in nanoseconds, count and cumulative fraction
+    bool WriteCSV (const char* fileName) const
+    {
+        FILE* file = fopen(fileName, "w+t");
+        if (!file)
+        {
+            printf("Could not open %s for writing.\n", fileName);
+            return false;
+        }
+
+        fprintf(file, "\"Latency (ns)\",\"Count\",\"Cumulative Fraction\"\n");
+        uint64_t seen = 0;
+        for (size_t i = 0; i < c_bucketCount; ++i)
+        {
+            if (m_buckets[i] == 0)
+                continue;
+            seen += m_buckets[i];
+            fprintf(file, "%llu,%llu,%f\n", (unsigned long long)BucketUpperBound(i), (unsigned long long)m_buckets[i], double(seen) / double(m_count));
+        }
+        fclose(file);
+        return true;
+    }
+
+private:
+
+    static const size_t c_linearBuckets = 32;
+    static const size_t c_subBuckets = 16;
+    static const size_t c_bucketCount = c_linearBuckets + (64 - 5) * c_subBuckets;
+
+    static size_t BucketIndex (uint64_t value)
+    {
+        if (value < c_linearBuckets)
+            return size_t(value);
+
+        size_t exponent = 63;
+        while (!(value >> exponent))
+            --exponent;
+        size_t subBucket = size_t(value >> (exponent - 4)) - c_subBuckets;
+        return c_linearBuckets + (exponent - 5) * c_subBuckets + subBucket;
+    }
+
+    static uint64_t BucketUpperBound (size_t index)
+    {
+        if (index < c_linearBuckets)
+            return index;
+
+        size_t exponent = (index - c_linearBuckets) / c_subBuckets + 5;
+        uint64_t subBucket = (index - c_linearBuckets) % c_subBuckets;
+        return ((c_subBuckets + subBucket + 1) << (exponent - 4)) - 1;
+    }
+
+private:
+
+    std::array<uint64_t, c_bucketCount> m_buckets = {};
+    uint64_t m_count = 0;
+    uint64_t m_sum = 0;
+    uint64_t m_max = 0;
+};
@@ -0,0 +1,250 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "simd_kernels.h"
+
+/* The shape of a network of dense layers, built at runtime. Every layer is fully connected to the previous one
+(the first layer to the inputs) and has its own activation function. A softmax layer is only allowed as the
+last layer, it is trained with the cross-entropy cost; all other output layers use the quadratic cost. */
+
+enum ActivationFunction
+{
+    c_sigmoidActivation,
+    c_reluActivation,
+    c_softmaxActivation,
+    c_activationFunctionCount
+};
+
+inline const char* ActivationName (ActivationFunction activation)
+{
+    switch (activation)
+    {
+        case c_sigmoidActivation: return "sigmoid";
+        case c_reluActivation:    return "relu";
+        case c_softmaxActivation: return "softmax";
+        default:                  return "unknown";
+    }
+}
+
+struct LayerTopology
+{
+    size_t m_neurons = 0;
+    ActivationFunction m_activation = c_sigmoidActivation;
+};
+
+struct NetworkTopology
+{
+    size_t m_inputs = 0;
+    std::vector<LayerTopology> m_layers;
+
+    /* Parses a topology like "785-30-10" or "785-128:relu-64:relu-10:softmax": the input count followed by
+    the neuron count of every layer, optionally with the activation function (sigmoid by default) */
+    bool Parse (const char* text)
+    {
+        NetworkTopology topology;
+        const char* position = text;
+        char* end = nullptr;
+        topology.m_inputs = strtoul(position, &end, 10);
+        position = end;
+        while (*position == '-')
+        {
+            LayerTopology layer;
+            layer.m_neurons = strtoul(position + 1, &end, 10);
+            if (end == position + 1)
+                break;
+            position = end;
+
+            if (*position == ':')
+            {
+                size_t length = strcspn(position + 1, "-");
+                std::string name(position + 1, length);
+                size_t activation = 0;
+                while (activation < c_activationFunctionCount && name != ActivationName(ActivationFunction(activation)))
+                    ++activation;
+                if (activation == c_activationFunctionCount)
+                {
+                    printf("Unknown activation function '%s' in the topology '%s'.\n", name.c_str(), text);
+                    return false;
+                }
+                layer.m_activation = ActivationFunction(activation);
+                position += 1 + length;
+            }
+            topology.m_layers.push_back(layer);
+        }
+
+        if (*position != 0 || !topology.IsValid())
+        {
+            printf("'%s' is not a valid topology, expected e.g. \"785-30-10\" or \"785-100:relu-10:softmax\".\n", text);
+            return false;
+        }
+        *this = topology;
+        return true;
+    }
+
+    std::string ToString () const
+    {
+        std::string text = std::to_string(m_inputs);
+        for (const LayerTopology& layer : m_layers)
+        {
+            text += "-" + std::to_string(layer.m_neurons);
+            if (layer.m_activation != c_sigmoidActivation)
+                text += std::string(":") + ActivationName(layer.m_activation);
+        }
+        return text;
+    }
+
+    bool IsValid () const
+    {
+        if (m_inputs == 0 || m_layers.empty())
+            return false;
+        for (size_t layerIndex = 0; layerIndex < m_layers.size(); ++layerIndex)
+        {
+            if (m_layers[layerIndex].m_neurons == 0 || m_layers[layerIndex].m_activation >= c_activationFunctionCount)
+                return false;
+            if (m_layers[layerIndex].m_activation == c_softmaxActivation && layerIndex + 1 != m_layers.size())
+                return false;
+        }
+        return true;
+    }
+
+    size_t Outputs () const { return m_layers.empty() ? 0 : m_layers.back().m_neurons; }
+
+    // The number of weights and biases, without the padding of the parameter arena
+    size_t ParameterCount () const
+    {
+        size_t count = 0;
+        size_t inputs = m_inputs;
+        for (const LayerTopology& layer : m_layers)
+        {
+            count += layer.m_neurons * (inputs + 1);
+            inputs = layer.m_neurons;
+        }
+        return count;
+    }
+
+    bool operator == (const NetworkTopology& other) const
+    {
+        if (m_inputs != other.m_inputs || m_layers.size() != other.m_layers.size())
+            return false;
+        for (size_t layerIndex = 0; layerIndex < m_layers.size(); ++layerIndex)
+        {
+            if (m_layers[layerIndex].m_neurons != other.m_layers[layerIndex].m_neurons || m_layers[layerIndex].m_activation != other.m_layers[layerIndex].m_activation)
+                return false;
+        }
+        return true;
+    }
+
+    bool operator != (const NetworkTopology& other) const { return !(*this == other); }
+};
+
+// Every weight matrix and bias vector in the parameter arena starts at a multiple of this many floats (one cache line)
+const size_t c_parameterAlignment = 16;
+
+inline size_t AlignParameterCount (size_t count)
+{
+    return (count + c_parameterAlignment - 1) / c_parameterAlignment * c_parameterAlignment;
+}
+
+/* Where the parameters of a layer are in the parameter arena. The weights are [neurons x inputs], a row per neuron,
+m_weightsStride floats apart, followed by one bias per neuron. The input-major view of the first layer (see
+NeuralNetwork::InputMajorWeights()) is [inputs x neurons] with rows m_inputMajorStride floats apart */
+struct LayerLayout
+{
+    size_t m_inputs = 0;
+    size_t m_neurons = 0;
+    ActivationFunction m_activation = c_sigmoidActivation;
+    size_t m_weightsOffset = 0;
+    size_t m_biasesOffset = 0;
+    size_t m_weightsStride = 0;
+    size_t m_inputMajorStride = 0;
+
+    // The floats of the weights in either view, including the padding of the rows
+    size_t WeightsSize () const { return m_neurons * m_weightsStride; }
+    size_t InputMajorSize () const { return m_inputs * m_inputMajorStride; }
+};
+
+/* Lays out the parameters of all layers one after another and returns the size of the arena in floats.
+With paddedRows every row of weights starts on a cache line and the padding floats are never read, so the vector loads
+of a row never straddle two lines and its tail starts aligned; the first layer reserves room for its input-major view
+as well. Without, the rows are tightly packed, which is the layout of checkpoint files */
+inline size_t ComputeLayout (const NetworkTopology& topology, std::vector<LayerLayout>& layout, bool paddedRows = true)
+{
+    layout.resize(topology.m_layers.size());
+    size_t offset = 0;
+    size_t inputs = topology.m_inputs;
+    for (size_t layerIndex = 0; layerIndex < layout.size(); ++layerIndex)
+    {
+        LayerLayout& layer = layout[layerIndex];
+        layer.m_inputs = inputs;
+        layer.m_neurons = topology.m_layers[layerIndex].m_neurons;
+        layer.m_activation = topology.m_layers[layerIndex].m_activation;
+        layer.m_weightsStride = paddedRows ? AlignParameterCount(layer.m_inputs) : layer.m_inputs;
+        layer.m_inputMajorStride = paddedRows ? AlignParameterCount(layer.m_neurons) : layer.m_neurons;
+        layer.m_weightsOffset = offset;
+        offset += AlignParameterCount(layerIndex == 0 ? std::max(layer.WeightsSize(), layer.InputMajorSize()) : layer.WeightsSize());
+        layer.m_biasesOffset = offset;
+        offset += AlignParameterCount(layer.m_neurons);
+        inputs = layer.m_neurons;
+    }
+    return offset;
+}
+
+// Copies the weights and biases of an arena into an arena of the same topology with another layout, e.g. of a checkpoint
+inline void CopyParameters (const std::vector<LayerLayout>& sourceLayout, const float* source, const std::vector<LayerLayout>& destinationLayout, float* destination)
+{
+    for (size_t layerIndex = 0; layerIndex < sourceLayout.size(); ++layerIndex)
+    {
+        const LayerLayout& from = sourceLayout[layerIndex];
+        const LayerLayout& to = destinationLayout[layerIndex];
+        for (size_t neuronIndex = 0; neuronIndex < from.m_neurons; ++neuronIndex)
+            std::copy_n(&source[from.m_weightsOffset + neuronIndex * from.m_weightsStride], from.m_inputs, &destination[to.m_weightsOffset + neuronIndex * to.m_weightsStride]);
+        std::copy_n(&source[from.m_biasesOffset], from.m_neurons, &destination[to.m_biasesOffset]);
+    }
+}
+
+// values[i] = activation(values[i] + biases[i]) for the count neurons of one item
+inline void ApplyActivation (ActivationFunction activation, float* values, const float* biases, size_t count)
+{
+    switch (activation)
+    {
+        case c_sigmoidActivation:
+        {
+            GetSimdKernels().Sigmoid(values, biases, count);
+            break;
+        }
+        case c_reluActivation:
+        {
+            for (size_t i = 0; i < count; ++i)
+                values[i] = std::max(values[i] + biases[i], 0.0f);
+            break;
+        }
+        case c_softmaxActivation:
+        {
+            // Subtracting the largest value keeps exp() from overflowing and does not change the result
+            float maxValue = -INFINITY;
+            for (size_t i = 0; i < count; ++i)
+            {
+                values[i] += biases[i];
+                maxValue = std::max(maxValue, values[i]);
+            }
+            float sum = 0.0f;
+            for (size_t i = 0; i < count; ++i)
+            {
+                values[i] = std::exp(values[i] - maxValue);
+                sum += values[i];
+            }
+            for (size_t i = 0; i < count; ++i)
+                values[i] /= sum;
+            break;
+        }
+        default:
+            break;
+    }
+}
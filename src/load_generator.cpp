@@ -0,0 +1,198 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <atomic>
+#include <thread>
+#include <random>
+#include <vector>
+#include "data_loader.h"
+#include "inference_protocol.h"
+#include "latency_histogram.h"
+
+/* Measures the inference server from the client side:
+
+    load_generator [--socket <path> | --port <number>] [--connections <n>] [--pipeline <n>] [--seconds <n>] [--csv <file>] [--random]
+
+Every connection runs a closed loop: it keeps pipeline requests in flight and sends the next one when a response arrives.
+The images are taken from the MNIST test files in the working directory, so the accuracy seen by the clients is
+reported as well; with --random (or without the files) random images are sent. The round trip latency of every
+request is recorded, the histograms of all connections are merged at the end. */
+
+typedef std::chrono::steady_clock Clock;
+
+struct Options
+{
+    ServerAddress m_address;
+    size_t m_connections = 8;
+    size_t m_pipeline = 1;
+    double m_seconds = 10.0;
+    const char* m_csvFileName = nullptr;
+    bool m_random = false;
+};
+
+struct ConnectionResult
+{
+    LatencyHistogram m_latencies;
+    size_t m_correct = 0;
+    size_t m_labeled = 0;
+    bool m_failed = false;
+};
+
+MNISTData g_testData;
+std::atomic<bool> g_stop(false);
+
+void RunConnection (const Options& options, size_t connectionIndex, ConnectionResult& result)
+{
+    int socket = ConnectTo(options.m_address);
+    if (socket < 0)
+    {
+        printf("Connection %zu could not connect: %s\n", connectionIndex, strerror(errno));
+        result.m_failed = true;
+        return;
+    }
+
+    std::mt19937 generator(uint32_t(connectionIndex + 1));
+    std::uniform_int_distribution<uint32_t> pixelDistribution(0, 255);
+    bool useTestData = g_testData.NumImages() > 0;
+
+    // The requests in flight, indexed by id modulo the pipeline depth
+    std::vector<Clock::time_point> sendTimes(options.m_pipeline);
+    std::vector<int> correctLabels(options.m_pipeline, -1);
+    size_t nextImage = connectionIndex;
+    uint32_t nextId = 0;
+
+    auto sendRequest = [&] () -> bool
+    {
+        InferenceRequest request;
+        request.m_magic = c_requestMagic;
+        request.m_id = nextId++;
+
+        size_t slot = request.m_id % options.m_pipeline;
+        if (useTestData)
+        {
+            uint8_t label;
+            const uint8_t* pixels = g_testData.GetImage(nextImage % g_testData.NumImages(), label);
+            memcpy(request.m_pixels, pixels, c_requestImageSize);
+            correctLabels[slot] = label;
+            nextImage += options.m_connections;
+        }
+        else
+        {
+            for (size_t i = 0; i < c_requestImageSize; ++i)
+                request.m_pixels[i] = uint8_t(pixelDistribution(generator));
+            correctLabels[slot] = -1;
+        }
+
+        sendTimes[slot] = Clock::now();
+        return SendAll(socket, &request, sizeof(request));
+    };
+
+    size_t inFlight = 0;
+    for (; inFlight < options.m_pipeline; ++inFlight)
+    {
+        if (!sendRequest())
+            break;
+    }
+
+    InferenceResponse response;
+    while (inFlight > 0 && ReceiveAll(socket, &response, sizeof(response)))
+    {
+        Clock::time_point now = Clock::now();
+        if (response.m_magic != c_responseMagic)
+        {
+            printf("Connection %zu received an invalid response.\n", connectionIndex);
+            result.m_failed = true;
+            break;
+        }
+
+        size_t slot = response.m_id % options.m_pipeline;
+        result.m_latencies.Record(now - sendTimes[slot]);
+        if (correctLabels[slot] >= 0)
+        {
+            ++result.m_labeled;
+            if (int(response.m_label) == correctLabels[slot])
+                ++result.m_correct;
+        }
+
+        --inFlight;
+        if (!g_stop)
+        {
+            if (!sendRequest())
+                break;
+            ++inFlight;
+        }
+    }
+
+    if (inFlight > 0 && !result.m_failed)
+    {
+        printf("Connection %zu was closed by the server.\n", connectionIndex);
+        result.m_failed = true;
+    }
+    close(socket);
+}
+
+int main (int argc, char** argv)
+{
+    Options options;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (options.m_address.ParseArgument(argc, argv, i))
+            continue;
+        if (strcmp(argv[i], "--connections") == 0 && i + 1 < argc)
+            options.m_connections = std::max(atoi(argv[++i]), 1);
+        else if (strcmp(argv[i], "--pipeline") == 0 && i + 1 < argc)
+            options.m_pipeline = std::max(atoi(argv[++i]), 1);
+        else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc)
+            options.m_seconds = atof(argv[++i]);
+        else if (strcmp(argv[i], "--csv") == 0 && i + 1 < argc)
+            options.m_csvFileName = argv[++i];
+        else if (strcmp(argv[i], "--random") == 0)
+            options.m_random = true;
+        else
+        {
+            printf("Unknown argument '%s'.\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (!options.m_random && (!g_testData.Load(false) || g_testData.ImageSize() != c_requestImageSize))
+    {
+        printf("Could not use the MNIST test data, sending random images.\n");
+        g_testData.Clear();
+    }
+
+    printf("%zu connections with %zu requests in flight each to ", options.m_connections, options.m_pipeline);
+    options.m_address.Print();
+    printf(" for %0.1f seconds\n", options.m_seconds);
+
+    std::vector<ConnectionResult> results(options.m_connections);
+    std::vector<std::thread> threads;
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < options.m_connections; ++i)
+        threads.emplace_back(RunConnection, std::cref(options), i, std::ref(results[i]));
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(options.m_seconds));
+    g_stop = true;
+    for (std::thread& thread : threads)
+        thread.join();
+    std::chrono::duration<double> elapsed = Clock::now() - start;
+
+    LatencyHistogram latencies;
+    size_t correct = 0;
+    size_t labeled = 0;
+    bool failed = false;
+    for (const ConnectionResult& result : results)
+    {
+        latencies.Merge(result.m_latencies);
+        correct += result.m_correct;
+        labeled += result.m_labeled;
+        failed = failed || result.m_failed;
+    }
+
+    printf("%0.0f requests per second\n", double(latencies.Count()) / elapsed.count());
+    latencies.Print("Round trip latency");
+    if (labeled > 0)
+        printf("Accuracy = %0.2f%% of %zu labeled images\n", 100.0 * double(correct) / double(labeled), labeled);
+
+    if (options.m_csvFileName && !latencies.WriteCSV(options.m_csvFileName))
+        return 2;
+    return failed ? 3 : 0;
+}
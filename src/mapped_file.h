@@ -0,0 +1,108 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef _WIN32
+    #ifndef WIN32_LEAN_AND_MEAN
+        #define WIN32_LEAN_AND_MEAN
+    #endif
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+/* A read-only memory mapping of a whole file. The pages are loaded by the OS when they are first touched
+and are shared between all processes that map the same file, so opening a file is nearly free */
+class MappedFile
+{
+public:
+    MappedFile () = default;
+
+    ~MappedFile ()
+    {
+        Close();
+    }
+
+    MappedFile (const MappedFile&) = delete;
+    MappedFile& operator = (const MappedFile&) = delete;
+
+    bool Open (const char* fileName)
+    {
+        Close();
+
+#ifdef _WIN32
+        HANDLE file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+        {
+            CloseHandle(file);
+            return false;
+        }
+
+        HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        CloseHandle(file);
+        if (!mapping)
+            return false;
+
+        void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(mapping);
+        if (!data)
+            return false;
+
+        m_size = size_t(fileSize.QuadPart);
+#else
+        int file = open(fileName, O_RDONLY);
+        if (file < 0)
+            return false;
+
+        struct stat fileInfo;
+        if (fstat(file, &fileInfo) != 0 || fileInfo.st_size == 0)
+        {
+            close(file);
+            return false;
+        }
+
+        void* data = mmap(nullptr, size_t(fileInfo.st_size), PROT_READ, MAP_SHARED, file, 0);
+        close(file);
+        if (data == MAP_FAILED)
+            return false;
+
+        m_size = size_t(fileInfo.st_size);
+#endif
+        m_data = (const uint8_t*)data;
+        return true;
+    }
+
+    void Close ()
+    {
+        if (!m_data)
+            return;
+
+#ifdef _WIN32
+        UnmapViewOfFile(m_data);
+#else
+        munmap((void*)m_data, m_size);
+#endif
+        m_data = nullptr;
+        m_size = 0;
+    }
+
+    const uint8_t* Data () const { return m_data; }
+    size_t Size () const { return m_size; }
+
+private:
+
+    const uint8_t* m_data = nullptr;
+    size_t m_size = 0;
+};
@@ -0,0 +1,410 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <charconv>
+#include "neural_network.h"
+
+/* Exports a trained network for the web demo (demonstration.html) as JSON and as a binary blob:
+
+    WeightsBiasesJSON.txt   the JSON object the page was always built with, for a network with one sigmoid hidden layer
+    Weights.bin             a compact little-endian blob of any topology, which the page decodes with typed arrays
+    WeightsBase64.txt       the same blob as base64 text, to embed it into the page as a string
+
+The blob is laid out as:
+
+    WeightsBlobHeader (20 bytes)
+    WeightsBlobLayer table, one entry per layer
+    for every layer: the biases [neurons], then the weights [neurons x inputs], as float32 or float16
+
+All parts have a size that is a multiple of 4 bytes, so every float32 array starts at an offset a Float32Array can view
+directly. float32 reproduces the trained weights exactly, float16 halves the size again and rounds every value to
+about 3 significant digits. */
+
+const uint32_t c_weightsBlobMagic = 0x4D57524E; // "NRWM"
+const uint32_t c_weightsBlobVersion = 1;
+
+enum WeightsDataType
+{
+    c_weightsFloat32 = 1,
+    c_weightsFloat16 = 2
+};
+
+struct WeightsBlobHeader
+{
+    uint32_t m_magic;
+    uint32_t m_version;
+    uint32_t m_dataType;
+    uint32_t m_inputs;
+    uint32_t m_layerCount;
+};
+static_assert(sizeof(WeightsBlobHeader) == 20, "The header is read by the web demo, its layout must not change");
+
+struct WeightsBlobLayer
+{
+    uint32_t m_neurons;
+    uint32_t m_activation;
+};
+
+// Rounds a float to the nearest half precision value (ties to even), out of range values become infinity
+inline uint16_t FloatToHalf (float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000;
+    uint32_t exponent = (bits >> 23) & 0xFF;
+    uint32_t mantissa = bits & 0x7FFFFF;
+
+    // NaN and infinity
+    if (exponent == 0xFF)
+        return uint16_t(sign | 0x7C00 | (mantissa ? 0x200 : 0));
+
+    int halfExponent = int(exponent) - 127 + 15;
+    if (halfExponent >= 31)
+        return uint16_t(sign | 0x7C00);
+
+    // Subnormal half: shift the mantissa including its implicit bit, rounding to nearest even
+    if (halfExponent <= 0)
+    {
+        if (halfExponent < -10)
+            return uint16_t(sign);
+        mantissa |= 0x800000;
+        uint32_t shift = uint32_t(14 - halfExponent);
+        uint32_t half = mantissa >> shift;
+        uint32_t remainder = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (remainder > halfway || (remainder == halfway && (half & 1)))
+            ++half;
+        return uint16_t(sign | half);
+    }
+
+    // A carry out of the mantissa correctly moves on to the next exponent, up to infinity
+    uint32_t half = (uint32_t(halfExponent) << 10) | (mantissa >> 13);
+    uint32_t remainder = mantissa & 0x1FFF;
+    if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1)))
+        ++half;
+    return uint16_t(sign | half);
+}
+
+inline float HalfToFloat (uint16_t half)
+{
+    uint32_t sign = uint32_t(half & 0x8000) << 16;
+    uint32_t exponent = (half >> 10) & 0x1F;
+    uint32_t mantissa = half & 0x3FF;
+    uint32_t bits;
+    if (exponent == 0x1F)
+        bits = sign | 0x7F800000 | (mantissa << 13);
+    else if (exponent != 0)
+        bits = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+    else if (mantissa == 0)
+        bits = sign;
+    else
+    {
+        // Subnormal half, normalize it
+        exponent = 127 - 15 + 1;
+        while (!(mantissa & 0x400))
+        {
+            mantissa <<= 1;
+            --exponent;
+        }
+        bits = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+    }
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+/* Writes the shortest decimal representation of value that reads back as exactly the same float and returns its
+length. 0.1f is written as "0.1" instead of the 9 digits "%.9g" needs for every value. */
+inline size_t FormatShortestFloat (float value, char* buffer, size_t bufferSize)
+{
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+    std::to_chars_result result = std::to_chars(buffer, buffer + bufferSize - 1, value);
+    *result.ptr = 0;
+    return size_t(result.ptr - buffer);
+#else
+    // Without to_chars, take the first precision that round trips. 9 significant digits always do.
+    int length = 0;
+    for (int precision = 6; precision <= 9; ++precision)
+    {
+        length = snprintf(buffer, bufferSize, "%.*g", precision, value);
+        if (strtof(buffer, nullptr) == value)
+            break;
+    }
+    return size_t(length);
+#endif
+}
+
+/* Collects the output in a large buffer and hands it to fwrite in big blocks, instead of one fprintf call (and one
+format string parse) per value */
+class BufferedFileWriter
+{
+public:
+    explicit BufferedFileWriter (FILE* file, size_t bufferSize = 1 << 16)
+        : m_file(file)
+    {
+        m_buffer.reserve(bufferSize);
+    }
+
+    ~BufferedFileWriter ()
+    {
+        Flush();
+    }
+
+    BufferedFileWriter (const BufferedFileWriter&) = delete;
+    BufferedFileWriter& operator = (const BufferedFileWriter&) = delete;
+
+    void Write (const char* text, size_t length)
+    {
+        if (m_buffer.size() + length > m_buffer.capacity())
+            Flush();
+        if (length > m_buffer.capacity())
+            m_failed |= fwrite(text, 1, length, m_file) != length;
+        else
+            m_buffer.insert(m_buffer.end(), text, text + length);
+    }
+
+    void Write (const char* text) { Write(text, strlen(text)); }
+
+    void WriteInteger (size_t value)
+    {
+        char buffer[32];
+        int length = snprintf(buffer, sizeof(buffer), "%zu", value);
+        Write(buffer, size_t(length));
+    }
+
+    void WriteFloat (float value)
+    {
+        char buffer[32];
+        Write(buffer, FormatShortestFloat(value, buffer, sizeof(buffer)));
+    }
+
+    // Returns false if anything could not be written
+    bool Flush ()
+    {
+        if (!m_buffer.empty())
+            m_failed |= fwrite(m_buffer.data(), 1, m_buffer.size(), m_file) != m_buffer.size();
+        m_buffer.clear();
+        return !m_failed;
+    }
+
+private:
+    FILE*               m_file;
+    std::vector<char>   m_buffer;
+    bool                m_failed = false;
+};
+
+// The web demo embeds the JSON of a network with one sigmoid hidden layer, the blob can describe any network
+inline bool IsWebDemoJSONNetwork (const NeuralNetwork& network)
+{
+    return network.LayerCount() == 2 && network.Layer(0).m_activation == c_sigmoidActivation && network.Layer(1).m_activation == c_sigmoidActivation;
+}
+
+// JSON has no NaN or infinity, and the weights of such a network are of no use anyway
+inline bool HasFiniteParameters (const NeuralNetwork& network)
+{
+    for (size_t layerIndex = 0; layerIndex < network.LayerCount(); ++layerIndex)
+    {
+        const LayerLayout& layer = network.Layer(layerIndex);
+        const float* biases = network.LayerBiases(layerIndex);
+        for (size_t neuronIndex = 0; neuronIndex < layer.m_neurons; ++neuronIndex)
+        {
+            const float* weights = network.NeuronWeights(layerIndex, neuronIndex);
+            for (size_t i = 0; i < layer.m_inputs; ++i)
+            {
+                if (!std::isfinite(weights[i]))
+                    return false;
+            }
+        }
+        for (size_t i = 0; i < layer.m_neurons; ++i)
+        {
+            if (!std::isfinite(biases[i]))
+                return false;
+        }
+    }
+    return true;
+}
+
+/* Writes the network as the g_neuralNetwork object of the web demo. The values are written in their shortest form that
+parses back to the same float, a line holds 16 of them */
+inline bool ExportWebDemoJSON (const char* fileName, const NeuralNetwork& network)
+{
+    if (!IsWebDemoJSONNetwork(network))
+    {
+        printf("The web demo JSON only holds a network with one sigmoid hidden layer, not %s.\n", network.Topology().ToString().c_str());
+        return false;
+    }
+    if (!HasFiniteParameters(network))
+    {
+        printf("The network has parameters that are not finite, %s is not written.\n", fileName);
+        return false;
+    }
+
+    FILE* file = fopen(fileName, "wb");
+    if (!file)
+    {
+        printf("Could not open %s for writing.\n", fileName);
+        return false;
+    }
+
+    auto writeArray = [] (BufferedFileWriter& writer, const char* name, const float* values, size_t count, bool last)
+    {
+        writer.Write("  \"");
+        writer.Write(name);
+        writer.Write("\" : [\n    ");
+        for (size_t i = 0; i < count; ++i)
+        {
+            writer.WriteFloat(values[i]);
+            if (i + 1 < count)
+                writer.Write((i % 16 == 15) ? ",\n    " : ",");
+        }
+        writer.Write(last ? "\n  ]\n" : "\n  ],\n");
+    };
+
+    bool written;
+    {
+        const LayerLayout& hiddenLayer = network.Layer(0);
+        const LayerLayout& outputLayer = network.Layer(1);
+
+        BufferedFileWriter writer(file);
+        writer.Write("{\n  \"InputNeurons\":");
+        writer.WriteInteger(network.Inputs());
+        writer.Write(",\n  \"HiddenNeurons\":");
+        writer.WriteInteger(hiddenLayer.m_neurons);
+        writer.Write(",\n  \"OutputNeurons\":");
+        writer.WriteInteger(outputLayer.m_neurons);
+        writer.Write(",\n");
+        writeArray(writer, "HiddenBiases", network.LayerBiases(0), hiddenLayer.m_neurons, false);
+        writeArray(writer, "HiddenWeights", network.GetLayerWeights(0).data(), hiddenLayer.m_neurons * hiddenLayer.m_inputs, false);
+        writeArray(writer, "OutputBiases", network.LayerBiases(1), outputLayer.m_neurons, false);
+        writeArray(writer, "OutputWeights", network.GetLayerWeights(1).data(), outputLayer.m_neurons * outputLayer.m_inputs, true);
+        writer.Write("}\n");
+        written = writer.Flush();
+    }
+    written = (fclose(file) == 0) && written;
+    if (!written)
+        printf("Could not write %s.\n", fileName);
+    return written;
+}
+
+// Lays out the blob described at the top of this file in memory
+inline std::vector<uint8_t> BuildWeightsBlob (const NeuralNetwork& network, WeightsDataType dataType)
+{
+    const size_t valueSize = (dataType == c_weightsFloat16) ? sizeof(uint16_t) : sizeof(float);
+
+    size_t size = sizeof(WeightsBlobHeader) + network.LayerCount() * sizeof(WeightsBlobLayer);
+    for (size_t layerIndex = 0; layerIndex < network.LayerCount(); ++layerIndex)
+    {
+        const LayerLayout& layer = network.Layer(layerIndex);
+        size += (layer.m_neurons + layer.m_neurons * layer.m_inputs) * valueSize;
+    }
+    // A float16 blob with an odd number of values is padded to a multiple of 4 bytes
+    size = (size + 3) & ~size_t(3);
+    std::vector<uint8_t> blob(size, 0);
+
+    WeightsBlobHeader header;
+    header.m_magic = c_weightsBlobMagic;
+    header.m_version = c_weightsBlobVersion;
+    header.m_dataType = uint32_t(dataType);
+    header.m_inputs = uint32_t(network.Inputs());
+    header.m_layerCount = uint32_t(network.LayerCount());
+    memcpy(&blob[0], &header, sizeof(header));
+
+    size_t offset = sizeof(WeightsBlobHeader);
+    for (size_t layerIndex = 0; layerIndex < network.LayerCount(); ++layerIndex)
+    {
+        WeightsBlobLayer layer;
+        layer.m_neurons = uint32_t(network.Layer(layerIndex).m_neurons);
+        layer.m_activation = uint32_t(network.Layer(layerIndex).m_activation);
+        memcpy(&blob[offset], &layer, sizeof(layer));
+        offset += sizeof(layer);
+    }
+
+    auto writeValues = [&] (const float* values, size_t count)
+    {
+        if (dataType == c_weightsFloat16)
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                uint16_t half = FloatToHalf(values[i]);
+                memcpy(&blob[offset + i * sizeof(half)], &half, sizeof(half));
+            }
+        }
+        else
+            memcpy(&blob[offset], values, count * sizeof(float));
+        offset += count * valueSize;
+    };
+
+    for (size_t layerIndex = 0; layerIndex < network.LayerCount(); ++layerIndex)
+    {
+        const LayerLayout& layer = network.Layer(layerIndex);
+        writeValues(network.LayerBiases(layerIndex), layer.m_neurons);
+        for (size_t neuronIndex = 0; neuronIndex < layer.m_neurons; ++neuronIndex)
+            writeValues(network.NeuronWeights(layerIndex, neuronIndex), layer.m_inputs);
+    }
+    return blob;
+}
+
+// Standard base64 with padding, which the browser decodes with atob()
+inline std::string EncodeBase64 (const uint8_t* data, size_t size)
+{
+    static const char c_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    std::string text;
+    text.reserve((size + 2) / 3 * 4);
+    size_t i = 0;
+    for (; i + 3 <= size; i += 3)
+    {
+        uint32_t triple = (uint32_t(data[i]) << 16) | (uint32_t(data[i + 1]) << 8) | data[i + 2];
+        text += c_alphabet[(triple >> 18) & 63];
+        text += c_alphabet[(triple >> 12) & 63];
+        text += c_alphabet[(triple >> 6) & 63];
+        text += c_alphabet[triple & 63];
+    }
+    if (i < size)
+    {
+        uint32_t triple = uint32_t(data[i]) << 16;
+        if (i + 1 < size)
+            triple |= uint32_t(data[i + 1]) << 8;
+        text += c_alphabet[(triple >> 18) & 63];
+        text += c_alphabet[(triple >> 12) & 63];
+        text += (i + 1 < size) ? c_alphabet[(triple >> 6) & 63] : '=';
+        text += '=';
+    }
+    return text;
+}
+
+inline bool WriteWholeFile (const char* fileName, const void* data, size_t size)
+{
+    FILE* file = fopen(fileName, "wb");
+    if (!file)
+    {
+        printf("Could not open %s for writing.\n", fileName);
+        return false;
+    }
+    bool written = fwrite(data, 1, size, file) == size;
+    written = (fclose(file) == 0) && written;
+    if (!written)
+        printf("Could not write %s.\n", fileName);
+    return written;
+}
+
+// The blob for the web demo to fetch, see the top of this file
+inline bool ExportWeightsBlob (const char* fileName, const NeuralNetwork& network, WeightsDataType dataType)
+{
+    std::vector<uint8_t> blob = BuildWeightsBlob(network, dataType);
+    return WriteWholeFile(fileName, blob.data(), blob.size());
+}
+
+// The blob as one line of base64, to paste into the g_neuralNetworkBase64 string of the web demo
+inline bool ExportWeightsBase64 (const char* fileName, const NeuralNetwork& network, WeightsDataType dataType)
+{
+    std::vector<uint8_t> blob = BuildWeightsBlob(network, dataType);
+    std::string text = EncodeBase64(blob.data(), blob.size()) + "\n";
+    return WriteWholeFile(fileName, text.data(), text.size());
+}
@@ -4,41 +4,204 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <random>
 #include <array>
 #include <vector>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include "aligned_allocator.h"
+#include "gemm.h"
+#include "thread_pool.h"
+#include "layer_topology.h"
+#include "checkpoint.h"
+#include "data_loader.h"
+#include "batch_prefetcher.h"
+#include "augmentation.h"
+#include "optimizer.h"
+#include "profiler.h"
 
-template <size_t inputs, size_t hidden_neurons, size_t output_neurons>
+/* A minibatch is split into shards of at least this many items when a thread pool is used.
+Every shard costs one extra gradient reduction, so very small shards are not worth it */
+const size_t c_minItemsPerShard = 2;
+
+// Evaluate() processes the data in blocks of this many items, every block is one parallel task
+const size_t c_evaluationBatchSize = 256;
+
+/* The first layer only reads the weights of the nonzero inputs (see SparseRows) of a batch with at most this fraction
+of nonzero inputs, denser batches run over all inputs. About 19% of the MNIST pixels are nonzero */
+const float c_maxSparseInputDensity = 0.5f;
+
+/* How Train() uses the threads of the pool:
+
+    c_synchronousTraining   every minibatch is split into shards, their derivatives are summed and applied in one
+                            update after all shards are done, which is a barrier per minibatch. Reproducible
+    c_hogwildTraining       every thread trains on single items it takes from a shared cursor and updates the
+                            shared parameters right away without any lock (Hogwild!), there is no barrier at all.
+                            Not reproducible with more than one thread */
+enum TrainingMode
+{
+    c_synchronousTraining,
+    c_hogwildTraining
+};
+
+// What the last Hogwild epoch did, see NeuralNetwork::HogwildTrainingStats()
+struct HogwildStats
+{
+    size_t m_workers = 0;
+    size_t m_items = 0;
+    double m_seconds = 0.0;
+
+    /* The staleness of an update is the number of updates that other threads applied between reading the parameters
+    for the forward pass of an item and applying its derivatives */
+    double m_meanStaleness = 0.0;
+    uint64_t m_maxStaleness = 0;
+
+    /* The mean fraction of nonzero inputs of the first layer. Only the weights of those inputs are updated, for MNIST
+    about a fifth of the first layer, which is why updates of different threads rarely touch the same weights */
+    double m_inputDensity = 0.0;
+
+    double ItemsPerSecond () const { return m_seconds > 0.0 ? double(m_items) / m_seconds : 0.0; }
+};
+
+/* The accuracy and the cost of the items of the last Train() call, collected from the forward passes of the training
+itself at no extra cost. Every item is scored with the parameters it was trained on, which change during the epoch,
+and augmented items are scored as augmented, so this estimates the training accuracy without another pass */
+struct TrainingStats
+{
+    size_t m_items = 0;
+    size_t m_correctItems = 0;
+    double m_cost = 0.0;
+
+    float Accuracy () const { return m_items > 0 ? float(m_correctItems) / float(m_items) : 0.0f; }
+    float Cost () const { return m_items > 0 ? float(m_cost / double(m_items)) : 0.0f; }
+};
+
+/* A network of dense layers whose shape is chosen at runtime, see NetworkTopology. The weights and biases of all layers
+live in one contiguous parameter arena (laid out by ComputeLayout()), so the update, the gradient reduction and
+checkpointing each run over a single array. */
 class NeuralNetwork
 {
+    // The benchmark times the private batch passes one by one
+    friend class NetworkBenchmark;
+
 public:
-    NeuralNetwork ()
+    // An empty network, e.g. to be filled by LoadCheckpoint()
+    NeuralNetwork () = default;
+
+    explicit NeuralNetwork (const NetworkTopology& topology)
+        : NeuralNetwork(topology, std::random_device()())
+    {
+    }
+
+    // The seed makes the initial weights and the order of the training data reproducible
+    NeuralNetwork (const NetworkTopology& topology, uint32_t seed)
     {
-        /* Set the initial weights and biases to random numbers drawn from a 
-        Gaussian distribution with a mean of 0 and standard deviation of 1.0 */
-        std::random_device rd;
-        std::mt19937 e2(rd());
+        Reset(topology, seed);
+    }
+
+    // Rebuilds the network with random weights, the training starts again from epoch 0
+    void Reset (const NetworkTopology& topology, uint32_t seed)
+    {
+        m_topology = topology;
+        m_parameters.assign(ComputeLayout(topology, m_layout), 0.0f);
+        m_forwardKernels.resize(m_layout.size());
+        for (size_t layerIndex = 0; layerIndex < m_layout.size(); ++layerIndex)
+            m_forwardKernels[layerIndex] = SelectDenseForwardKernel(m_layout[layerIndex].m_inputs, m_layout[layerIndex].m_neurons);
+        m_seed = seed;
+        m_epoch = 0;
+        m_optimizer.Reset(m_parameters.size());
+
+        /* Set the initial weights and biases to random numbers drawn from a Gaussian distribution with a mean of 0 and
+        standard deviation of 1.0. ReLU and softmax layers scale that by sqrt(2 / inputs) and sqrt(1 / inputs),
+        otherwise the sums of a wide layer would start far outside the useful range of the activation function */
+        std::mt19937 e2(seed);
         std::normal_distribution<float> dist(0, 1);
- 
-        for (float& f : m_hiddenLayerBiases)
-            f = dist(e2);
- 
-        for (float& f : m_outputLayerBiases)
-            f = dist(e2);
- 
-        for (float& f : m_hiddenLayerWeights)
-            f = dist(e2);
- 
-        for (float& f : m_outputLayerWeights)
-            f = dist(e2);
-    }
- 
+
+        for (const LayerLayout& layer : m_layout)
+        {
+            for (size_t i = 0; i < layer.m_neurons; ++i)
+                m_parameters[layer.m_biasesOffset + i] = dist(e2) * InitialScale(layer);
+        }
+
+        for (const LayerLayout& layer : m_layout)
+        {
+            for (size_t neuronIndex = 0; neuronIndex < layer.m_neurons; ++neuronIndex)
+                for (size_t inputIndex = 0; inputIndex < layer.m_inputs; ++inputIndex)
+                    m_parameters[layer.m_weightsOffset + neuronIndex * layer.m_weightsStride + inputIndex] = dist(e2) * InitialScale(layer);
+        }
+        m_trainingLayout = false;
+        UpdateInputMajorWeights();
+    }
+
+    const NetworkTopology& Topology () const { return m_topology; }
+    size_t Inputs () const { return m_topology.m_inputs; }
+    size_t Outputs () const { return m_topology.Outputs(); }
+    size_t LayerCount () const { return m_layout.size(); }
+
+    // The shape of a layer and the position of its weights and biases in the parameter arena
+    const LayerLayout& Layer (size_t layerIndex) const { return m_layout[layerIndex]; }
+
+    /* The weights of a layer as [neurons x inputs], a row per neuron. The rows of the arena are padded to whole cache
+    lines (see ComputeLayout()), so every row is contiguous, but the matrix is not. Not valid for the first layer during Train() */
+    const float* NeuronWeights (size_t layerIndex, size_t neuronIndex) const { return LayerWeights(layerIndex) + neuronIndex * m_layout[layerIndex].m_weightsStride; }
+    float Weight (size_t layerIndex, size_t neuronIndex, size_t inputIndex) const { return NeuronWeights(layerIndex, neuronIndex)[inputIndex]; }
+
+    // A tightly packed copy of the weights of a layer, e.g. for exporting them
+    std::vector<float> GetLayerWeights (size_t layerIndex) const
+    {
+        const LayerLayout& layer = m_layout[layerIndex];
+        std::vector<float> weights(layer.m_neurons * layer.m_inputs);
+        for (size_t neuronIndex = 0; neuronIndex < layer.m_neurons; ++neuronIndex)
+            std::copy_n(NeuronWeights(layerIndex, neuronIndex), layer.m_inputs, &weights[neuronIndex * layer.m_inputs]);
+        return weights;
+    }
+
+    const float* LayerBiases (size_t layerIndex) const { return &m_parameters[m_layout[layerIndex].m_biasesOffset]; }
+
+    // The whole parameter arena with its padding
+    const AlignedVector<float>& Parameters () const { return m_parameters; }
+
+    // Replaces the whole parameter arena, e.g. with a copy of Parameters() from an earlier epoch. Not during Train()
+    bool SetParameters (const AlignedVector<float>& parameters)
+    {
+        if (parameters.size() != m_parameters.size())
+        {
+            printf("%zu parameters do not fit the %s network.\n", parameters.size(), m_topology.ToString().c_str());
+            return false;
+        }
+        m_parameters = parameters;
+        UpdateInputMajorWeights();
+        return true;
+    }
+
+    /* Training runs data-parallel on the given pool, nullptr trains on the calling thread only.
+    For a fixed seed the results are reproducible as long as the thread count does not change */
+    void SetThreadPool (ThreadPool* threadPool) { m_threadPool = threadPool; }
+
+    /* The first layer skips the zero inputs of sparse batches in training and inference (the default), false runs it
+    on all inputs like the other layers */
+    void SetSparseInputs (bool sparseInputs) { m_sparseInputs = sparseInputs; }
+
+    /* How the synchronous training applies the derivatives and how the learning rate changes over the epochs.
+    Changing the optimizer type starts its state from zero. Hogwild training follows the schedule but always takes
+    plain SGD steps, every thread updating its own copy of a velocity would not be momentum any more */
+    void SetOptimizer (const OptimizerSettings& settings) { m_optimizer.SetSettings(settings); }
+    const OptimizerSettings& GetOptimizer () const { return m_optimizer.Settings(); }
+
+    /* learningRate is the rate of the schedule, see OptimizerSettings::LearningRateFactor(). In both modes the
+    derivatives are averaged over the minibatch, so a Hogwild update of a single item moves the parameters as far
+    as its share of a synchronous minibatch update would */
     void Train (const MNISTData& trainingData, size_t miniBatchSize, float learningRate)
     {
-        // Randomize the order of the training data to create mini-batches
-        if (m_trainingOrder.size() != trainingData.NumImages())
+        PROFILE_ZONE(c_trainZone);
+
+        /* Randomize the order of the training data to create mini-batches. The order only depends on the seed
+        and the epoch, so training that is resumed from a checkpoint continues exactly as it would have */
         {
+            PROFILE_ZONE(c_shuffleZone);
             m_trainingOrder.resize(trainingData.NumImages());
             size_t index = 0;
             for (size_t& v : m_trainingOrder)
@@ -46,202 +209,862 @@ public:
                 v = index;
                 ++index;
             }
+            std::seed_seq shuffleSeed = { m_seed, m_epoch };
+            std::mt19937 e2(shuffleSeed);
+            std::shuffle(m_trainingOrder.begin(), m_trainingOrder.end(), e2);
         }
-        static std::random_device rd;
-        static std::mt19937 e2(rd());
-        std::shuffle(m_trainingOrder.begin(), m_trainingOrder.end(), e2);
- 
-        // Process all minibatches until we are out of training examples
-        size_t trainingIndex = 0;
-        while (trainingIndex < trainingData.NumImages())
-        {
-            // Clear out minibatch derivatives. Sum up and then divide them at the end of the minibatch
-            std::fill(m_miniBatchHiddenLayerBiasesDeltaCost.begin(), m_miniBatchHiddenLayerBiasesDeltaCost.end(), 0.0f);
-            std::fill(m_miniBatchOutputLayerBiasesDeltaCost.begin(), m_miniBatchOutputLayerBiasesDeltaCost.end(), 0.0f);
-            std::fill(m_miniBatchHiddenLayerWeightsDeltaCost.begin(), m_miniBatchHiddenLayerWeightsDeltaCost.end(), 0.0f);
-            std::fill(m_miniBatchOutputLayerWeightsDeltaCost.begin(), m_miniBatchOutputLayerWeightsDeltaCost.end(), 0.0f);
- 
-            // Process the minibatch
-            size_t miniBatchIndex = 0;
-            while (miniBatchIndex < miniBatchSize && trainingIndex < trainingData.NumImages())
-            {
-                // Get the training item
-                uint8_t imageLabel = 0;
-                const float* pixels = trainingData.GetImage(m_trainingOrder[trainingIndex], imageLabel);
- 
-                // Run the forward pass of the network
-                uint8_t labelDetected = ForwardPass(pixels, imageLabel);
- 
-                // Run the backward pass to get derivatives of the cost function
-                BackwardPass(pixels, imageLabel);
- 
-                /* Adding current derivatives into the minibatch derivative arrays 
-                we can average them at the end of the minibatch via division */
-                for (size_t i = 0; i < m_hiddenLayerBiasesDeltaCost.size(); ++i)
-                    m_miniBatchHiddenLayerBiasesDeltaCost[i] += m_hiddenLayerBiasesDeltaCost[i];
-                for (size_t i = 0; i < m_outputLayerBiasesDeltaCost.size(); ++i)
-                    m_miniBatchOutputLayerBiasesDeltaCost[i] += m_outputLayerBiasesDeltaCost[i];
-                for (size_t i = 0; i < m_hiddenLayerWeightsDeltaCost.size(); ++i)
-                    m_miniBatchHiddenLayerWeightsDeltaCost[i] += m_hiddenLayerWeightsDeltaCost[i];
-                for (size_t i = 0; i < m_outputLayerWeightsDeltaCost.size(); ++i)
-                    m_miniBatchOutputLayerWeightsDeltaCost[i] += m_outputLayerWeightsDeltaCost[i];
- 
-                // Add another item to the minibatch and used another training example
-                ++trainingIndex;
-                ++miniBatchIndex;
-            }
- 
-            /* Divide the derivatives of the mini-series by the number of elements in 
-            the mini-series to get the average value of the derivatives */
-            float miniBatchLearningRate = learningRate / float(miniBatchIndex);
-
-            /* Important: Instead of doing this explicitly like in the commented code below, 
-            I did that implicitly above by dividing the learning rate by miniBatchIndex
-            
-            for (float& f : m_miniBatchHiddenLayerBiasesDeltaCost)  f /= float(miniBatchIndex);
-            for (float& f : m_miniBatchOutputLayerBiasesDeltaCost)  f /= float(miniBatchIndex);
-            for (float& f : m_miniBatchHiddenLayerWeightsDeltaCost) f /= float(miniBatchIndex);
-            for (float& f : m_miniBatchOutputLayerWeightsDeltaCost) f /= float(miniBatchIndex); */
- 
-            // Application training to biases and weights
-            for (size_t i = 0; i < m_hiddenLayerBiases.size(); ++i)
-                m_hiddenLayerBiases[i] -= m_miniBatchHiddenLayerBiasesDeltaCost[i] * miniBatchLearningRate;
-            for (size_t i = 0; i < m_outputLayerBiases.size(); ++i)
-                m_outputLayerBiases[i] -= m_miniBatchOutputLayerBiasesDeltaCost[i] * miniBatchLearningRate;
-            for (size_t i = 0; i < m_hiddenLayerWeights.size(); ++i)
-                m_hiddenLayerWeights[i] -= m_miniBatchHiddenLayerWeightsDeltaCost[i] * miniBatchLearningRate;
-            for (size_t i = 0; i < m_outputLayerWeights.size(); ++i)
-                m_outputLayerWeights[i] -= m_miniBatchOutputLayerWeightsDeltaCost[i] * miniBatchLearningRate;
-        }
-    }
- 
-    // This function evaluates the network for the given input pixels and returns the predicted label, which can range from 0 to 9
-    uint8_t ForwardPass (const float* pixels, uint8_t correctLabel)
+
+        // The first layer is trained input-major, see InputMajorWeights()
+        if (m_sparseInputs)
+            BeginTrainingLayout();
+
+        for (Workspace& workspace : m_workspaces)
+            workspace.m_stats = TrainingStats();
+
+        if (m_trainingMode == c_hogwildTraining)
+            TrainHogwild(trainingData, learningRate / float(std::max<size_t>(miniBatchSize, 1)));
+        else
+            TrainSynchronous(trainingData, miniBatchSize, learningRate);
+
+        m_trainingStats = TrainingStats();
+        for (const Workspace& workspace : m_workspaces)
+        {
+            m_trainingStats.m_items += workspace.m_stats.m_items;
+            m_trainingStats.m_correctItems += workspace.m_stats.m_correctItems;
+            m_trainingStats.m_cost += workspace.m_stats.m_cost;
+        }
+
+        if (m_trainingLayout)
+            EndTrainingLayout();
+        else
+            UpdateInputMajorWeights();
+        ++m_epoch;
+    }
+
+    /* The number of threads that gather the training minibatches in the background, 0 gathers them
+    on the training thread between the minibatches */
+    void SetPrefetchThreads (size_t threadCount) { m_prefetchThreads = threadCount; }
+
+    /* Train() distorts every training image with the augmenter on the prefetch threads, nullptr trains on the
+    images as they are. The augmenter must be made for the image size of the training data */
+    void SetAugmenter (const ImageAugmenter* augmenter) { m_augmenter = augmenter; }
+
+    // How long the last Train() call waited for its input batches, Hogwild epochs read their items without prefetching
+    const PrefetchStats& InputStats () const { return m_inputStats; }
+
+    // See TrainingMode, the default is c_synchronousTraining
+    void SetTrainingMode (TrainingMode mode) { m_trainingMode = mode; }
+    TrainingMode GetTrainingMode () const { return m_trainingMode; }
+
+    // The throughput and the staleness of the updates of the last Hogwild epoch
+    const HogwildStats& HogwildTrainingStats () const { return m_hogwildStats; }
+
+    // The running accuracy and cost of the last epoch, in both training modes
+    const TrainingStats& TrainingStatistics () const { return m_trainingStats; }
+
+    // The number of completed calls to Train()
+    uint32_t Epoch () const { return m_epoch; }
+
+    /* Writes the topology, the parameters and the training state with the optimizer to a binary checkpoint, see checkpoint.h.
+    training and bestParameters (a copy of Parameters() from an earlier epoch) are the state of EarlyStopping */
+    bool SaveCheckpoint (const char* fileName, const CheckpointTraining* training = nullptr, const AlignedVector<float>* bestParameters = nullptr) const
     {
-        for (size_t neuronIndex = 0; neuronIndex < hidden_neurons; ++neuronIndex)
+        PROFILE_ZONE(c_checkpointZone);
+        CheckpointOptimizer optimizer = {};
+        optimizer.m_type = uint32_t(m_optimizer.Settings().m_type);
+        optimizer.m_stateSlots = uint32_t(m_optimizer.StateSlots());
+        optimizer.m_steps = m_optimizer.Steps();
+
+        // The file holds the rows without their padding, so it does not depend on the cache line size
+        std::vector<LayerLayout> packedLayout;
+        std::vector<float> parameters(ComputeLayout(m_topology, packedLayout, false), 0.0f);
+        std::vector<float> state(m_optimizer.StateSlots() * parameters.size(), 0.0f);
+        CopyParameters(m_layout, m_parameters.data(), packedLayout, parameters.data());
+        for (size_t slot = 0; slot < m_optimizer.StateSlots(); ++slot)
+            CopyParameters(m_layout, m_optimizer.State(slot), packedLayout, &state[slot * parameters.size()]);
+        std::vector<float> best(bestParameters ? parameters.size() : 0, 0.0f);
+        if (bestParameters)
+            CopyParameters(m_layout, bestParameters->data(), packedLayout, best.data());
+        return WriteCheckpoint(fileName, m_topology, m_seed, m_epoch, parameters.data(), parameters.size(), &optimizer, state.data(),
+                               training, bestParameters ? best.data() : nullptr);
+    }
+
+    /* Restores a checkpoint written by SaveCheckpoint(), Train() then continues with the next epoch.
+    The network takes the topology stored in the file. The state of the optimizer is restored if the file was
+    written with the same optimizer type as the current one, otherwise it starts from zero. training and
+    bestParameters receive what SaveCheckpoint() was given, bestParameters stays empty if the file has none */
+    bool LoadCheckpoint (const char* fileName, CheckpointTraining* training = nullptr, AlignedVector<float>* bestParameters = nullptr)
+    {
+        CheckpointFile file;
+        if (!file.Open(fileName))
+            return false;
+
+        Reset(file.Topology(), file.Seed());
+        for (size_t layerIndex = 0; layerIndex < m_layout.size(); ++layerIndex)
         {
-            float Z = m_hiddenLayerBiases[neuronIndex];
- 
-            for (size_t inputIndex = 0; inputIndex < inputs; ++inputIndex)
-                Z += pixels[inputIndex] * m_hiddenLayerWeights[HiddenLayerWeightIndex(inputIndex, neuronIndex)];
- 
-            m_hiddenLayerOutputs[neuronIndex] = 1.0f / (1.0f + std::exp(-Z));
+            const LayerLayout& layer = m_layout[layerIndex];
+            for (size_t neuronIndex = 0; neuronIndex < layer.m_neurons; ++neuronIndex)
+                std::copy_n(file.Weights(layerIndex) + neuronIndex * layer.m_inputs, layer.m_inputs, &m_parameters[layer.m_weightsOffset + neuronIndex * layer.m_weightsStride]);
+            std::copy_n(file.Biases(layerIndex), layer.m_neurons, &m_parameters[layer.m_biasesOffset]);
         }
- 
-        for (size_t neuronIndex = 0; neuronIndex < output_neurons; ++neuronIndex)
+        m_epoch = file.Epoch();
+        UpdateInputMajorWeights();
+
+        std::vector<LayerLayout> packedLayout;
+        ComputeLayout(m_topology, packedLayout, false);
+        if (training)
+            *training = file.Training();
+        if (bestParameters)
         {
-            float Z = m_outputLayerBiases[neuronIndex];
- 
-            for (size_t inputIndex = 0; inputIndex < hidden_neurons; ++inputIndex)
-                Z += m_hiddenLayerOutputs[inputIndex] * m_outputLayerWeights[OutputLayerWeightIndex(inputIndex, neuronIndex)];
- 
-            m_outputLayerOutputs[neuronIndex] = 1.0f / (1.0f + std::exp(-Z));
+            bestParameters->clear();
+            if (file.HasBestParameters())
+            {
+                bestParameters->assign(m_parameters.size(), 0.0f);
+                CopyParameters(packedLayout, file.BestParameters(), m_layout, bestParameters->data());
+            }
         }
- 
-        // Finding the maximum value of the output layer and return the index as the label
-        float maxOutput = m_outputLayerOutputs[0];
-        uint8_t maxLabel = 0;
-        for (uint8_t neuronIndex = 1; neuronIndex < output_neurons; ++neuronIndex)
+
+        if (file.HasOptimizerState() && file.Optimizer().m_type == uint32_t(m_optimizer.Settings().m_type) && file.Optimizer().m_stateSlots == m_optimizer.StateSlots())
         {
-            if (m_outputLayerOutputs[neuronIndex] > maxOutput)
+            for (size_t slot = 0; slot < m_optimizer.StateSlots(); ++slot)
+                CopyParameters(packedLayout, file.OptimizerState(slot), m_layout, m_optimizer.State(slot));
+            m_optimizer.SetSteps(file.Optimizer().m_steps);
+        }
+        else if (m_optimizer.StateSlots() > 0)
+            printf("%s has no %s state, the optimizer starts from zero.\n", fileName, OptimizerName(m_optimizer.Settings().m_type));
+        return true;
+    }
+
+    // This function evaluates the network for the given input pixels and returns the predicted label, which can range from 0 to 9
+    uint8_t ForwardPass (const float* pixels, uint8_t correctLabel) const
+    {
+        (void)correctLabel;
+        thread_local std::vector<float> outputs;
+        outputs.resize(Outputs());
+
+        uint8_t label;
+        ForwardPass(pixels, 1, outputs.data(), &label);
+        return label;
+    }
+
+    /* Evaluates batchSize items at once. batchInputs holds a row of Inputs() values per item, batchOutputs receives
+    Outputs() values per item and labels (unless it is nullptr) the detected label of every item.
+    This does not modify the network, so it can be called from several threads at once */
+    void ForwardPass (const float* batchInputs, size_t batchSize, float* batchOutputs, uint8_t* labels) const
+    {
+        thread_local Workspace workspace;
+        workspace.Resize(*this, batchSize, false);
+        ForwardBatch(workspace, batchInputs, batchSize, CompressInputs(workspace, batchInputs, batchSize));
+
+        const std::vector<float>& outputs = workspace.m_outputs.back();
+        std::copy_n(outputs.begin(), batchSize * Outputs(), batchOutputs);
+        if (labels)
+        {
+            for (size_t batchIndex = 0; batchIndex < batchSize; ++batchIndex)
             {
-                maxOutput = m_outputLayerOutputs[neuronIndex];
-                maxLabel = neuronIndex;
+                const float* O = &batchOutputs[batchIndex * Outputs()];
+                labels[batchIndex] = uint8_t(std::max_element(O, O + Outputs()) - O);
             }
         }
-        return maxLabel;
     }
- 
-    // Functions to get weights / bias values. They are used to make the JSON file
-    const std::array<float, hidden_neurons>& GetHiddenLayerBiases () const { return m_hiddenLayerBiases; }
-    const std::array<float, output_neurons>& GetOutputLayerBiases () const { return m_outputLayerBiases; }
-    const std::array<float, inputs * hidden_neurons>& GetHiddenLayerWeights () const { return m_hiddenLayerWeights; }
-    const std::array<float, hidden_neurons * output_neurons>& GetOutputLayerWeights () const { return m_outputLayerWeights; }
- 
+
+    // The result of evaluating the network on a dataset
+    struct Evaluation
+    {
+        float m_accuracy = 0.0f;
+
+        // The cost that is minimized by training (cross-entropy for a softmax output layer, else quadratic), averaged over all items
+        float m_cost = 0.0f;
+
+        // m_confusionMatrix[correctLabel][detectedLabel] counts how often a label was detected for a correct label
+        std::vector<std::vector<size_t>> m_confusionMatrix;
+    };
+
+    /* Evaluates the network on every item of the dataset in a single pass, or only on the given items (indices into the
+    dataset), e.g. a fixed sample of a validation split. This does not modify the network, the scratch memory is thread
+    local, so it is safe to call from several threads at once. The blocks are processed on the thread pool and their
+    results are combined in a fixed order */
+    Evaluation Evaluate (const MNISTData& data, const std::vector<size_t>* items = nullptr) const
+    {
+        PROFILE_ZONE(c_evaluateZone);
+        const size_t outputs = Outputs();
+        struct BlockResult
+        {
+            size_t m_correctItems = 0;
+            float m_cost = 0.0f;
+            std::vector<std::vector<size_t>> m_confusionMatrix;
+        };
+
+        const size_t itemCount = items ? items->size() : data.NumImages();
+        const size_t blockCount = (itemCount + c_evaluationBatchSize - 1) / c_evaluationBatchSize;
+        std::vector<BlockResult> blockResults(blockCount);
+
+        RunParallel(blockCount, [&] (size_t blockIndex)
+        {
+            thread_local Workspace workspace;
+            workspace.Resize(*this, c_evaluationBatchSize, false);
+
+            size_t begin = blockIndex * c_evaluationBatchSize;
+            size_t batchSize = std::min(c_evaluationBatchSize, itemCount - begin);
+            auto itemIndex = [&] (size_t batchIndex) { return items ? (*items)[begin + batchIndex] : begin + batchIndex; };
+
+            // The nonzero pixels are taken from the uint8 images directly, only a dense block is converted completely
+            const SparseRows* sparseInputs = nullptr;
+            if (m_sparseInputs)
+            {
+                workspace.m_sparseInputs.Clear();
+                for (size_t batchIndex = 0; batchIndex < batchSize; ++batchIndex)
+                    data.GetSparseImage(itemIndex(batchIndex), workspace.m_sparseInputs, Inputs(), workspace.m_labels[batchIndex]);
+                sparseInputs = SparseEnough(workspace.m_sparseInputs);
+            }
+            if (!sparseInputs)
+            {
+                for (size_t batchIndex = 0; batchIndex < batchSize; ++batchIndex)
+                    PackImage(data, itemIndex(batchIndex), workspace, batchIndex);
+            }
+
+            ForwardBatch(workspace, workspace.m_inputs.data(), batchSize, sparseInputs);
+
+            BlockResult& result = blockResults[blockIndex];
+            result.m_confusionMatrix.assign(outputs, std::vector<size_t>(outputs, 0));
+            for (size_t batchIndex = 0; batchIndex < batchSize; ++batchIndex)
+            {
+                const float* O = &workspace.m_outputs.back()[batchIndex * outputs];
+                uint8_t correctLabel = workspace.m_labels[batchIndex];
+                result.m_cost += ItemCost(O, correctLabel);
+
+                uint8_t detectedLabel = uint8_t(std::max_element(O, O + outputs) - O);
+                if (detectedLabel == correctLabel)
+                    ++result.m_correctItems;
+                if (correctLabel < outputs)
+                    ++result.m_confusionMatrix[correctLabel][detectedLabel];
+            }
+        });
+
+        Evaluation evaluation;
+        evaluation.m_confusionMatrix.assign(outputs, std::vector<size_t>(outputs, 0));
+        size_t correctItems = 0;
+        double cost = 0.0;
+        for (const BlockResult& result : blockResults)
+        {
+            correctItems += result.m_correctItems;
+            cost += result.m_cost;
+            for (size_t i = 0; i < outputs; ++i)
+                for (size_t j = 0; j < outputs; ++j)
+                    evaluation.m_confusionMatrix[i][j] += result.m_confusionMatrix[i][j];
+        }
+
+        if (itemCount > 0)
+        {
+            evaluation.m_accuracy = float(correctItems) / float(itemCount);
+            evaluation.m_cost = float(cost / double(itemCount));
+        }
+        return evaluation;
+    }
+
 private:
- 
-    static size_t HiddenLayerWeightIndex (size_t inputIndex, size_t hiddenLayerNeuronIndex)
+
+    /* Scratch memory for one shard of a minibatch. Nothing in here is shared between threads,
+    so any number of shards can run their forward and backward passes at the same time */
+    struct Workspace
+    {
+        // Training also needs the derivative arrays, evaluation only the activations
+        void Resize (const NeuralNetwork& network, size_t batchSize, bool derivatives)
+        {
+            m_inputs.resize(batchSize * network.Inputs());
+            m_labels.resize(batchSize);
+            m_outputs.resize(network.LayerCount());
+            m_deltaCosts.resize(network.LayerCount());
+            for (size_t layerIndex = 0; layerIndex < network.LayerCount(); ++layerIndex)
+            {
+                m_outputs[layerIndex].resize(batchSize * network.Layer(layerIndex).m_neurons);
+                m_deltaCosts[layerIndex].resize(batchSize * network.Layer(layerIndex).m_neurons);
+            }
+
+            if (derivatives)
+                m_gradients.resize(network.m_parameters.size());
+        }
+
+        // Adds the derivatives of another shard to the derivatives of this one
+        void AddDerivatives (const Workspace& other)
+        {
+            MultiplyAdd(m_gradients.data(), 1.0f, other.m_gradients.data(), m_gradients.size());
+        }
+
+        /* Items packed as [batch x inputs] for the evaluation (training reads them from the prefetched minibatch)
+        and the per-item layer outputs and deltaCost/deltaZ values, one row per item */
+        std::vector<float>                  m_inputs;
+        std::vector<uint8_t>                m_labels;
+        std::vector<std::vector<float>>     m_outputs;
+        std::vector<std::vector<float>>     m_deltaCosts;
+
+        // Derivatives of biases and weights summed over all items of the shard, laid out like the parameter arena
+        AlignedVector<float>                m_gradients;
+
+        // The running accuracy and cost of the items this workspace trained on in the current epoch
+        TrainingStats                       m_stats;
+
+        // The nonzero inputs of the evaluated items and of a Hogwild item
+        SparseRows                          m_sparseInputs;
+
+        // The indices of the nonzero inputs of a layer and the update of every neuron, for the sparse Hogwild updates
+        std::vector<uint32_t>               m_nonzeroInputs;
+        std::vector<float>                  m_steps;
+    };
+
+    static float InitialScale (const LayerLayout& layer)
     {
-        return hiddenLayerNeuronIndex * inputs + inputIndex;
+        switch (layer.m_activation)
+        {
+            case c_reluActivation:    return std::sqrt(2.0f / float(layer.m_inputs));
+            case c_softmaxActivation: return std::sqrt(1.0f / float(layer.m_inputs));
+            default:                  return 1.0f;
+        }
     }
- 
-    static size_t OutputLayerWeightIndex (size_t hiddenLayerNeuronIndex, size_t outputLayerNeuronIndex)
+
+    // Adds the items of the last forward pass in the workspace to its running training statistics
+    void ScoreItems (Workspace& workspace, const uint8_t* labels, size_t batchSize) const
     {
-        return outputLayerNeuronIndex * hidden_neurons + hiddenLayerNeuronIndex;
+        const size_t outputs = Outputs();
+        for (size_t batchIndex = 0; batchIndex < batchSize; ++batchIndex)
+        {
+            const float* O = &workspace.m_outputs.back()[batchIndex * outputs];
+            workspace.m_stats.m_cost += ItemCost(O, labels[batchIndex]);
+            if (size_t(std::max_element(O, O + outputs) - O) == labels[batchIndex])
+                ++workspace.m_stats.m_correctItems;
+        }
+        workspace.m_stats.m_items += batchSize;
     }
- 
-    /* This function calculates the gradient needed for training by backpropagating the error of 
-    the network, using the neuron output values from the forward pass. It determines the error 
-    by comparing the label predicted by the network to the correct label */
 
-    void BackwardPass (const float* pixels, uint8_t correctLabel)
+    // The cost of one item, Evaluate() averages it over the dataset
+    float ItemCost (const float* O, uint8_t correctLabel) const
     {
-        // Since we are proceeding backwards, we are starting with the output layer
-        for (size_t neuronIndex = 0; neuronIndex < output_neurons; ++neuronIndex)
+        if (m_layout.back().m_activation == c_softmaxActivation)
+            return correctLabel < Outputs() ? -std::log(std::max(O[correctLabel], 1e-30f)) : 0.0f;
+
+        float cost = 0.0f;
+        for (size_t neuronIndex = 0; neuronIndex < Outputs(); ++neuronIndex)
         {
             float desiredOutput = (correctLabel == neuronIndex) ? 1.0f : 0.0f;
- 
-            float deltaCost_deltaO = m_outputLayerOutputs[neuronIndex] - desiredOutput;
-            float deltaO_deltaZ = m_outputLayerOutputs[neuronIndex] * (1.0f - m_outputLayerOutputs[neuronIndex]);
- 
-            m_outputLayerBiasesDeltaCost[neuronIndex] = deltaCost_deltaO * deltaO_deltaZ;
- 
-            // Calculating deltaCost/deltaWeight for each weight going into the neuron
-            for (size_t inputIndex = 0; inputIndex < hidden_neurons; ++inputIndex)
-                m_outputLayerWeightsDeltaCost[OutputLayerWeightIndex(inputIndex, neuronIndex)] = m_outputLayerBiasesDeltaCost[neuronIndex] * m_hiddenLayerOutputs[inputIndex];
-        }
- 
-        for (size_t neuronIndex = 0; neuronIndex < hidden_neurons; ++neuronIndex)
-        {
-            /* To calculate the error (deltaCost/deltaBias) for each hidden neuron we are following these steps:
-
-            1. Multiply the deltaCost/deltaDestinationZ, which is already calculated and stored in 
-            m_outputLayerBiasesDeltaCost[destinationNeuronIndex], by the weight connecting the source and target neurons. 
-            This multiplication gives the error value for the neuron
-            2. Multiply the neuron's output (O) by (1 - O) to obtain deltaO/deltaZ
-            3. Compute deltaCost/deltaZ by multiplying the error by deltaO/deltaZ
-            
-            By following these steps, you can calculate the error (deltaCost/deltaBias) for each hidden neuron */
-
-            float deltaCost_deltaO = 0.0f;
-            for (size_t destinationNeuronIndex = 0; destinationNeuronIndex < output_neurons; ++destinationNeuronIndex)
-                deltaCost_deltaO += m_outputLayerBiasesDeltaCost[destinationNeuronIndex] * m_outputLayerWeights[OutputLayerWeightIndex(neuronIndex, destinationNeuronIndex)];
-            float deltaO_deltaZ = m_hiddenLayerOutputs[neuronIndex] * (1.0f - m_hiddenLayerOutputs[neuronIndex]);
-            m_hiddenLayerBiasesDeltaCost[neuronIndex] = deltaCost_deltaO * deltaO_deltaZ;
- 
-            // Calculating deltaCost/deltaWeight for each weight going into the neuron
-            for (size_t inputIndex = 0; inputIndex < inputs; ++inputIndex)
-                m_hiddenLayerWeightsDeltaCost[HiddenLayerWeightIndex(inputIndex, neuronIndex)] = m_hiddenLayerBiasesDeltaCost[neuronIndex] * pixels[inputIndex];
-        }
-    }
- 
+            cost += 0.5f * (O[neuronIndex] - desiredOutput) * (O[neuronIndex] - desiredOutput);
+        }
+        return cost;
+    }
+
+    /* Converts one image into row batchIndex of the workspace input matrix. The image may have fewer
+    pixels than the network has inputs, the remaining inputs are fed with zeros */
+    void PackImage (const MNISTData& data, size_t imageIndex, Workspace& workspace, size_t batchIndex) const
+    {
+        data.GetImage(imageIndex, &workspace.m_inputs[batchIndex * Inputs()], Inputs(), workspace.m_labels[batchIndex]);
+    }
+
+    // The sparse rows if they are sparse enough for the first layer to skip the zero inputs, else nullptr
+    const SparseRows* SparseEnough (const SparseRows& rows) const
+    {
+        return rows.Density(Inputs()) <= c_maxSparseInputDensity ? &rows : nullptr;
+    }
+
+    // Collects the nonzero inputs of dense rows in the workspace, returns nullptr if the first layer should run dense
+    const SparseRows* CompressInputs (Workspace& workspace, const float* batchInputs, size_t batchSize) const
+    {
+        if (!m_sparseInputs)
+            return nullptr;
+        workspace.m_sparseInputs.Clear();
+        for (size_t batchIndex = 0; batchIndex < batchSize; ++batchIndex)
+            workspace.m_sparseInputs.AppendRow(&batchInputs[batchIndex * Inputs()], Inputs());
+        return SparseEnough(workspace.m_sparseInputs);
+    }
+
+    // The neuron-major weights of a layer with m_weightsStride floats per row. Not valid for the first layer during Train()
+    const float* LayerWeights (size_t layerIndex) const { return &m_parameters[m_layout[layerIndex].m_weightsOffset]; }
+
+    /* The weights of the first layer input-major, [inputs x neurons] with the weights of all neurons for one input in a
+    row of m_inputMajorStride floats. The forward pass of an item then sums up the rows of its nonzero inputs scaled by the
+    inputs (SumScaledRows()), and the weight derivatives of an item only change those rows (AddScaledRows()), both with
+    contiguous, aligned vector loads. During Train() the parameter arena itself holds the first layer this way, so the
+    gradient reduction and the update still run over one array; otherwise a copy of it is kept next to the arena */
+    const float* InputMajorWeights () const
+    {
+        return m_trainingLayout ? &m_parameters[m_layout[0].m_weightsOffset] : m_inputMajorWeights.data();
+    }
+
+    // Must be called whenever the parameters were changed outside of Train()
+    void UpdateInputMajorWeights ()
+    {
+        const LayerLayout& layer = m_layout[0];
+        m_inputMajorWeights.assign(layer.InputMajorSize(), 0.0f);
+        TransposeMatrix(layer.m_neurons, layer.m_inputs, LayerWeights(0), layer.m_weightsStride, m_inputMajorWeights.data(), layer.m_inputMajorStride);
+    }
+
+    // The state of the optimizer is laid out like the arena, so its first layer is transposed along with the weights
+    void BeginTrainingLayout ()
+    {
+        const LayerLayout& layer = m_layout[0];
+        std::copy(m_inputMajorWeights.begin(), m_inputMajorWeights.end(), &m_parameters[layer.m_weightsOffset]);
+        TransposeOptimizerState(layer.m_neurons, layer.m_inputs, layer.m_weightsStride, layer.m_inputMajorStride);
+        m_trainingLayout = true;
+    }
+
+    // The padding of the rows is cleared, so the neuron-major rows are padded with zeros again
+    void EndTrainingLayout ()
+    {
+        const LayerLayout& layer = m_layout[0];
+        float* weights = &m_parameters[layer.m_weightsOffset];
+        std::copy(weights, weights + m_inputMajorWeights.size(), m_inputMajorWeights.begin());
+        std::fill(weights, weights + std::max(layer.WeightsSize(), layer.InputMajorSize()), 0.0f);
+        TransposeMatrix(layer.m_inputs, layer.m_neurons, m_inputMajorWeights.data(), layer.m_inputMajorStride, weights, layer.m_weightsStride);
+        TransposeOptimizerState(layer.m_inputs, layer.m_neurons, layer.m_inputMajorStride, layer.m_weightsStride);
+        m_trainingLayout = false;
+    }
+
+    // Transposes the [rows x columns] first layer of every slot of the optimizer state from rows of stride floats to rows of transposedStride
+    void TransposeOptimizerState (size_t rows, size_t columns, size_t stride, size_t transposedStride)
+    {
+        const LayerLayout& layer = m_layout[0];
+        std::vector<float> transposed(std::max(layer.WeightsSize(), layer.InputMajorSize()));
+        for (size_t slot = 0; slot < m_optimizer.StateSlots(); ++slot)
+        {
+            float* state = m_optimizer.State(slot) + layer.m_weightsOffset;
+            std::fill(transposed.begin(), transposed.end(), 0.0f);
+            TransposeMatrix(rows, columns, state, stride, transposed.data(), transposedStride);
+            std::copy(transposed.begin(), transposed.end(), state);
+        }
+    }
+
+    // The number of shards depends only on the batch size and the thread count, which keeps the summation order fixed
+    size_t ShardCount (size_t batchSize) const
+    {
+        if (!m_threadPool)
+            return 1;
+        return std::max<size_t>(1, std::min(m_threadPool->ThreadCount(), batchSize / c_minItemsPerShard));
+    }
+
+    /* The most items a shard gets for any batch of up to miniBatchSize items. The short last minibatch of an epoch
+    may be split into fewer shards than a full one, so its shards can be larger */
+    size_t MaxShardSize (size_t miniBatchSize) const
+    {
+        size_t maxShardSize = 1;
+        for (size_t batchSize = 1; batchSize <= miniBatchSize; ++batchSize)
+        {
+            size_t shardCount = ShardCount(batchSize);
+            maxShardSize = std::max(maxShardSize, (batchSize + shardCount - 1) / shardCount);
+        }
+        return maxShardSize;
+    }
+
+    template <typename FUNCTION>
+    void RunParallel (size_t count, const FUNCTION& task) const
+    {
+        if (m_threadPool)
+        {
+            m_threadPool->ParallelFor(count, task);
+        }
+        else
+        {
+            for (size_t i = 0; i < count; ++i)
+                task(i);
+        }
+    }
+
+    /* Sums up the derivatives of the shards pairwise as a binary tree, so that every level of the tree
+    runs in parallel. The summation order only depends on the shard count */
+    void ReduceShards (size_t shardCount)
+    {
+        for (size_t stride = 1; stride < shardCount; stride *= 2)
+        {
+            RunParallel((shardCount + 2 * stride - 1) / (2 * stride), [&] (size_t pairIndex)
+            {
+                size_t destination = pairIndex * 2 * stride;
+                if (destination + stride < shardCount)
+                    m_workspaces[destination].AddDerivatives(m_workspaces[destination + stride]);
+            });
+        }
+    }
+
+    /* Evaluates the network for batchSize rows of [batch x inputs] values, the results are stored in the workspace.
+    With sparseInputs the first layer reads its rows firstSparseRow ... firstSparseRow + batchSize - 1 instead,
+    batchInputs is not used then */
+    void ForwardBatch (Workspace& workspace, const float* batchInputs, size_t batchSize, const SparseRows* sparseInputs = nullptr, size_t firstSparseRow = 0) const
+    {
+        PROFILE_ZONE(c_forwardZone);
+        const float* layerInputs = batchInputs;
+        for (size_t layerIndex = 0; layerIndex < m_layout.size(); ++layerIndex)
+        {
+            const LayerLayout& layer = m_layout[layerIndex];
+            float* O = workspace.m_outputs[layerIndex].data();
+
+            // Z = X * W^T for all neurons of the layer and all items of the batch at once
+            if (layerIndex == 0 && (sparseInputs || m_trainingLayout))
+                FirstLayerForward(batchInputs, batchSize, sparseInputs, firstSparseRow, O);
+            else
+                m_forwardKernels[layerIndex](batchSize, layer.m_neurons, layer.m_inputs, layerInputs, LayerWeights(layerIndex), layer.m_weightsStride, O);
+            for (size_t batchIndex = 0; batchIndex < batchSize; ++batchIndex)
+                ApplyActivation(layer.m_activation, &O[batchIndex * layer.m_neurons], LayerBiases(layerIndex), layer.m_neurons);
+
+            layerInputs = O;
+        }
+    }
+
+    // Z = X * W^T of the first layer from the input-major weights, for the nonzero inputs only if sparseInputs is given
+    void FirstLayerForward (const float* batchInputs, size_t batchSize, const SparseRows* sparseInputs, size_t firstSparseRow, float* Z) const
+    {
+        const LayerLayout& layer = m_layout[0];
+        const float* weights = InputMajorWeights();
+        std::fill(Z, Z + batchSize * layer.m_neurons, 0.0f);
+        for (size_t batchIndex = 0; batchIndex < batchSize; ++batchIndex)
+        {
+            float* itemZ = &Z[batchIndex * layer.m_neurons];
+            if (sparseInputs)
+            {
+                size_t row = firstSparseRow + batchIndex;
+                SumScaledRows(itemZ, layer.m_neurons, weights, layer.m_inputMajorStride, sparseInputs->RowIndices(row), sparseInputs->RowValues(row), sparseInputs->RowNonzeros(row));
+            }
+            else
+                SumScaledRows(itemZ, layer.m_neurons, weights, layer.m_inputMajorStride, nullptr, &batchInputs[batchIndex * layer.m_inputs], layer.m_inputs);
+        }
+    }
+
+    /* This function calculates the gradient needed for training by backpropagating the error of
+    the network, using the neuron output values from the forward pass. It determines the error
+    by comparing the label predicted by the network to the correct label.
+
+    The derivatives are summed over the whole batch: deltaCost/deltaZ is computed for every item and neuron,
+    and the weight derivatives are then accumulated as a sum of outer products (deltaZ^T * O) in one matrix product */
+
+    void BackwardBatch (Workspace& workspace, const float* batchInputs, const uint8_t* labels, size_t batchSize, const SparseRows* sparseInputs = nullptr, size_t firstSparseRow = 0) const
+    {
+        PROFILE_ZONE(c_backwardZone);
+        BackpropagateDeltas(workspace, labels, batchSize);
+
+        for (size_t layerIndex = 0; layerIndex < m_layout.size(); ++layerIndex)
+        {
+            const LayerLayout& layer = m_layout[layerIndex];
+            const float* deltaCost_deltaZ = workspace.m_deltaCosts[layerIndex].data();
+            const float* layerInputs = layerIndex > 0 ? workspace.m_outputs[layerIndex - 1].data() : batchInputs;
+
+            // The bias derivatives are the deltaCost/deltaZ values summed over the batch
+            float* biasesDeltaCost = &workspace.m_gradients[layer.m_biasesOffset];
+            std::fill(biasesDeltaCost, biasesDeltaCost + layer.m_neurons, 0.0f);
+            for (size_t batchIndex = 0; batchIndex < batchSize; ++batchIndex)
+            {
+                for (size_t neuronIndex = 0; neuronIndex < layer.m_neurons; ++neuronIndex)
+                    biasesDeltaCost[neuronIndex] += deltaCost_deltaZ[batchIndex * layer.m_neurons + neuronIndex];
+            }
+
+            // Calculating deltaCost/deltaWeight for each weight going into the neurons of this layer
+            float* weightsDeltaCost = &workspace.m_gradients[layer.m_weightsOffset];
+            if (layerIndex == 0 && m_trainingLayout)
+                FirstLayerGradient(batchInputs, batchSize, sparseInputs, firstSparseRow, deltaCost_deltaZ, weightsDeltaCost);
+            else
+                GemmTN(layer.m_neurons, layer.m_inputs, batchSize, deltaCost_deltaZ, layer.m_neurons, layerInputs, layer.m_inputs, weightsDeltaCost, layer.m_weightsStride, false);
+        }
+    }
+
+    /* The weight derivatives of the first layer in its input-major training layout: every input of an item adds
+    deltaCost/deltaZ of the item, scaled by the input, to its row. With sparseInputs only the rows of the nonzero inputs */
+    void FirstLayerGradient (const float* batchInputs, size_t batchSize, const SparseRows* sparseInputs, size_t firstSparseRow, const float* deltaCost_deltaZ, float* weightsDeltaCost) const
+    {
+        const LayerLayout& layer = m_layout[0];
+        std::fill(weightsDeltaCost, weightsDeltaCost + layer.InputMajorSize(), 0.0f);
+        for (size_t batchIndex = 0; batchIndex < batchSize; ++batchIndex)
+        {
+            const float* itemDeltaCost = &deltaCost_deltaZ[batchIndex * layer.m_neurons];
+            if (sparseInputs)
+            {
+                size_t row = firstSparseRow + batchIndex;
+                AddScaledRows(weightsDeltaCost, layer.m_inputMajorStride, sparseInputs->RowIndices(row), sparseInputs->RowValues(row), sparseInputs->RowNonzeros(row), itemDeltaCost, layer.m_neurons);
+            }
+            else
+                AddScaledRows(weightsDeltaCost, layer.m_inputMajorStride, nullptr, &batchInputs[batchIndex * layer.m_inputs], layer.m_inputs, itemDeltaCost, layer.m_neurons);
+        }
+    }
+
+    // Computes deltaCost/deltaZ of every neuron of every layer for all items of the batch, from the output layer backwards
+    void BackpropagateDeltas (Workspace& workspace, const uint8_t* labels, size_t batchSize) const
+    {
+        // Since we are proceeding backwards, we are starting with the output layer
+        const LayerLayout& outputLayer = m_layout.back();
+        for (size_t batchIndex = 0; batchIndex < batchSize; ++batchIndex)
+        {
+            const float* O = &workspace.m_outputs.back()[batchIndex * outputLayer.m_neurons];
+            float* deltaCost_deltaZ = &workspace.m_deltaCosts.back()[batchIndex * outputLayer.m_neurons];
+            for (size_t neuronIndex = 0; neuronIndex < outputLayer.m_neurons; ++neuronIndex)
+            {
+                float desiredOutput = (labels[batchIndex] == neuronIndex) ? 1.0f : 0.0f;
+                float deltaCost_deltaO = O[neuronIndex] - desiredOutput;
+
+                // Softmax with the cross-entropy cost has the plain difference as its derivative
+                if (outputLayer.m_activation == c_softmaxActivation)
+                    deltaCost_deltaZ[neuronIndex] = deltaCost_deltaO;
+                else
+                    deltaCost_deltaZ[neuronIndex] = deltaCost_deltaO * ActivationDerivative(outputLayer.m_activation, O[neuronIndex]);
+            }
+        }
+
+        for (size_t layerIndex = m_layout.size() - 1; layerIndex > 0; --layerIndex)
+        {
+            /* To calculate the error (deltaCost/deltaZ) for each neuron of the previous layer we are following these steps:
+
+            1. Multiply the deltaCost/deltaDestinationZ of this layer by the weight connecting the source
+            and target neurons and sum it up over the destination neurons. This gives the error value for the neuron
+            2. Get deltaO/deltaZ of the source neuron from its output, e.g. O * (1 - O) for the sigmoid
+            3. Compute deltaCost/deltaZ by multiplying the error by deltaO/deltaZ */
+
+            const LayerLayout& layer = m_layout[layerIndex];
+            const LayerLayout& previousLayer = m_layout[layerIndex - 1];
+            const float* deltaCost_deltaZ = workspace.m_deltaCosts[layerIndex].data();
+            float* previousDeltaCost = workspace.m_deltaCosts[layerIndex - 1].data();
+            GemmNN(batchSize, layer.m_inputs, layer.m_neurons, deltaCost_deltaZ, layer.m_neurons, LayerWeights(layerIndex), layer.m_weightsStride, previousDeltaCost, layer.m_inputs, false);
+
+            const float* O = workspace.m_outputs[layerIndex - 1].data();
+            for (size_t i = 0; i < batchSize * previousLayer.m_neurons; ++i)
+                previousDeltaCost[i] *= ActivationDerivative(previousLayer.m_activation, O[i]);
+        }
+    }
+
+    // Trains one epoch in shards of minibatches with one update per minibatch, see c_synchronousTraining
+    void TrainSynchronous (const MNISTData& trainingData, size_t miniBatchSize, float learningRate)
+    {
+        // Every shard of the minibatch gets its own workspace with activations and derivatives
+        const size_t maxShards = ShardCount(miniBatchSize);
+        if (m_workspaces.size() < maxShards)
+            m_workspaces.resize(maxShards);
+        for (Workspace& workspace : m_workspaces)
+            workspace.Resize(*this, MaxShardSize(miniBatchSize), true);
+
+        /* The shuffled items are gathered into contiguous minibatches on background threads while the
+        previous minibatch is trained, see BatchPrefetcher */
+        BatchPrefetcher prefetcher(m_prefetchThreads);
+        if (m_augmenter)
+        {
+            const uint32_t epoch = m_epoch;
+            prefetcher.SetTransform([this, epoch] (float* input, size_t, size_t position) { m_augmenter->Augment(input, m_seed, epoch, position); });
+        }
+        prefetcher.SetSparseInputs(m_sparseInputs ? c_maxSparseInputDensity : 0.0f);
+        prefetcher.Start(trainingData, m_trainingOrder.data(), m_trainingOrder.size(), miniBatchSize, Inputs());
+
+        // Process all minibatches until we are out of training examples
+        while (const PrefetchedBatch* batch = prefetcher.Next())
+        {
+            size_t miniBatchIndex = batch->m_size;
+            size_t shardCount = ShardCount(miniBatchIndex);
+
+            RunParallel(shardCount, [&] (size_t shardIndex)
+            {
+                Workspace& workspace = m_workspaces[shardIndex];
+                size_t begin = miniBatchIndex * shardIndex / shardCount;
+                size_t end = miniBatchIndex * (shardIndex + 1) / shardCount;
+                const float* shardInputs = batch->m_inputs ? &batch->m_inputs[begin * Inputs()] : nullptr;
+
+                // Run the forward pass of the network for the whole shard, its outputs also give the running accuracy
+                ForwardBatch(workspace, shardInputs, end - begin, batch->m_sparseInputs, begin);
+                ScoreItems(workspace, &batch->m_labels[begin], end - begin);
+
+                // Run the backward pass to get the derivatives of the cost function summed over the shard
+                BackwardBatch(workspace, shardInputs, &batch->m_labels[begin], end - begin, batch->m_sparseInputs, begin);
+            });
+
+            /* Adding the derivatives of all shards together, after that the first workspace holds
+            the derivatives summed over the minibatch and we can average them via division */
+            {
+                PROFILE_ZONE(c_accumulateZone);
+                ReduceShards(shardCount);
+            }
+            const Workspace& miniBatch = m_workspaces[0];
+
+            // The schedule is evaluated at the end of the minibatch, so a warmup never takes a step with a rate of 0
+            double epochs = m_epoch + double(batch->m_firstItem + batch->m_size) / double(m_trainingOrder.size());
+            float miniBatchLearningRate = learningRate * m_optimizer.Settings().LearningRateFactor(epochs);
+
+            /* Application training to biases and weights of all layers at once in a single pass. The optimizer
+            divides the derivatives of the mini-series by the number of elements in it to get their average */
+            PROFILE_ZONE(c_updateZone);
+            m_optimizer.Step(m_parameters.data(), miniBatch.m_gradients.data(), miniBatchIndex, miniBatchLearningRate);
+        }
+
+        m_inputStats = prefetcher.Stats();
+    }
+
+    /* Hogwild! (Niu et al. 2011): every thread of the pool runs its own loop that takes the next item from a shared
+    atomic cursor over m_trainingOrder, runs the forward and backward pass for it and applies the derivatives to the
+    shared parameters immediately. Nothing is locked: a thread may read parameters that another thread is just
+    updating and two threads may add to the same weight at the same time, losing one of the additions. These are
+    benign races on aligned floats, the result is some noise in the updates. As a weight of the first layer only
+    changes when its input is nonzero, and most MNIST pixels are zero, such collisions are rare */
+    void TrainHogwild (const MNISTData& trainingData, float rate)
+    {
+        const size_t workerCount = m_threadPool ? m_threadPool->ThreadCount() : 1;
+        if (m_workspaces.size() < workerCount)
+            m_workspaces.resize(workerCount);
+        for (Workspace& workspace : m_workspaces)
+            workspace.Resize(*this, 1, false);
+
+        struct WorkerStats
+        {
+            size_t m_items = 0;
+            uint64_t m_staleness = 0;
+            uint64_t m_maxStaleness = 0;
+            size_t m_nonzeroInputs = 0;
+        };
+        std::vector<WorkerStats> workerStats(workerCount);
+
+        // The next position in m_trainingOrder and the number of updates applied so far, shared by all workers
+        std::atomic<size_t> cursor(0);
+        std::atomic<uint64_t> updateCount(0);
+        const uint32_t epoch = m_epoch;
+        auto start = std::chrono::steady_clock::now();
+
+        RunParallel(workerCount, [&] (size_t workerIndex)
+        {
+            Workspace& workspace = m_workspaces[workerIndex];
+            WorkerStats& stats = workerStats[workerIndex];
+            for (size_t position = cursor.fetch_add(1, std::memory_order_relaxed); position < m_trainingOrder.size();
+                 position = cursor.fetch_add(1, std::memory_order_relaxed))
+            {
+                {
+                    PROFILE_ZONE(c_gatherZone);
+                    PackImage(trainingData, m_trainingOrder[position], workspace, 0);
+                }
+                if (m_augmenter)
+                {
+                    PROFILE_ZONE(c_augmentZone);
+                    m_augmenter->Augment(workspace.m_inputs.data(), m_seed, epoch, position);
+                }
+
+                const SparseRows* sparseInputs = CompressInputs(workspace, workspace.m_inputs.data(), 1);
+
+                uint64_t readVersion = updateCount.load(std::memory_order_relaxed);
+                ForwardBatch(workspace, workspace.m_inputs.data(), 1, sparseInputs);
+                ScoreItems(workspace, workspace.m_labels.data(), 1);
+                {
+                    PROFILE_ZONE(c_backwardZone);
+                    BackpropagateDeltas(workspace, workspace.m_labels.data(), 1);
+                }
+                {
+                    PROFILE_ZONE(c_updateZone);
+                    float itemRate = rate * m_optimizer.Settings().LearningRateFactor(epoch + double(position + 1) / double(m_trainingOrder.size()));
+                    stats.m_nonzeroInputs += ApplyItemUpdate(workspace, itemRate);
+                }
+
+                uint64_t staleness = updateCount.fetch_add(1, std::memory_order_relaxed) - readVersion;
+                stats.m_staleness += staleness;
+                stats.m_maxStaleness = std::max(stats.m_maxStaleness, staleness);
+                ++stats.m_items;
+            }
+        });
+
+        m_hogwildStats = HogwildStats();
+        m_hogwildStats.m_workers = workerCount;
+        m_hogwildStats.m_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        uint64_t staleness = 0;
+        size_t nonzeroInputs = 0;
+        for (const WorkerStats& stats : workerStats)
+        {
+            m_hogwildStats.m_items += stats.m_items;
+            m_hogwildStats.m_maxStaleness = std::max(m_hogwildStats.m_maxStaleness, stats.m_maxStaleness);
+            staleness += stats.m_staleness;
+            nonzeroInputs += stats.m_nonzeroInputs;
+        }
+        if (m_hogwildStats.m_items > 0)
+        {
+            m_hogwildStats.m_meanStaleness = double(staleness) / double(m_hogwildStats.m_items);
+            m_hogwildStats.m_inputDensity = double(nonzeroInputs) / (double(m_hogwildStats.m_items) * double(Inputs()));
+        }
+        m_inputStats = PrefetchStats();
+    }
+
+    /* Applies the derivatives of the single item in the workspace to the shared parameters (w -= deltaCost * rate).
+    deltaCost/deltaWeight is deltaCost/deltaZ times the input of the weight, so only the weights of nonzero inputs
+    change and the loops skip all others. Returns the number of nonzero inputs of the first layer */
+    size_t ApplyItemUpdate (Workspace& workspace, float rate)
+    {
+        size_t firstLayerNonzeroInputs = 0;
+        for (size_t layerIndex = 0; layerIndex < m_layout.size(); ++layerIndex)
+        {
+            const LayerLayout& layer = m_layout[layerIndex];
+            const float* layerInputs = layerIndex > 0 ? workspace.m_outputs[layerIndex - 1].data() : workspace.m_inputs.data();
+            const float* deltaCost_deltaZ = workspace.m_deltaCosts[layerIndex].data();
+
+            // The input-major first layer moves the row of every nonzero input (collected by TrainHogwild()) at once
+            if (layerIndex == 0 && m_trainingLayout)
+            {
+                const SparseRows& inputs = workspace.m_sparseInputs;
+                std::vector<float>& steps = workspace.m_steps;
+                steps.resize(layer.m_neurons);
+                float* biases = &m_parameters[layer.m_biasesOffset];
+                for (size_t neuronIndex = 0; neuronIndex < layer.m_neurons; ++neuronIndex)
+                {
+                    steps[neuronIndex] = -rate * deltaCost_deltaZ[neuronIndex];
+                    biases[neuronIndex] += steps[neuronIndex];
+                }
+                AddScaledRows(&m_parameters[layer.m_weightsOffset], layer.m_inputMajorStride, inputs.RowIndices(0), inputs.RowValues(0), inputs.RowNonzeros(0), steps.data(), layer.m_neurons);
+                firstLayerNonzeroInputs = inputs.RowNonzeros(0);
+                continue;
+            }
+
+            std::vector<uint32_t>& nonzeroInputs = workspace.m_nonzeroInputs;
+            nonzeroInputs.clear();
+            for (size_t inputIndex = 0; inputIndex < layer.m_inputs; ++inputIndex)
+            {
+                if (layerInputs[inputIndex] != 0.0f)
+                    nonzeroInputs.push_back(uint32_t(inputIndex));
+            }
+            if (layerIndex == 0)
+                firstLayerNonzeroInputs = nonzeroInputs.size();
+
+            float* biases = &m_parameters[layer.m_biasesOffset];
+            float* weights = &m_parameters[layer.m_weightsOffset];
+            for (size_t neuronIndex = 0; neuronIndex < layer.m_neurons; ++neuronIndex)
+            {
+                float step = -rate * deltaCost_deltaZ[neuronIndex];
+                if (step == 0.0f)
+                    continue;
+                biases[neuronIndex] += step;
+                float* neuronWeights = &weights[neuronIndex * layer.m_weightsStride];
+                for (uint32_t inputIndex : nonzeroInputs)
+                    neuronWeights[inputIndex] += step * layerInputs[inputIndex];
+            }
+        }
+        return firstLayerNonzeroInputs;
+    }
+
+    // deltaO/deltaZ expressed by the output O of the neuron
+    static float ActivationDerivative (ActivationFunction activation, float O)
+    {
+        if (activation == c_reluActivation)
+            return O > 0.0f ? 1.0f : 0.0f;
+        return O * (1.0f - O);
+    }
+
 private:
- 
-    // Weights and Biases 
-    std::array<float, inputs * hidden_neurons>          m_hiddenLayerWeights;
-    std::array<float, hidden_neurons * output_neurons>  m_outputLayerWeights;
-
-    std::array<float, hidden_neurons>                   m_hiddenLayerBiases;
-    std::array<float, output_neurons>                   m_outputLayerBiases;
-    
-    // Neuron activation values (known as "O" values)
-    std::array<float, hidden_neurons>                   m_hiddenLayerOutputs;
-    std::array<float, output_neurons>                   m_outputLayerOutputs;
- 
-    // Derivatives of biases and weights for a training example
-    std::array<float, hidden_neurons>                   m_hiddenLayerBiasesDeltaCost;
-    std::array<float, output_neurons>                   m_outputLayerBiasesDeltaCost;
- 
-    std::array<float, inputs * hidden_neurons>          m_hiddenLayerWeightsDeltaCost;
-    std::array<float, hidden_neurons * output_neurons>  m_outputLayerWeightsDeltaCost;
- 
-    // Average of all items in minibatch (Derivatives of biases and weights for the minibatch)
-    std::array<float, hidden_neurons>                   m_miniBatchHiddenLayerBiasesDeltaCost;
-    std::array<float, output_neurons>                   m_miniBatchOutputLayerBiasesDeltaCost;
- 
-    std::array<float, inputs * hidden_neurons>          m_miniBatchHiddenLayerWeightsDeltaCost;
-    std::array<float, hidden_neurons * output_neurons>  m_miniBatchOutputLayerWeightsDeltaCost;
- 
+
+    NetworkTopology                     m_topology;
+    std::vector<LayerLayout>            m_layout;
+    std::vector<DenseForwardKernel>     m_forwardKernels;
+
+    // Weights and biases of all layers, the arena starts on a cache line so the rows of ComputeLayout() do as well
+    AlignedVector<float>                m_parameters;
+
+    // Turns the derivatives of a minibatch into the update, with its state in one buffer laid out like m_parameters
+    Optimizer                           m_optimizer;
+
+    // The first layer input-major and whether the arena holds it that way during Train(), see InputMajorWeights()
+    AlignedVector<float>                m_inputMajorWeights;
+    bool                                m_trainingLayout = false;
+    bool                                m_sparseInputs = true;
+
+    // One workspace per shard of the minibatch, the first one also receives the reduced minibatch derivatives
+    std::vector<Workspace>              m_workspaces;
+    ThreadPool*                         m_threadPool = nullptr;
+    size_t                              m_prefetchThreads = 1;
+    const ImageAugmenter*               m_augmenter = nullptr;
+    PrefetchStats                       m_inputStats;
+    TrainingStats                       m_trainingStats;
+    TrainingMode                        m_trainingMode = c_synchronousTraining;
+    HogwildStats                        m_hogwildStats;
+
     // Used for minibatch generation
-    std::vector<size_t>                                 m_trainingOrder;
-};
\ No newline at end of file
+    std::vector<size_t>                 m_trainingOrder;
+    uint32_t                            m_seed = 0;
+    uint32_t                            m_epoch = 0;
+};
@@ -0,0 +1,311 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cmath>
+#include <string>
+#include <algorithm>
+#include "aligned_allocator.h"
+#include "simd_kernels.h"
+
+/* How Train() turns the derivatives of a minibatch (their mean g) into a step of the parameters w:
+
+    c_sgdOptimizer          w -= rate * g
+    c_momentumOptimizer     v = momentum * v + g, w -= rate * v. The velocity v keeps moving the parameters along
+                            directions the derivatives agree on and damps the ones they keep flipping
+    c_nesterovOptimizer     v = momentum * v + g, w -= rate * (g + momentum * v), momentum that looks one step ahead
+    c_adamOptimizer         running means of g and g^2 (Kingma and Ba 2015), every parameter gets a step of about
+                            rate in the direction of its mean derivative, scaled down where the derivatives are noisy
+
+Momentum and Nesterov take the same rate as plain SGD times about (1 - momentum), Adam needs a much smaller rate
+(see DefaultLearningRate()). */
+enum OptimizerType
+{
+    c_sgdOptimizer,
+    c_momentumOptimizer,
+    c_nesterovOptimizer,
+    c_adamOptimizer,
+    c_optimizerTypeCount
+};
+
+inline const char* OptimizerName (OptimizerType type)
+{
+    switch (type)
+    {
+        case c_sgdOptimizer:      return "sgd";
+        case c_momentumOptimizer: return "momentum";
+        case c_nesterovOptimizer: return "nesterov";
+        case c_adamOptimizer:     return "adam";
+        default:                  return "unknown";
+    }
+}
+
+// The number of values the optimizer keeps per parameter: the velocity, or Adam's two moments
+inline size_t OptimizerStateSlots (OptimizerType type)
+{
+    switch (type)
+    {
+        case c_momentumOptimizer:
+        case c_nesterovOptimizer: return 1;
+        case c_adamOptimizer:     return 2;
+        default:                  return 0;
+    }
+}
+
+// A learning rate that works for the default "785-30-10" network with minibatches of 10 items
+inline float DefaultLearningRate (OptimizerType type)
+{
+    switch (type)
+    {
+        case c_momentumOptimizer:
+        case c_nesterovOptimizer: return 0.3f;
+        case c_adamOptimizer:     return 0.01f;
+        default:                  return 3.0f;
+    }
+}
+
+/* How the learning rate changes over the training, as a factor of the rate given to Train():
+
+    c_constantSchedule      always 1
+    c_stepSchedule          multiplied by the step factor every few epochs
+    c_cosineSchedule        follows half a cosine wave from 1 down to the minimum factor at the last epoch
+
+Any schedule can start with a linear warmup, which helps momentum and Adam whose first steps are based on few
+derivatives. The factor is evaluated for every minibatch, so the rate changes smoothly within an epoch */
+enum LearningRateSchedule
+{
+    c_constantSchedule,
+    c_stepSchedule,
+    c_cosineSchedule,
+    c_learningRateScheduleCount
+};
+
+inline const char* ScheduleName (LearningRateSchedule schedule)
+{
+    switch (schedule)
+    {
+        case c_constantSchedule: return "constant";
+        case c_stepSchedule:     return "step";
+        case c_cosineSchedule:   return "cosine";
+        default:                 return "unknown";
+    }
+}
+
+struct OptimizerSettings
+{
+    OptimizerType m_type = c_sgdOptimizer;
+
+    // The decay of the velocity, also Adam's beta1 (the decay of the mean derivative)
+    float m_momentum = 0.9f;
+
+    // Adam's decay of the mean squared derivative and the term that keeps its steps finite
+    float m_beta2 = 0.999f;
+    float m_epsilon = 1e-8f;
+
+    LearningRateSchedule m_schedule = c_constantSchedule;
+    float m_stepEpochs = 10.0f;
+    float m_stepFactor = 0.5f;
+
+    // The cosine schedule ends at m_minimumFactor after m_totalEpochs epochs
+    float m_totalEpochs = 30.0f;
+    float m_minimumFactor = 0.0f;
+
+    // The rate grows linearly from 0 over this many epochs
+    float m_warmupEpochs = 0.0f;
+
+    /* Parses an optimizer like "sgd", "momentum", "nesterov:0.95" or "adam:0.9:0.999": the name, optionally
+    followed by the momentum (beta1 for Adam) and Adam's beta2 */
+    bool ParseOptimizer (const char* text)
+    {
+        OptimizerSettings settings = *this;
+        size_t length = strcspn(text, ":");
+        std::string name(text, length);
+        size_t type = 0;
+        while (type < c_optimizerTypeCount && name != OptimizerName(OptimizerType(type)))
+            ++type;
+
+        const char* position = text + length;
+        float* values[] = { &settings.m_momentum, &settings.m_beta2 };
+        size_t valueCount = 0;
+        bool valid = type < c_optimizerTypeCount;
+        while (valid && *position == ':' && valueCount < 2)
+        {
+            char* end = nullptr;
+            *values[valueCount++] = strtof(position + 1, &end);
+            valid = end != position + 1;
+            position = end;
+        }
+
+        settings.m_type = OptimizerType(type);
+        valid = valid && *position == 0 && settings.m_momentum >= 0.0f && settings.m_momentum < 1.0f && settings.m_beta2 >= 0.0f && settings.m_beta2 < 1.0f;
+        if (!valid)
+        {
+            printf("'%s' is not a valid optimizer, expected e.g. \"sgd\", \"momentum:0.9\", \"nesterov\" or \"adam:0.9:0.999\".\n", text);
+            return false;
+        }
+        *this = settings;
+        return true;
+    }
+
+    /* Parses a schedule like "constant", "step:10:0.5" (halve the rate every 10 epochs) or "cosine:30" (decay to 0
+    over 30 epochs, the current m_totalEpochs without the number) */
+    bool ParseSchedule (const char* text)
+    {
+        OptimizerSettings settings = *this;
+        size_t length = strcspn(text, ":");
+        std::string name(text, length);
+        size_t schedule = 0;
+        while (schedule < c_learningRateScheduleCount && name != ScheduleName(LearningRateSchedule(schedule)))
+            ++schedule;
+
+        const char* position = text + length;
+        float* values[2] = {};
+        if (schedule == c_stepSchedule)
+        {
+            values[0] = &settings.m_stepEpochs;
+            values[1] = &settings.m_stepFactor;
+        }
+        else if (schedule == c_cosineSchedule)
+            values[0] = &settings.m_totalEpochs;
+
+        size_t valueCount = 0;
+        bool valid = schedule < c_learningRateScheduleCount;
+        while (valid && *position == ':' && valueCount < 2 && values[valueCount])
+        {
+            char* end = nullptr;
+            *values[valueCount++] = strtof(position + 1, &end);
+            valid = end != position + 1;
+            position = end;
+        }
+
+        settings.m_schedule = LearningRateSchedule(schedule);
+        valid = valid && *position == 0 && settings.m_stepEpochs > 0.0f && settings.m_stepFactor > 0.0f && settings.m_totalEpochs > 0.0f;
+        if (!valid)
+        {
+            printf("'%s' is not a valid learning rate schedule, expected e.g. \"constant\", \"step:10:0.5\" or \"cosine:30\".\n", text);
+            return false;
+        }
+        *this = settings;
+        return true;
+    }
+
+    std::string ToString () const
+    {
+        char text[256];
+        int length = snprintf(text, sizeof(text), "%s", OptimizerName(m_type));
+        if (m_type != c_sgdOptimizer)
+            length += snprintf(text + length, sizeof(text) - length, ":%g", m_momentum);
+        if (m_type == c_adamOptimizer)
+            length += snprintf(text + length, sizeof(text) - length, ":%g", m_beta2);
+
+        if (m_schedule == c_stepSchedule)
+            length += snprintf(text + length, sizeof(text) - length, ", step schedule (x%g every %g epochs)", m_stepFactor, m_stepEpochs);
+        else if (m_schedule == c_cosineSchedule)
+            length += snprintf(text + length, sizeof(text) - length, ", cosine schedule over %g epochs", m_totalEpochs);
+        if (m_warmupEpochs > 0.0f)
+            snprintf(text + length, sizeof(text) - length, ", %g warmup epochs", m_warmupEpochs);
+        return text;
+    }
+
+    // The factor of the learning rate after the given number of epochs, which includes the finished part of the current one
+    float LearningRateFactor (double epochs) const
+    {
+        double factor = 1.0;
+        if (m_schedule == c_stepSchedule)
+            factor = std::pow(double(m_stepFactor), std::floor(epochs / m_stepEpochs));
+        else if (m_schedule == c_cosineSchedule)
+        {
+            double progress = std::min(epochs / m_totalEpochs, 1.0);
+            factor = m_minimumFactor + (1.0 - m_minimumFactor) * 0.5 * (1.0 + std::cos(3.14159265358979323846 * progress));
+        }
+        if (m_warmupEpochs > 0.0f && epochs < m_warmupEpochs)
+            factor *= epochs / m_warmupEpochs;
+        return float(factor);
+    }
+};
+
+/* Applies the derivatives of a minibatch to the parameter arena. The state (velocity or moments) of every parameter
+lives in one contiguous, cache line aligned buffer laid out like the arena, a slot of ParameterCount() values after
+the other, so State(slot)[i] belongs to parameter i. Every update is one fused, vectorized pass that reads the
+parameter, its derivative and its state once and writes the parameter and the state back (see SimdKernels). */
+class Optimizer
+{
+public:
+    // The state is kept if the type stays the same, otherwise it starts again from zero
+    void SetSettings (const OptimizerSettings& settings)
+    {
+        bool typeChanged = settings.m_type != m_settings.m_type;
+        m_settings = settings;
+        if (typeChanged)
+            Reset(m_parameterCount);
+    }
+
+    const OptimizerSettings& Settings () const { return m_settings; }
+
+    // Zeroes the state for an arena of parameterCount values
+    void Reset (size_t parameterCount)
+    {
+        m_parameterCount = parameterCount;
+        m_state.assign(StateSlots() * parameterCount, 0.0f);
+        m_steps = 0;
+    }
+
+    size_t ParameterCount () const { return m_parameterCount; }
+    size_t StateSlots () const { return OptimizerStateSlots(m_settings.m_type); }
+    float* State (size_t slot) { return &m_state[slot * m_parameterCount]; }
+    const float* State (size_t slot) const { return &m_state[slot * m_parameterCount]; }
+
+    // The whole state buffer, StateSlots() * ParameterCount() values
+    const AlignedVector<float>& StateBuffer () const { return m_state; }
+    AlignedVector<float>& StateBuffer () { return m_state; }
+
+    // The number of updates so far, Adam's bias correction depends on it
+    uint64_t Steps () const { return m_steps; }
+    void SetSteps (uint64_t steps) { m_steps = steps; }
+
+    /* One update of all parameters with the derivatives summed over batchSize items. rate is the learning rate
+    of this update, i.e. including the schedule */
+    void Step (float* parameters, const float* gradients, size_t batchSize, float rate)
+    {
+        const SimdKernels& kernels = GetSimdKernels();
+        ++m_steps;
+
+        // Plain SGD divides the rate instead of every derivative, the scaled derivative is only needed with state
+        if (m_settings.m_type == c_sgdOptimizer)
+        {
+            kernels.MultiplyAdd(parameters, -(rate / float(batchSize)), gradients, m_parameterCount);
+            return;
+        }
+
+        OptimizerStepArgs args;
+        args.m_gradientScale = 1.0f / float(batchSize);
+        args.m_rate = rate;
+        args.m_momentum = m_settings.m_momentum;
+        args.m_beta2 = m_settings.m_beta2;
+        args.m_epsilon = m_settings.m_epsilon;
+        args.m_nesterov = m_settings.m_type == c_nesterovOptimizer;
+
+        if (m_settings.m_type == c_adamOptimizer)
+        {
+            /* Both moments start at zero and are biased towards it in the first steps. Instead of dividing them by
+            1 - beta^t, the rate and epsilon are corrected once per step */
+            double t = double(m_steps);
+            double correction1 = 1.0 - std::pow(double(m_settings.m_momentum), t);
+            double correction2 = std::sqrt(1.0 - std::pow(double(m_settings.m_beta2), t));
+            args.m_rate = float(rate * correction2 / correction1);
+            args.m_epsilon = float(m_settings.m_epsilon * correction2);
+            kernels.AdamStep(parameters, State(0), State(1), gradients, m_parameterCount, args);
+        }
+        else
+            kernels.MomentumStep(parameters, State(0), gradients, m_parameterCount, args);
+    }
+
+private:
+
+    OptimizerSettings       m_settings;
+    size_t                  m_parameterCount = 0;
+    AlignedVector<float>    m_state;
+    uint64_t                m_steps = 0;
+};
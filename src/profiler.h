@@ -0,0 +1,352 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+// Setting to "0" compiles all profiling zones out, Profiler::Snapshot() then returns zeros
+#ifndef ENABLE_PROFILING
+#define ENABLE_PROFILING() 1
+#endif
+
+// The measured parts of training and inference, see PROFILE_ZONE()
+enum ProfileZone
+{
+    c_trainZone,
+    c_shuffleZone,
+    c_inputWaitZone,
+    c_gatherZone,
+    c_augmentZone,
+    c_forwardZone,
+    c_backwardZone,
+    c_accumulateZone,
+    c_updateZone,
+    c_evaluateZone,
+    c_checkpointZone,
+    c_profileZoneCount
+};
+
+inline const char* ProfileZoneName (ProfileZone zone)
+{
+    static const char* const c_names[c_profileZoneCount] =
+    {
+        "train", "shuffle", "input wait", "gather", "augment", "forward", "backward", "accumulate", "update", "evaluate", "checkpoint"
+    };
+    return c_names[zone];
+}
+
+// The time of a zone summed over all threads. Self time excludes the zones that ran nested inside on the same thread
+struct ZoneTotals
+{
+    uint64_t m_calls = 0;
+    uint64_t m_nanoseconds = 0;
+    uint64_t m_selfNanoseconds = 0;
+};
+
+struct ProfileSnapshot
+{
+    std::array<ZoneTotals, c_profileZoneCount> m_zones;
+
+    // The difference of two snapshots is what happened in between, e.g. in one epoch
+    ProfileSnapshot operator - (const ProfileSnapshot& earlier) const
+    {
+        ProfileSnapshot result;
+        for (size_t zone = 0; zone < c_profileZoneCount; ++zone)
+        {
+            result.m_zones[zone].m_calls = m_zones[zone].m_calls - earlier.m_zones[zone].m_calls;
+            result.m_zones[zone].m_nanoseconds = m_zones[zone].m_nanoseconds - earlier.m_zones[zone].m_nanoseconds;
+            result.m_zones[zone].m_selfNanoseconds = m_zones[zone].m_selfNanoseconds - earlier.m_zones[zone].m_selfNanoseconds;
+        }
+        return result;
+    }
+};
+
+/* The counters of one thread. Only the owning thread writes them, so they are plain relaxed loads and stores
+without any locked instructions; other threads may read them at any time through Profiler::Snapshot() */
+class ThreadProfile
+{
+public:
+    ThreadProfile ();
+    ~ThreadProfile ();
+
+    ThreadProfile (const ThreadProfile&) = delete;
+    ThreadProfile& operator = (const ThreadProfile&) = delete;
+
+    void Enter ()
+    {
+        if (m_depth < c_maxDepth)
+            m_childNanoseconds[m_depth] = 0;
+        ++m_depth;
+    }
+
+    void Leave (ProfileZone zone, uint64_t begin, uint64_t end);
+
+    void AddTo (ProfileSnapshot& snapshot) const
+    {
+        for (size_t zone = 0; zone < c_profileZoneCount; ++zone)
+        {
+            snapshot.m_zones[zone].m_calls += m_calls[zone].load(std::memory_order_relaxed);
+            snapshot.m_zones[zone].m_nanoseconds += m_nanoseconds[zone].load(std::memory_order_relaxed);
+            snapshot.m_zones[zone].m_selfNanoseconds += m_selfNanoseconds[zone].load(std::memory_order_relaxed);
+        }
+    }
+
+    struct TraceEvent
+    {
+        ProfileZone m_zone;
+        uint64_t m_begin;
+        uint64_t m_duration;
+    };
+
+private:
+    friend class Profiler;
+
+    static void Add (std::atomic<uint64_t>& counter, uint64_t value)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    static const size_t c_maxDepth = 16;
+
+    std::array<std::atomic<uint64_t>, c_profileZoneCount> m_calls{};
+    std::array<std::atomic<uint64_t>, c_profileZoneCount> m_nanoseconds{};
+    std::array<std::atomic<uint64_t>, c_profileZoneCount> m_selfNanoseconds{};
+
+    // The time spent in nested zones, for every level of the zone stack
+    uint64_t m_childNanoseconds[c_maxDepth];
+    size_t m_depth = 0;
+
+    // The trace events of the thread, the mutex is only contended while the trace is written
+    std::mutex m_eventsMutex;
+    std::vector<TraceEvent> m_events;
+    uint32_t m_threadIndex = 0;
+};
+
+/* Collects the counters of all threads. Threads register themselves with their first zone; when a thread ends,
+its counters are kept in the retired totals, so short lived threads (e.g. the prefetch threads of an epoch) still count.
+
+With the trace enabled every zone is also recorded as an event that WriteTrace() saves in the Chrome trace event
+format, to be opened with chrome://tracing or Perfetto. */
+class Profiler
+{
+public:
+    /* Never destroyed, threads of global thread pools may still retire their counters while the
+    static objects are destroyed at exit */
+    static Profiler& Instance ()
+    {
+        static Profiler* profiler = new Profiler();
+        return *profiler;
+    }
+
+    // The totals of all zones since the start of the program
+    ProfileSnapshot Snapshot ()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ProfileSnapshot snapshot = m_retired;
+        for (const ThreadProfile* thread : m_threads)
+            thread->AddTo(snapshot);
+        return snapshot;
+    }
+
+    // Every thread keeps at most maxEventsPerThread events, the later ones are dropped
+    void EnableTrace (size_t maxEventsPerThread = 4000000)
+    {
+        m_maxTraceEvents.store(maxEventsPerThread, std::memory_order_relaxed);
+    }
+
+    size_t MaxTraceEvents () const { return m_maxTraceEvents.load(std::memory_order_relaxed); }
+
+    // Nanoseconds since the profiler was created, the time base of the trace
+    uint64_t Now () const
+    {
+        return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start).count());
+    }
+
+    bool WriteTrace (const char* fileName)
+    {
+        FILE* file = fopen(fileName, "wt");
+        if (!file)
+        {
+            printf("Could not open '%s' for writing!\n", fileName);
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        fprintf(file, "{\"traceEvents\":[\n");
+        bool first = true;
+        auto writeEvents = [&] (const std::vector<ThreadProfile::TraceEvent>& events, uint32_t threadIndex)
+        {
+            for (const ThreadProfile::TraceEvent& event : events)
+            {
+                fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}", first ? "" : ",\n",
+                    ProfileZoneName(event.m_zone), threadIndex, double(event.m_begin) / 1000.0, double(event.m_duration) / 1000.0);
+                first = false;
+            }
+        };
+        for (ThreadProfile* thread : m_threads)
+        {
+            std::lock_guard<std::mutex> eventsLock(thread->m_eventsMutex);
+            writeEvents(thread->m_events, thread->m_threadIndex);
+        }
+        for (const RetiredEvents& retired : m_retiredEvents)
+            writeEvents(retired.m_events, retired.m_threadIndex);
+        fprintf(file, "\n]}\n");
+        fclose(file);
+        return true;
+    }
+
+    // The zones that ran, sorted by their self time, with the share of the given wall clock time
+    static void Print (const ProfileSnapshot& snapshot, double wallSeconds)
+    {
+        std::array<size_t, c_profileZoneCount> order;
+        for (size_t zone = 0; zone < c_profileZoneCount; ++zone)
+            order[zone] = zone;
+        std::sort(order.begin(), order.end(), [&] (size_t a, size_t b) { return snapshot.m_zones[a].m_selfNanoseconds > snapshot.m_zones[b].m_selfNanoseconds; });
+
+        printf("%-12s %10s %12s %12s %8s\n", "zone", "calls", "seconds", "self seconds", "self %");
+        for (size_t zone : order)
+        {
+            const ZoneTotals& totals = snapshot.m_zones[zone];
+            if (totals.m_calls == 0)
+                continue;
+            double selfSeconds = double(totals.m_selfNanoseconds) * 1e-9;
+            printf("%-12s %10llu %12.3f %12.3f %7.1f%%\n", ProfileZoneName(ProfileZone(zone)), (unsigned long long)totals.m_calls,
+                double(totals.m_nanoseconds) * 1e-9, selfSeconds, wallSeconds > 0.0 ? 100.0 * selfSeconds / wallSeconds : 0.0);
+        }
+    }
+
+    static void WriteCSVHeader (FILE* file)
+    {
+        fprintf(file, "\"Epoch\",\"Zone\",\"Calls\",\"Seconds\",\"Self Seconds\"\n");
+    }
+
+    // One line per zone that ran
+    static void WriteCSV (FILE* file, size_t epoch, const ProfileSnapshot& snapshot)
+    {
+        for (size_t zone = 0; zone < c_profileZoneCount; ++zone)
+        {
+            const ZoneTotals& totals = snapshot.m_zones[zone];
+            if (totals.m_calls > 0)
+                fprintf(file, "%zu,\"%s\",%llu,%f,%f\n", epoch, ProfileZoneName(ProfileZone(zone)), (unsigned long long)totals.m_calls,
+                    double(totals.m_nanoseconds) * 1e-9, double(totals.m_selfNanoseconds) * 1e-9);
+        }
+    }
+
+private:
+    friend class ThreadProfile;
+
+    Profiler ()
+        : m_start(std::chrono::steady_clock::now())
+    {
+    }
+
+    uint32_t Register (ThreadProfile* thread)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_threads.push_back(thread);
+        return m_nextThreadIndex++;
+    }
+
+    void Retire (ThreadProfile* thread)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        thread->AddTo(m_retired);
+        m_threads.erase(std::find(m_threads.begin(), m_threads.end(), thread));
+
+        std::lock_guard<std::mutex> eventsLock(thread->m_eventsMutex);
+        if (!thread->m_events.empty())
+            m_retiredEvents.push_back({ thread->m_threadIndex, std::move(thread->m_events) });
+    }
+
+    struct RetiredEvents
+    {
+        uint32_t m_threadIndex;
+        std::vector<ThreadProfile::TraceEvent> m_events;
+    };
+
+    std::chrono::steady_clock::time_point m_start;
+    std::atomic<size_t> m_maxTraceEvents{ 0 };
+
+    // Guards the thread list, the retired totals and the retired events
+    std::mutex m_mutex;
+    std::vector<ThreadProfile*> m_threads;
+    ProfileSnapshot m_retired;
+    std::vector<RetiredEvents> m_retiredEvents;
+    uint32_t m_nextThreadIndex = 0;
+};
+
+inline ThreadProfile::ThreadProfile ()
+{
+    m_threadIndex = Profiler::Instance().Register(this);
+}
+
+inline ThreadProfile::~ThreadProfile ()
+{
+    Profiler::Instance().Retire(this);
+}
+
+inline void ThreadProfile::Leave (ProfileZone zone, uint64_t begin, uint64_t end)
+{
+    --m_depth;
+    uint64_t nanoseconds = end - begin;
+    uint64_t childNanoseconds = m_depth < c_maxDepth ? m_childNanoseconds[m_depth] : 0;
+    if (m_depth > 0 && m_depth - 1 < c_maxDepth)
+        m_childNanoseconds[m_depth - 1] += nanoseconds;
+
+    Add(m_calls[zone], 1);
+    Add(m_nanoseconds[zone], nanoseconds);
+    Add(m_selfNanoseconds[zone], nanoseconds - std::min(childNanoseconds, nanoseconds));
+
+    size_t maxEvents = Profiler::Instance().MaxTraceEvents();
+    if (maxEvents > 0 && m_events.size() < maxEvents)
+    {
+        std::lock_guard<std::mutex> lock(m_eventsMutex);
+        m_events.push_back({ zone, begin, nanoseconds });
+    }
+}
+
+// Measures the time from its construction to the end of the scope as one call of the zone
+class ScopedProfileZone
+{
+public:
+    explicit ScopedProfileZone (ProfileZone zone)
+        : m_zone(zone)
+        , m_thread(CurrentThread())
+    {
+        m_thread.Enter();
+        m_begin = Profiler::Instance().Now();
+    }
+
+    ~ScopedProfileZone ()
+    {
+        m_thread.Leave(m_zone, m_begin, Profiler::Instance().Now());
+    }
+
+    ScopedProfileZone (const ScopedProfileZone&) = delete;
+    ScopedProfileZone& operator = (const ScopedProfileZone&) = delete;
+
+private:
+    static ThreadProfile& CurrentThread ()
+    {
+        thread_local ThreadProfile thread;
+        return thread;
+    }
+
+    ProfileZone m_zone;
+    ThreadProfile& m_thread;
+    uint64_t m_begin = 0;
+};
+
+// Profiles the rest of the enclosing scope as the given zone, e.g. PROFILE_ZONE(c_forwardZone);
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#if ENABLE_PROFILING()
+    #define PROFILE_ZONE(zone) ScopedProfileZone PROFILE_CONCAT(profileZone, __LINE__)(zone)
+#else
+    #define PROFILE_ZONE(zone) ((void)0)
+#endif
@@ -0,0 +1,111 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include "timer.h"
+#include "data_loader.h"
+#include "neural_network.h"
+#include "quantized_network.h"
+
+/* Quantizes a trained network to int8 and compares it with the float network on the MNIST test images:
+
+    quantize [--checkpoint <file>] [--calibration <images>] [--max-drop <percent>]
+
+The hidden activations are calibrated on the first images of the training set, so the test set stays unseen.
+The exit code is 4 if the accuracy drops by more than --max-drop percentage points, so a deployment script
+can use it as a gate. */
+
+MNISTData g_trainingData;
+MNISTData g_testData;
+
+NeuralNetwork g_neuralNetwork;
+QuantizedNetwork g_quantizedNetwork;
+
+int main (int argc, char** argv)
+{
+    const char* checkpointFileName = "Checkpoint.bin";
+    size_t calibrationCount = 10000;
+    double maxDrop = 100.0;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc)
+            checkpointFileName = argv[++i];
+        else if (strcmp(argv[i], "--calibration") == 0 && i + 1 < argc)
+            calibrationCount = size_t(std::max(atol(argv[++i]), 1L));
+        else if (strcmp(argv[i], "--max-drop") == 0 && i + 1 < argc)
+            maxDrop = atof(argv[++i]);
+        else
+        {
+            printf("Unknown argument '%s'.\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (!g_trainingData.Load(true) || !g_testData.Load(false))
+    {
+        printf("Could not load the MNIST data!\n");
+        return 1;
+    }
+
+    if (!g_neuralNetwork.LoadCheckpoint(checkpointFileName))
+    {
+        printf("Could not load the network from '%s'!\n", checkpointFileName);
+        return 2;
+    }
+
+    {
+        Timer timer("Quantization and calibration time: ");
+        if (!g_quantizedNetwork.Quantize(g_neuralNetwork, g_trainingData, calibrationCount))
+            return 3;
+    }
+
+    size_t floatSize = sizeof(float) * g_neuralNetwork.Topology().ParameterCount();
+    printf("Calibrated on %zu training images, model size %zu bytes (float) -> %zu bytes (int8)\n",
+        std::min(calibrationCount, g_trainingData.NumImages()), floatSize, g_quantizedNetwork.SizeInBytes());
+
+    // Both networks classify every test image on one thread, the float network from the converted pixels
+    const size_t numImages = g_testData.NumImages();
+    std::vector<uint8_t> floatLabels(numImages);
+    std::vector<uint8_t> quantizedLabels(numImages);
+    std::vector<float> input(g_neuralNetwork.Inputs());
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t imageIndex = 0; imageIndex < numImages; ++imageIndex)
+    {
+        uint8_t label;
+        g_testData.GetImage(imageIndex, input.data(), input.size(), label);
+        floatLabels[imageIndex] = g_neuralNetwork.ForwardPass(input.data(), label);
+    }
+    std::chrono::duration<double> floatSeconds = std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    for (size_t imageIndex = 0; imageIndex < numImages; ++imageIndex)
+    {
+        uint8_t label;
+        quantizedLabels[imageIndex] = g_quantizedNetwork.Classify(g_testData.GetImage(imageIndex, label));
+    }
+    std::chrono::duration<double> quantizedSeconds = std::chrono::steady_clock::now() - start;
+
+    size_t floatCorrect = 0;
+    size_t quantizedCorrect = 0;
+    size_t agreements = 0;
+    for (size_t imageIndex = 0; imageIndex < numImages; ++imageIndex)
+    {
+        uint8_t label;
+        g_testData.GetImage(imageIndex, label);
+        floatCorrect += floatLabels[imageIndex] == label;
+        quantizedCorrect += quantizedLabels[imageIndex] == label;
+        agreements += floatLabels[imageIndex] == quantizedLabels[imageIndex];
+    }
+
+    double floatAccuracy = 100.0 * double(floatCorrect) / double(numImages);
+    double quantizedAccuracy = 100.0 * double(quantizedCorrect) / double(numImages);
+    printf("Float test data accuracy: %0.2f%% (%0.0f images per second on one thread)\n", floatAccuracy, double(numImages) / floatSeconds.count());
+    printf("Int8 test data accuracy:  %0.2f%% (%0.0f images per second on one thread, %s kernels)\n", quantizedAccuracy, double(numImages) / quantizedSeconds.count(), GetSimdKernels().m_name);
+    printf("Accuracy drop: %0.2f percentage points, the networks agree on %0.2f%% of the images\n", floatAccuracy - quantizedAccuracy, 100.0 * double(agreements) / double(numImages));
+
+    if (floatAccuracy - quantizedAccuracy > maxDrop)
+    {
+        printf("The accuracy drop exceeds %0.2f percentage points!\n", maxDrop);
+        return 4;
+    }
+    return 0;
+}
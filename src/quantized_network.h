@@ -0,0 +1,172 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include "simd_kernels.h"
+#include "data_loader.h"
+#include "neural_network.h"
+
+/* A trained network with int8 weights for inference, a quarter of the size of the float weights.
+
+Every neuron gets its own weight scale, so a neuron with small weights does not lose its precision to a neuron with
+large ones: w = scale * q with q in [-127, 127]. The hidden layer works on the uint8 pixels of the images directly,
+the division by 255 of the float network is folded into the hidden layer scales. The hidden activations are quantized
+to uint8 as well, with a scale per hidden neuron that is calibrated on a set of images: the largest activation of the
+neuron on the calibration set becomes 255. These scales are folded into the output layer weights before they are quantized.
+
+Both layers are integer dot products, only the per-neuron scales, biases and the activation functions use float math. */
+class QuantizedNetwork
+{
+public:
+    /* Quantizes a network with one hidden layer, which may use any activation function except softmax.
+    Inputs past the image size of the calibration data are ignored, they are always zero.
+    The hidden activations are calibrated on the first calibrationCount images of calibrationData */
+    bool Quantize (const NeuralNetwork& network, const MNISTData& calibrationData, size_t calibrationCount)
+    {
+        if (network.LayerCount() != 2 || network.Layer(0).m_activation == c_softmaxActivation)
+        {
+            printf("Only networks with one sigmoid or ReLU hidden layer can be quantized, not %s.\n", network.Topology().ToString().c_str());
+            return false;
+        }
+
+        const size_t inputs = network.Inputs();
+        if (calibrationData.NumImages() == 0 || calibrationData.ImageSize() > inputs)
+        {
+            printf("The calibration data does not fit the network inputs.\n");
+            return false;
+        }
+
+        const float* hiddenBiases = network.LayerBiases(0);
+        const float* outputBiases = network.LayerBiases(1);
+
+        m_inputs = calibrationData.ImageSize();
+        m_hiddenNeurons = network.Layer(0).m_neurons;
+        m_outputNeurons = network.Layer(1).m_neurons;
+        m_hiddenActivation = network.Layer(0).m_activation;
+        m_outputActivation = network.Layer(1).m_activation;
+        m_hiddenBiases.assign(hiddenBiases, hiddenBiases + m_hiddenNeurons);
+        m_outputBiases.assign(outputBiases, outputBiases + m_outputNeurons);
+
+        // Hidden layer, a pixel p stands for the input value p / 255
+        m_hiddenWeights.resize(m_hiddenNeurons * m_inputs);
+        m_hiddenScales.resize(m_hiddenNeurons);
+        for (size_t neuronIndex = 0; neuronIndex < m_hiddenNeurons; ++neuronIndex)
+        {
+            float scale = QuantizeRow(network.NeuronWeights(0, neuronIndex), m_inputs, &m_hiddenWeights[neuronIndex * m_inputs]);
+            m_hiddenScales[neuronIndex] = scale / 255.0f;
+        }
+
+        // Find the range of every hidden activation on the calibration images, with the float weights
+        const SimdKernels& kernels = GetSimdKernels();
+        std::vector<float> input(inputs);
+        std::vector<float> hiddenOutputs(m_hiddenNeurons);
+        std::vector<float> maxActivations(m_hiddenNeurons, 0.0f);
+        calibrationCount = std::min(std::max<size_t>(calibrationCount, 1), calibrationData.NumImages());
+        for (size_t imageIndex = 0; imageIndex < calibrationCount; ++imageIndex)
+        {
+            uint8_t label;
+            calibrationData.GetImage(imageIndex, input.data(), inputs, label);
+            for (size_t neuronIndex = 0; neuronIndex < m_hiddenNeurons; ++neuronIndex)
+                hiddenOutputs[neuronIndex] = kernels.DotProduct(input.data(), network.NeuronWeights(0, neuronIndex), inputs);
+            ApplyActivation(m_hiddenActivation, hiddenOutputs.data(), hiddenBiases, m_hiddenNeurons);
+
+            for (size_t neuronIndex = 0; neuronIndex < m_hiddenNeurons; ++neuronIndex)
+                maxActivations[neuronIndex] = std::max(maxActivations[neuronIndex], hiddenOutputs[neuronIndex]);
+        }
+
+        // A neuron that never fired on the calibration set keeps the range [0, 1]
+        m_activationScales.resize(m_hiddenNeurons);
+        for (size_t neuronIndex = 0; neuronIndex < m_hiddenNeurons; ++neuronIndex)
+            m_activationScales[neuronIndex] = (maxActivations[neuronIndex] > 0.0f ? maxActivations[neuronIndex] : 1.0f) / 255.0f;
+
+        // Output layer, the activation scales are folded into the weights
+        std::vector<float> foldedWeights(m_hiddenNeurons);
+        m_outputWeights.resize(m_outputNeurons * m_hiddenNeurons);
+        m_outputScales.resize(m_outputNeurons);
+        for (size_t neuronIndex = 0; neuronIndex < m_outputNeurons; ++neuronIndex)
+        {
+            const float* outputWeights = network.NeuronWeights(1, neuronIndex);
+            for (size_t hiddenIndex = 0; hiddenIndex < m_hiddenNeurons; ++hiddenIndex)
+                foldedWeights[hiddenIndex] = outputWeights[hiddenIndex] * m_activationScales[hiddenIndex];
+            m_outputScales[neuronIndex] = QuantizeRow(foldedWeights.data(), m_hiddenNeurons, &m_outputWeights[neuronIndex * m_hiddenNeurons]);
+        }
+        return true;
+    }
+
+    /* Evaluates the network for the uint8 pixels of an image (Inputs() of them) and returns the detected label.
+    outputs receives the activations of the output neurons unless it is nullptr. Can be called from several threads at once */
+    uint8_t Classify (const uint8_t* pixels, float* outputs = nullptr) const
+    {
+        const SimdKernels& kernels = GetSimdKernels();
+
+        thread_local std::vector<float> values;
+        thread_local std::vector<uint8_t> hiddenOutputs;
+        values.resize(std::max(m_hiddenNeurons, m_outputNeurons));
+        hiddenOutputs.resize(m_hiddenNeurons);
+
+        for (size_t neuronIndex = 0; neuronIndex < m_hiddenNeurons; ++neuronIndex)
+            values[neuronIndex] = float(kernels.DotProductU8I8(pixels, &m_hiddenWeights[neuronIndex * m_inputs], m_inputs)) * m_hiddenScales[neuronIndex];
+        ApplyActivation(m_hiddenActivation, values.data(), m_hiddenBiases.data(), m_hiddenNeurons);
+
+        for (size_t neuronIndex = 0; neuronIndex < m_hiddenNeurons; ++neuronIndex)
+        {
+            float quantized = std::nearbyint(values[neuronIndex] / m_activationScales[neuronIndex]);
+            hiddenOutputs[neuronIndex] = uint8_t(std::min(quantized, 255.0f));
+        }
+
+        for (size_t neuronIndex = 0; neuronIndex < m_outputNeurons; ++neuronIndex)
+            values[neuronIndex] = float(kernels.DotProductU8I8(hiddenOutputs.data(), &m_outputWeights[neuronIndex * m_hiddenNeurons], m_hiddenNeurons)) * m_outputScales[neuronIndex];
+        ApplyActivation(m_outputActivation, values.data(), m_outputBiases.data(), m_outputNeurons);
+
+        if (outputs)
+            std::copy_n(values.begin(), m_outputNeurons, outputs);
+        return uint8_t(std::max_element(values.begin(), values.begin() + m_outputNeurons) - values.begin());
+    }
+
+    size_t Inputs () const { return m_inputs; }
+    size_t HiddenNeurons () const { return m_hiddenNeurons; }
+    size_t OutputNeurons () const { return m_outputNeurons; }
+
+    // The memory used by the weights, scales and biases
+    size_t SizeInBytes () const
+    {
+        return m_hiddenWeights.size() + m_outputWeights.size() +
+               sizeof(float) * (m_hiddenScales.size() + m_activationScales.size() + m_outputScales.size() + m_hiddenBiases.size() + m_outputBiases.size());
+    }
+
+private:
+
+    // Quantizes count weights to [-127, 127] and returns the scale, weight = scale * quantized weight
+    static float QuantizeRow (const float* weights, size_t count, int8_t* quantized)
+    {
+        float maxWeight = 0.0f;
+        for (size_t i = 0; i < count; ++i)
+            maxWeight = std::max(maxWeight, std::fabs(weights[i]));
+
+        float scale = maxWeight > 0.0f ? maxWeight / 127.0f : 1.0f;
+        for (size_t i = 0; i < count; ++i)
+            quantized[i] = int8_t(std::max(-127.0f, std::min(127.0f, std::nearbyint(weights[i] / scale))));
+        return scale;
+    }
+
+private:
+
+    size_t m_inputs = 0;
+    size_t m_hiddenNeurons = 0;
+    size_t m_outputNeurons = 0;
+    ActivationFunction m_hiddenActivation = c_sigmoidActivation;
+    ActivationFunction m_outputActivation = c_sigmoidActivation;
+
+    // One row of int8 weights per neuron
+    std::vector<int8_t> m_hiddenWeights;
+    std::vector<int8_t> m_outputWeights;
+
+    std::vector<float> m_hiddenScales;
+    std::vector<float> m_activationScales;
+    std::vector<float> m_outputScales;
+    std::vector<float> m_hiddenBiases;
+    std::vector<float> m_outputBiases;
+};
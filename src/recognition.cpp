@@ -2,153 +2,346 @@
 #include "timer.h"
 #include "data_loader.h"
 #include "neural_network.h"
+#include "model_export.h"
+#include "early_stopping.h"
 
-// Setting to "1" shows error after each training and writes them in Error.csv file
-// It may slow down the training process by 50%.
+/* Setting to "1" shows the running training accuracy and the validation accuracy after each epoch and writes them in
+Error.csv file. The validation runs in batches on all threads of the thread pool, its cost is the "evaluate" zone in Profile.csv */
 #define REPORT_ERROR_WHILE_TRAINING() 1
  
-const size_t c_numInputNeurons = 785;
-const size_t c_numHiddenNeurons = 30; // Setting up more neurons may give better result of neural network accuracy
-const size_t c_numOutputNeurons = 10;
+/* The layers of the network, see NetworkTopology::Parse(). More or wider hidden layers may give better accuracy,
+e.g. "785-100:relu-10:softmax". It can also be given on the command line with --topology */
+const char* c_networkTopology = "785-30-10";
 
 const size_t c_trainingEpochs = 30;
 const size_t c_miniBatchSize = 10;
-const float c_learningRate = 3.0f;
 
-// The datasets used for training and testing a model
+/* How the derivatives are applied, see OptimizerType and LearningRateSchedule. They can also be given on the command
+line with --optimizer and --schedule, the learning rate defaults to DefaultLearningRate() of the optimizer */
+const char* c_optimizer = "sgd";
+const char* c_learningRateSchedule = "constant";
+
+/* The last images of the training files are held out as a validation split that is never trained on, for smaller
+datasets a sixth of them. Only this split is scored after every epoch, c_validationSample limits that to a fixed random
+sample of it (0 scores all of it, --validation-sample on the command line) */
+const size_t c_validationImages = 10000;
+const size_t c_validationSample = 0;
+
+/* The training stops when the validation cost did not improve for this many epochs (0 always trains all epochs, --patience
+on the command line), and the network gets the weights of the best epoch back, see EarlyStopping */
+const size_t c_earlyStoppingPatience = 5;
+
+// Training is reproducible for a fixed seed and a fixed number of threads (0 uses all hardware threads)
+const uint32_t c_randomSeed = 1;
+const size_t c_numThreads = 0;
+
+// Threads that gather the shuffled training images into minibatches while the previous minibatch is trained
+const size_t c_prefetchThreads = 1;
+
+// Distorting an image costs more than training on it, so with --augment more threads gather the minibatches
+const size_t c_augmentationThreads = 4;
+
+/* The network is saved to this file after every epoch. If the file exists at startup, the training resumes
+after the last saved epoch, delete it to start from scratch */
+const char* c_checkpointFileName = "Checkpoint.bin";
+
+// The datasets used for training, validating and testing a model
 MNISTData g_trainingData;
+MNISTData g_validationData;
 MNISTData g_testData;
  
-// neural network
-NeuralNetwork <c_numInputNeurons, c_numHiddenNeurons, c_numOutputNeurons> g_neuralNetwork;
+// neural network and the threads it is trained on
+NeuralNetwork g_neuralNetwork;
+ThreadPool g_threadPool(c_numThreads);
  
-float GetDataAccuracy (const MNISTData& data)
+// Rows are the correct labels, columns the labels detected by the network
+template <typename EVALUATION>
+void PrintConfusionMatrix (const EVALUATION& evaluation)
 {
-    size_t correctItems = 0;
-    for (size_t i = 0, c = data.NumImages(); i < c; ++i)
+    printf("Confusion matrix (correct label / detected label):\n     ");
+    for (size_t detected = 0; detected < evaluation.m_confusionMatrix.size(); ++detected)
+        printf("%6zu", detected);
+    printf("\n");
+    for (size_t correct = 0; correct < evaluation.m_confusionMatrix.size(); ++correct)
     {
-        uint8_t label;
-        const float* pixels = data.GetImage(i, label);
-        uint8_t detectedLabel = g_neuralNetwork.ForwardPass(pixels, label);
-
-        if (detectedLabel == label)
-            ++correctItems;
+        printf("%4zu:", correct);
+        for (size_t detected = 0; detected < evaluation.m_confusionMatrix.size(); ++detected)
+            printf("%6zu", evaluation.m_confusionMatrix[correct][detected]);
+        printf("\n");
     }
-    return float(correctItems) / float(data.NumImages());
 }
  
 int main (int argc, char** argv)
 {
-    // Loading the MNIST data
-    if (!g_trainingData.Load(true) || !g_testData.Load(false))
+    /* Loading the MNIST data. Other datasets in IDX format and another network topology can be given on the command line:
+    recognition [--topology <layers>] [--optimizer <optimizer>] [--learning-rate <rate>] [--schedule <schedule>] [--warmup <epochs>]
+                [--patience <epochs>] [--validation-sample <images>] [--augment] [--hogwild] [--trace <file>]
+                [<training images> <training labels> <test images> <test labels>] [--training <images> <labels>] [--test <images> <labels>]
+    --optimizer is e.g. "momentum:0.9" or "adam" (see OptimizerSettings::ParseOptimizer()), --schedule e.g. "step:10:0.5"
+    or "cosine" (see OptimizerSettings::ParseSchedule()), --warmup raises the learning rate linearly over the first epochs.
+    --augment trains on randomly distorted copies of the training images, a new set every epoch (see ImageAugmenter).
+    --hogwild trains asynchronously, every thread updates the network without waiting for the others (see TrainingMode).
+    --training and --test can be repeated to stack several file pairs into one dataset (see DatasetArguments).
+    --trace writes every profiling zone to a Chrome trace event file (see Profiler), builds without profiling reject it */
+    const char* topologyText = c_networkTopology;
+    const char* optimizerText = c_optimizer;
+    const char* scheduleText = c_learningRateSchedule;
+    float learningRate = 0.0f;
+    float warmupEpochs = 0.0f;
+    size_t patience = c_earlyStoppingPatience;
+    size_t validationSampleSize = c_validationSample;
+    #if ENABLE_PROFILING()
+    const char* traceFileName = nullptr;
+    #endif
+    bool augment = false;
+    bool hogwild = false;
+    DatasetArguments datasets;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--topology") == 0 && i + 1 < argc)
+            topologyText = argv[++i];
+        else if (strcmp(argv[i], "--optimizer") == 0 && i + 1 < argc)
+            optimizerText = argv[++i];
+        else if (strcmp(argv[i], "--learning-rate") == 0 && i + 1 < argc)
+            learningRate = strtof(argv[++i], nullptr);
+        else if (strcmp(argv[i], "--schedule") == 0 && i + 1 < argc)
+            scheduleText = argv[++i];
+        else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc)
+            warmupEpochs = strtof(argv[++i], nullptr);
+        else if (strcmp(argv[i], "--patience") == 0 && i + 1 < argc)
+            patience = strtoul(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--validation-sample") == 0 && i + 1 < argc)
+            validationSampleSize = strtoul(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--augment") == 0)
+            augment = true;
+        else if (strcmp(argv[i], "--hogwild") == 0)
+            hogwild = true;
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+        {
+            #if ENABLE_PROFILING()
+                traceFileName = argv[++i];
+            #else
+                printf("--trace needs a build with profiling, this one was built with ENABLE_PROFILING() 0.\n");
+                return 1;
+            #endif
+        }
+        else if (!datasets.Parse(argc, argv, i))
+        {
+            printf("Unknown argument '%s'.\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (!datasets.Load(g_trainingData, g_testData))
     {
         printf("Could not load the MNIST data!\n");
         return 1;
     }
+
+    // The split shares the mapped training files, the sample is fixed so the scores of all epochs are comparable
+    g_trainingData.SplitOff(std::min(c_validationImages, g_trainingData.NumImages() / 6), g_validationData);
+    std::vector<size_t> validationSample;
+    if (validationSampleSize > 0 && validationSampleSize < g_validationData.NumImages())
+    {
+        validationSample.resize(g_validationData.NumImages());
+        for (size_t i = 0; i < validationSample.size(); ++i)
+            validationSample[i] = i;
+        std::mt19937 e2(c_randomSeed);
+        std::shuffle(validationSample.begin(), validationSample.end(), e2);
+        validationSample.resize(validationSampleSize);
+        std::sort(validationSample.begin(), validationSample.end());
+    }
+    const std::vector<size_t>* validationItems = validationSample.empty() ? nullptr : &validationSample;
+    printf("%zu training images, %zu validation images (%zu scored per epoch), %zu test images\n",
+        g_trainingData.NumImages(), g_validationData.NumImages(), validationItems ? validationSample.size() : g_validationData.NumImages(), g_testData.NumImages());
+
+    NetworkTopology topology;
+    if (!topology.Parse(topologyText))
+        return 4;
+
+    // A cosine schedule decays over the whole training unless it is given its own length
+    OptimizerSettings optimizer;
+    optimizer.m_totalEpochs = float(c_trainingEpochs);
+    optimizer.m_warmupEpochs = warmupEpochs;
+    if (!optimizer.ParseOptimizer(optimizerText) || !optimizer.ParseSchedule(scheduleText))
+        return 4;
+    if (learningRate <= 0.0f)
+        learningRate = DefaultLearningRate(optimizer.m_type);
+
+    g_neuralNetwork.Reset(topology, c_randomSeed);
+    g_neuralNetwork.SetOptimizer(optimizer);
+    g_neuralNetwork.SetThreadPool(&g_threadPool);
+    g_neuralNetwork.SetPrefetchThreads(augment ? c_augmentationThreads : c_prefetchThreads);
+    g_neuralNetwork.SetTrainingMode(hogwild ? c_hogwildTraining : c_synchronousTraining);
+    printf("Training a %s network%s%s\n", topology.ToString().c_str(), augment ? " on augmented images" : "", hogwild ? " with Hogwild updates" : "");
+    printf("Optimizer %s, learning rate %g\n\n", optimizer.ToString().c_str(), learningRate);
+    if (hogwild && optimizer.m_type != c_sgdOptimizer)
+        printf("Hogwild training takes plain SGD steps, the %s optimizer is not used.\n\n", OptimizerName(optimizer.m_type));
+
+    ImageAugmenter augmenter(g_trainingData.ImageRows(), g_trainingData.ImageColumns());
+    if (augment)
+        g_neuralNetwork.SetAugmenter(&augmenter);
+
+    /* Resume an interrupted training run from its last checkpoint, with the patience it had left. A training that
+    already ended is not continued, it is only evaluated and exported again */
+    EarlyStopping earlyStopping(patience);
+    bool ended = false;
+    if (FILE* checkpoint = fopen(c_checkpointFileName, "rb"))
+    {
+        fclose(checkpoint);
+        CheckpointTraining training;
+        AlignedVector<float> bestParameters;
+        if (!g_neuralNetwork.LoadCheckpoint(c_checkpointFileName, &training, &bestParameters))
+        {
+            printf("Could not resume from '%s'!\n", c_checkpointFileName);
+            return 3;
+        }
+        if (g_neuralNetwork.Topology() != topology)
+        {
+            printf("'%s' holds a %s network, delete it to train a %s network!\n", c_checkpointFileName, g_neuralNetwork.Topology().ToString().c_str(), topology.ToString().c_str());
+            return 3;
+        }
+        earlyStopping.Resume(g_neuralNetwork, training, bestParameters);
+        ended = training.m_state != c_trainingRunning;
+        if (ended)
+            printf("The training in '%s' %s after epoch %u with the weights of epoch %u, delete it to train again\n\n", c_checkpointFileName,
+                training.m_state == c_trainingStoppedEarly ? "stopped early" : "finished", g_neuralNetwork.Epoch(), earlyStopping.HasBest() ? earlyStopping.BestEpoch() : g_neuralNetwork.Epoch());
+        else
+            printf("Resuming the training after epoch %u from '%s'\n\n", g_neuralNetwork.Epoch(), c_checkpointFileName);
+    }
  
     #if REPORT_ERROR_WHILE_TRAINING()
-    FILE *file = fopen("Error.csv","w+t");
+    bool resumed = g_neuralNetwork.Epoch() > 0;
+    FILE *file = fopen("Error.csv", resumed ? "a+t" : "w+t");
     if (!file)
     {
         printf("Could not open 'Error.csv' for writing!\n");
         return 2;
     }
-    fprintf(file, "\"Training Data Accuracy\",\"Testing Data Accuracy\"\n");
+    if (!resumed)
+        fprintf(file, "\"Training Data Accuracy\",\"Validation Data Accuracy\",\"Training Data Cost\",\"Validation Data Cost\"\n");
+    #endif
+
+    // Where the time of every epoch went, one line per profiling zone and epoch
+    #if ENABLE_PROFILING()
+    FILE* profileFile = fopen("Profile.csv", g_neuralNetwork.Epoch() > 0 ? "a+t" : "w+t");
+    if (!profileFile)
+    {
+        printf("Could not open 'Profile.csv' for writing!\n");
+        return 2;
+    }
+    if (g_neuralNetwork.Epoch() == 0)
+        Profiler::WriteCSVHeader(profileFile);
+    if (traceFileName)
+        Profiler::Instance().EnableTrace();
+    const ProfileSnapshot trainingStart = Profiler::Instance().Snapshot();
+    auto trainingStartTime = std::chrono::steady_clock::now();
     #endif
 
+    bool stoppedEarly = false;
     {
         Timer timer("The training time:  ");
  
-        // We report error before each training of neural network
-        for (size_t epoch = 0; epoch < c_trainingEpochs; ++epoch)
+        // We report error after each training of neural network
+        for (size_t epoch = g_neuralNetwork.Epoch(); !ended && epoch < c_trainingEpochs; ++epoch)
         {
-            #if REPORT_ERROR_WHILE_TRAINING()
-                float accuracyTraining = GetDataAccuracy(g_trainingData);
-                float accuracyTest = GetDataAccuracy(g_testData);
-                printf("Training data accuracy: %0.2f%%\n", 100.0f*accuracyTraining);
-                printf("Test data accuracy: %0.2f%%\n\n", 100.0f*accuracyTest);
-                fprintf(file, "\"%f\",\"%f\"\n", accuracyTraining, accuracyTest);
+            #if ENABLE_PROFILING()
+                ProfileSnapshot epochStart = Profiler::Instance().Snapshot();
             #endif
  
             printf("Training the epoch %zu / %zu...\n", epoch+1, c_trainingEpochs);
-            g_neuralNetwork.Train(g_trainingData, c_miniBatchSize, c_learningRate);
+            g_neuralNetwork.Train(g_trainingData, c_miniBatchSize, learningRate);
+
+            if (hogwild)
+            {
+                // A high staleness means the threads often train on parameters that are already several updates old
+                const HogwildStats& stats = g_neuralNetwork.HogwildTrainingStats();
+                printf("Hogwild: %0.0f images per second on %zu threads, staleness %0.2f on average and %llu at most, %0.1f%% of the inputs were nonzero\n",
+                    stats.ItemsPerSecond(), stats.m_workers, stats.m_meanStaleness, (unsigned long long)stats.m_maxStaleness, 100.0 * stats.m_inputDensity);
+            }
+            else
+            {
+                // Time the training spent waiting for its input is time the prefetch threads could not hide
+                const PrefetchStats& input = g_neuralNetwork.InputStats();
+                printf("Waited %0.3f seconds (%0.1f%%) for input, %zu of %zu minibatches were not ready, gathering took %0.2f seconds\n",
+                    input.m_waitSeconds, 100.0 * input.WaitFraction(), input.m_stalls, input.m_batches, input.m_gatherSeconds);
+            }
+
+            /* The training accuracy comes from the forward passes of the epoch, only the validation split is scored.
+            Without reports and early stopping nothing is evaluated between the epochs */
+            bool stop = false;
+            if (REPORT_ERROR_WHILE_TRAINING() || patience > 0)
+            {
+                auto validation = g_neuralNetwork.Evaluate(g_validationData, validationItems);
+                #if REPORT_ERROR_WHILE_TRAINING()
+                    const TrainingStats& training = g_neuralNetwork.TrainingStatistics();
+                    printf("Training data accuracy: %0.2f%% (cost %0.4f, running during the epoch)\n", 100.0f*training.Accuracy(), training.Cost());
+                    printf("Validation data accuracy: %0.2f%% (cost %0.4f)\n", 100.0f*validation.m_accuracy, validation.m_cost);
+                    fprintf(file, "\"%f\",\"%f\",\"%f\",\"%f\"\n", training.Accuracy(), validation.m_accuracy, training.Cost(), validation.m_cost);
+                #endif
+                stop = earlyStopping.Update(g_neuralNetwork, validation);
+            }
+
+            CheckpointTraining training = earlyStopping.CheckpointState(c_trainingRunning);
+            if (!g_neuralNetwork.SaveCheckpoint(c_checkpointFileName, &training, earlyStopping.CheckpointParameters(g_neuralNetwork)))
+                printf("Could not save the checkpoint!\n");
             printf("\n");
+
+            #if ENABLE_PROFILING()
+                Profiler::WriteCSV(profileFile, epoch + 1, Profiler::Instance().Snapshot() - epochStart);
+                fflush(profileFile);
+            #endif
+
+            if (stop)
+            {
+                printf("The validation cost did not improve for %zu epochs, the training stops after epoch %zu.\n\n", patience, epoch + 1);
+                stoppedEarly = true;
+                break;
+            }
         }
     }
+
+    /* The checkpoint keeps the best weights for the other tools and is marked as ended, so the next run does not train
+    on from the weights of the best epoch with the optimizer state of the last one */
+    if (!ended)
+    {
+        if (earlyStopping.RestoreBest(g_neuralNetwork))
+            printf("Restored the weights of epoch %u, the best validation accuracy %0.2f%% (cost %0.4f).\n", earlyStopping.BestEpoch(), 100.0f*earlyStopping.BestAccuracy(), earlyStopping.BestCost());
+        CheckpointTraining training = earlyStopping.CheckpointState(stoppedEarly ? c_trainingStoppedEarly : c_trainingFinished);
+        if (!g_neuralNetwork.SaveCheckpoint(c_checkpointFileName, &training))
+            printf("Could not save the checkpoint!\n");
+    }
+
+    #if ENABLE_PROFILING()
+        // The self time of every zone summed over all threads, so the shares add up to more than 100% with several threads
+        std::chrono::duration<double> trainingSeconds = std::chrono::steady_clock::now() - trainingStartTime;
+        printf("\nProfile of the training:\n");
+        Profiler::Print(Profiler::Instance().Snapshot() - trainingStart, trainingSeconds.count());
+        fclose(profileFile);
+        if (traceFileName && Profiler::Instance().WriteTrace(traceFileName))
+            printf("The trace of all zones is in '%s'\n", traceFileName);
+    #endif
  
     // report final error
-    float accuracyTraining = GetDataAccuracy(g_trainingData);
-    float accuracyTest = GetDataAccuracy(g_testData);
-    printf("\nFinal training data accuracy: %0.2f%%\n", 100.0f*accuracyTraining);
-    printf("Final test data accuracy: %0.2f%%\n\n", 100.0f*accuracyTest);
+    auto training = g_neuralNetwork.Evaluate(g_trainingData);
+    auto test = g_neuralNetwork.Evaluate(g_testData);
+    printf("\nFinal training data accuracy: %0.2f%% (cost %0.4f)\n", 100.0f*training.m_accuracy, training.m_cost);
+    printf("Final test data accuracy: %0.2f%% (cost %0.4f)\n\n", 100.0f*test.m_accuracy, test.m_cost);
+    PrintConfusionMatrix(test);
+    printf("\n");
  
     #if REPORT_ERROR_WHILE_TRAINING()
-        fprintf(file, "\"%f\",\"%f\"\n", accuracyTraining, accuracyTest);
         fclose(file);
     #endif
  
-    // Write out the final weights and biases as JSON for use in the web demo
-    {
-        FILE* file = fopen("WeightsBiasesJSON.txt", "w+t");
-        fprintf(file, "{\n");
- 
-        // network structure
-        fprintf(file, "  \"InputNeurons\":%zu,\n", c_numInputNeurons);
-        fprintf(file, "  \"HiddenNeurons\":%zu,\n", c_numHiddenNeurons);
-        fprintf(file, "  \"OutputNeurons\":%zu,\n", c_numOutputNeurons);
- 
-        // HiddenBiases
-        auto hiddenBiases = g_neuralNetwork.GetHiddenLayerBiases();
-        fprintf(file, "  \"HiddenBiases\" : [\n");
-        for (size_t i = 0; i < hiddenBiases.size(); ++i)
-        {
-            fprintf(file, "    %f", hiddenBiases[i]);
-            if (i < hiddenBiases.size() -1)
-                fprintf(file, ",");
-            fprintf(file, "\n");
-        }
-        fprintf(file, "  ],\n");
- 
-        // HiddenWeights
-        auto hiddenWeights = g_neuralNetwork.GetHiddenLayerWeights();
-        fprintf(file, "  \"HiddenWeights\" : [\n");
-        for (size_t i = 0; i < hiddenWeights.size(); ++i)
-        {
-            fprintf(file, "    %f", hiddenWeights[i]);
-            if (i < hiddenWeights.size() - 1)
-                fprintf(file, ",");
-            fprintf(file, "\n");
-        }
-        fprintf(file, "  ],\n");
- 
-        // OutputBiases
-        auto outputBiases = g_neuralNetwork.GetOutputLayerBiases();
-        fprintf(file, "  \"OutputBiases\" : [\n");
-        for (size_t i = 0; i < outputBiases.size(); ++i)
-        {
-            fprintf(file, "    %f", outputBiases[i]);
-            if (i < outputBiases.size() - 1)
-                fprintf(file, ",");
-            fprintf(file, "\n");
-        }
-        fprintf(file, "  ],\n");
- 
-        // OutputWeights
-        auto outputWeights = g_neuralNetwork.GetOutputLayerWeights();
-        fprintf(file, "  \"OutputWeights\" : [\n");
-        for (size_t i = 0; i < outputWeights.size(); ++i)
-        {
-            fprintf(file, "    %f", outputWeights[i]);
-            if (i < outputWeights.size() - 1)
-                fprintf(file, ",");
-            fprintf(file, "\n");
-        }
-        fprintf(file, "  ]\n");
- 
-        // The end of training the neural network
-        fprintf(file, "}\n");
-        fclose(file);
-    }
+    /* Write out the final weights and biases for the web demo. The blob holds any topology, its base64 text can be
+    pasted into demonstration.html; the JSON is the format older copies of the page embed */
+    ExportWeightsBlob("Weights.bin", g_neuralNetwork, c_weightsFloat32);
+    ExportWeightsBase64("WeightsBase64.txt", g_neuralNetwork, c_weightsFloat32);
+    if (IsWebDemoJSONNetwork(g_neuralNetwork))
+        ExportWebDemoJSON("WeightsBiasesJSON.txt", g_neuralNetwork);
+    else
+        printf("The JSON of the web demo cannot hold a %s network, WeightsBiasesJSON.txt is not written.\n", topology.ToString().c_str());
     
     return 0;
 }
\ No newline at end of file
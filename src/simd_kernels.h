@@ -0,0 +1,770 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <cmath>
+#include <algorithm>
+
+/* Vectorized versions of the inner loops of the network (dot products, y += a * x, the sums and updates of scaled
+matrix rows used for sparse inputs, the fused optimizer steps, the sigmoid activation and the integer dot product of
+the quantized network).
+The best instruction set is selected once at runtime, so one binary runs on every x86 generation:
+AVX-512 and AVX2 (with FMA) use their own code paths, everything else falls back to the scalar loops.
+On ARM64, NEON is always available and used directly. */
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+    #define SIMD_X86() 1
+    #include <immintrin.h>
+    #if defined(_MSC_VER) && !defined(__clang__)
+        #include <intrin.h>
+        // MSVC allows using any intrinsic without enabling the instruction set for the whole file
+        #define SIMD_TARGET_AVX2
+        #define SIMD_TARGET_AVX512
+    #else
+        #define SIMD_TARGET_AVX2 __attribute__((target("avx2,fma")))
+        #define SIMD_TARGET_AVX512 __attribute__((target("avx512f,avx2,fma")))
+    #endif
+#else
+    #define SIMD_X86() 0
+#endif
+
+#if defined(__aarch64__) || defined(_M_ARM64)
+    #define SIMD_NEON() 1
+    #include <arm_neon.h>
+#else
+    #define SIMD_NEON() 0
+#endif
+
+/* The coefficients of one fused optimizer step over the parameter arena, see Optimizer. The derivatives are summed
+over a minibatch, gradientScale (1 / minibatch size) turns them into the mean */
+struct OptimizerStepArgs
+{
+    float m_gradientScale;
+
+    // The learning rate, for Adam including the bias correction of both moments
+    float m_rate;
+
+    // The momentum or Adam's beta1, the decay of the velocity or the first moment
+    float m_momentum;
+
+    // Adam's beta2 and epsilon (the latter also bias corrected)
+    float m_beta2;
+    float m_epsilon;
+
+    // Nesterov momentum steps along g + momentum * v instead of v
+    bool m_nesterov;
+};
+
+struct SimdKernels
+{
+    const char* m_name;
+
+    // Returns the sum of a[i] * b[i]
+    float (*DotProduct) (const float* a, const float* b, size_t count);
+
+    // y[i] += a * x[i], used for the outer products of the gradient and for the weight update (a = -learningRate)
+    void (*MultiplyAdd) (float* y, float a, const float* x, size_t count);
+
+    // values[i] = 1 / (1 + exp(-(values[i] + biases[i])))
+    void (*Sigmoid) (float* values, const float* biases, size_t count);
+
+    // Returns the exact sum of a[i] * b[i] for uint8 values (pixels, activations) and int8 weights
+    int32_t (*DotProductU8I8) (const uint8_t* a, const int8_t* b, size_t count);
+
+    /* y[j] += sum of values[k] * rows[indices[k] * stride + j] over k < rowCount, for j < count. Without indices the
+    first rowCount rows are summed. With input-major weights this is the first layer for the nonzero inputs of an item */
+    void (*SumScaledRows) (float* y, size_t count, const float* rows, size_t stride, const uint32_t* indices, const float* values, size_t rowCount);
+
+    /* rows[indices[k] * stride + j] += values[k] * x[j] for k < rowCount and j < count, the outer product of a sparse
+    and a dense vector. Without indices the first rowCount rows are updated */
+    void (*AddScaledRows) (float* rows, size_t stride, const uint32_t* indices, const float* values, size_t rowCount, const float* x, size_t count);
+
+    /* v = momentum * v + g and w -= rate * v (or rate * (g + momentum * v) for Nesterov) with g = gradientScale * gradients,
+    the parameters, the velocity and the gradients are read and written in a single pass */
+    void (*MomentumStep) (float* parameters, float* velocity, const float* gradients, size_t count, const OptimizerStepArgs& args);
+
+    // m = beta1 * m + (1 - beta1) * g, s = beta2 * s + (1 - beta2) * g^2 and w -= rate * m / (sqrt(s) + epsilon) in a single pass
+    void (*AdamStep) (float* parameters, float* moments, float* squares, const float* gradients, size_t count, const OptimizerStepArgs& args);
+};
+
+//-------------------------------------------------------------------------------------------------
+// Scalar fallback
+
+inline float DotProductScalar (const float* a, const float* b, size_t count)
+{
+    float sum = 0.0f;
+    for (size_t i = 0; i < count; ++i)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+inline void MultiplyAddScalar (float* y, float a, const float* x, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        y[i] += a * x[i];
+}
+
+inline void SigmoidScalar (float* values, const float* biases, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        values[i] = 1.0f / (1.0f + std::exp(-(values[i] + biases[i])));
+}
+
+inline int32_t DotProductU8I8Scalar (const uint8_t* a, const int8_t* b, size_t count)
+{
+    int32_t sum = 0;
+    for (size_t i = 0; i < count; ++i)
+        sum += int32_t(a[i]) * int32_t(b[i]);
+    return sum;
+}
+
+inline void SumScaledRowsScalar (float* y, size_t count, const float* rows, size_t stride, const uint32_t* indices, const float* values, size_t rowCount)
+{
+    for (size_t k = 0; k < rowCount; ++k)
+    {
+        const float* row = rows + (indices ? indices[k] : k) * stride;
+        for (size_t j = 0; j < count; ++j)
+            y[j] += values[k] * row[j];
+    }
+}
+
+inline void AddScaledRowsScalar (float* rows, size_t stride, const uint32_t* indices, const float* values, size_t rowCount, const float* x, size_t count)
+{
+    for (size_t k = 0; k < rowCount; ++k)
+    {
+        float* row = rows + (indices ? indices[k] : k) * stride;
+        for (size_t j = 0; j < count; ++j)
+            row[j] += values[k] * x[j];
+    }
+}
+
+// The step along the velocity and along the gradient, Nesterov momentum looks ahead by one more momentum step
+inline float MomentumVelocityRate (const OptimizerStepArgs& args) { return -args.m_rate * (args.m_nesterov ? args.m_momentum : 1.0f); }
+inline float MomentumGradientRate (const OptimizerStepArgs& args) { return args.m_nesterov ? -args.m_rate : 0.0f; }
+
+inline void MomentumStepScalar (float* parameters, float* velocity, const float* gradients, size_t count, const OptimizerStepArgs& args)
+{
+    const float velocityRate = MomentumVelocityRate(args);
+    const float gradientRate = MomentumGradientRate(args);
+    for (size_t i = 0; i < count; ++i)
+    {
+        float g = args.m_gradientScale * gradients[i];
+        float v = args.m_momentum * velocity[i] + g;
+        velocity[i] = v;
+        parameters[i] += velocityRate * v + gradientRate * g;
+    }
+}
+
+inline void AdamStepScalar (float* parameters, float* moments, float* squares, const float* gradients, size_t count, const OptimizerStepArgs& args)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        float g = args.m_gradientScale * gradients[i];
+        float m = args.m_momentum * moments[i] + (1.0f - args.m_momentum) * g;
+        float s = args.m_beta2 * squares[i] + (1.0f - args.m_beta2) * g * g;
+        moments[i] = m;
+        squares[i] = s;
+        parameters[i] -= args.m_rate * m / (std::sqrt(s) + args.m_epsilon);
+    }
+}
+
+/* The vectorized exp() below follows the Cephes expf: the argument is split into n * ln(2) + r,
+exp(r) is approximated by a polynomial and 2^n is built directly in the float exponent bits.
+The argument is clamped so that 2^n always stays a normal float, the relative error is about 1e-7 */
+const float c_expMax = 88.0f;
+const float c_expMin = -88.0f;
+const float c_log2e = 1.44269504088896341f;
+const float c_expC1 = 0.693359375f;
+const float c_expC2 = -2.12194440e-4f;
+const float c_expP0 = 1.9875691500e-4f;
+const float c_expP1 = 1.3981999507e-3f;
+const float c_expP2 = 8.3334519073e-3f;
+const float c_expP3 = 4.1665795894e-2f;
+const float c_expP4 = 1.6666665459e-1f;
+const float c_expP5 = 5.0000001201e-1f;
+
+#if SIMD_X86()
+
+//-------------------------------------------------------------------------------------------------
+// AVX2 + FMA
+
+SIMD_TARGET_AVX2 inline float HorizontalSum (__m256 v)
+{
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+    return _mm_cvtss_f32(sum);
+}
+
+SIMD_TARGET_AVX2 inline float DotProductAVX2 (const float* a, const float* b, size_t count)
+{
+    // Four independent accumulators hide the latency of the FMA instructions
+    __m256 sum0 = _mm256_setzero_ps();
+    __m256 sum1 = _mm256_setzero_ps();
+    __m256 sum2 = _mm256_setzero_ps();
+    __m256 sum3 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+        sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), sum1);
+        sum2 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 16), _mm256_loadu_ps(b + i + 16), sum2);
+        sum3 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 24), _mm256_loadu_ps(b + i + 24), sum3);
+    }
+    for (; i + 8 <= count; i += 8)
+        sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), sum0);
+
+    float sum = HorizontalSum(_mm256_add_ps(_mm256_add_ps(sum0, sum1), _mm256_add_ps(sum2, sum3)));
+    for (; i < count; ++i)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+SIMD_TARGET_AVX2 inline void MultiplyAddAVX2 (float* y, float a, const float* x, size_t count)
+{
+    __m256 scale = _mm256_set1_ps(a);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        _mm256_storeu_ps(y + i, _mm256_fmadd_ps(scale, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+        _mm256_storeu_ps(y + i + 8, _mm256_fmadd_ps(scale, _mm256_loadu_ps(x + i + 8), _mm256_loadu_ps(y + i + 8)));
+    }
+    for (; i + 8 <= count; i += 8)
+        _mm256_storeu_ps(y + i, _mm256_fmadd_ps(scale, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+    for (; i < count; ++i)
+        y[i] += a * x[i];
+}
+
+/* The values are widened to int16 and multiplied with madd, which adds pairs of products into int32. This is exact,
+unlike maddubs that adds the uint8 * int8 products in saturating int16. The AVX-512 kernels use this version as well,
+512 bit integer multiplies would need AVX512BW on top of AVX512F */
+SIMD_TARGET_AVX2 inline int32_t DotProductU8I8AVX2 (const uint8_t* a, const int8_t* b, size_t count)
+{
+    __m256i sum0 = _mm256_setzero_si256();
+    __m256i sum1 = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        __m256i a0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(a + i)));
+        __m256i b0 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(b + i)));
+        __m256i a1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(a + i + 16)));
+        __m256i b1 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(b + i + 16)));
+        sum0 = _mm256_add_epi32(sum0, _mm256_madd_epi16(a0, b0));
+        sum1 = _mm256_add_epi32(sum1, _mm256_madd_epi16(a1, b1));
+    }
+    for (; i + 16 <= count; i += 16)
+    {
+        __m256i a0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(a + i)));
+        __m256i b0 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(b + i)));
+        sum0 = _mm256_add_epi32(sum0, _mm256_madd_epi16(a0, b0));
+    }
+
+    __m256i sum = _mm256_add_epi32(sum0, sum1);
+    __m128i sum128 = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    sum128 = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum128 = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(sum128) + DotProductU8I8Scalar(a + i, b + i, count - i);
+}
+
+// Selects the first "remaining" lanes of a vector for maskload / maskstore
+SIMD_TARGET_AVX2 inline __m256i TailMaskAVX2 (size_t remaining)
+{
+    __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    return _mm256_cmpgt_epi32(_mm256_set1_epi32(int(std::min<size_t>(remaining, 8))), lanes);
+}
+
+/* The output columns are processed in blocks of 32 that stay in four registers while all rows are added, so y is
+only read and written once per block */
+SIMD_TARGET_AVX2 inline void SumScaledRowsAVX2 (float* y, size_t count, const float* rows, size_t stride, const uint32_t* indices, const float* values, size_t rowCount)
+{
+    for (size_t j = 0; j < count; j += 32)
+    {
+        size_t remaining = count - j;
+        __m256i mask0 = TailMaskAVX2(remaining);
+        __m256i mask1 = TailMaskAVX2(remaining > 8 ? remaining - 8 : 0);
+        __m256i mask2 = TailMaskAVX2(remaining > 16 ? remaining - 16 : 0);
+        __m256i mask3 = TailMaskAVX2(remaining > 24 ? remaining - 24 : 0);
+        __m256 sum0 = _mm256_maskload_ps(y + j, mask0);
+        __m256 sum1 = _mm256_maskload_ps(y + j + 8, mask1);
+        __m256 sum2 = _mm256_maskload_ps(y + j + 16, mask2);
+        __m256 sum3 = _mm256_maskload_ps(y + j + 24, mask3);
+        for (size_t k = 0; k < rowCount; ++k)
+        {
+            const float* row = rows + (indices ? indices[k] : k) * stride + j;
+            __m256 value = _mm256_set1_ps(values[k]);
+            sum0 = _mm256_fmadd_ps(value, _mm256_maskload_ps(row, mask0), sum0);
+            sum1 = _mm256_fmadd_ps(value, _mm256_maskload_ps(row + 8, mask1), sum1);
+            sum2 = _mm256_fmadd_ps(value, _mm256_maskload_ps(row + 16, mask2), sum2);
+            sum3 = _mm256_fmadd_ps(value, _mm256_maskload_ps(row + 24, mask3), sum3);
+        }
+        _mm256_maskstore_ps(y + j, mask0, sum0);
+        _mm256_maskstore_ps(y + j + 8, mask1, sum1);
+        _mm256_maskstore_ps(y + j + 16, mask2, sum2);
+        _mm256_maskstore_ps(y + j + 24, mask3, sum3);
+    }
+}
+
+SIMD_TARGET_AVX2 inline void AddScaledRowsAVX2 (float* rows, size_t stride, const uint32_t* indices, const float* values, size_t rowCount, const float* x, size_t count)
+{
+    for (size_t k = 0; k < rowCount; ++k)
+        MultiplyAddAVX2(rows + (indices ? indices[k] : k) * stride, values[k], x, count);
+}
+
+SIMD_TARGET_AVX2 inline void MomentumStepAVX2 (float* parameters, float* velocity, const float* gradients, size_t count, const OptimizerStepArgs& args)
+{
+    const __m256 gradientScale = _mm256_set1_ps(args.m_gradientScale);
+    const __m256 momentum = _mm256_set1_ps(args.m_momentum);
+    const __m256 velocityRate = _mm256_set1_ps(MomentumVelocityRate(args));
+    const __m256 gradientRate = _mm256_set1_ps(MomentumGradientRate(args));
+    for (size_t i = 0; i < count; i += 8)
+    {
+        __m256i mask = TailMaskAVX2(count - i);
+        __m256 g = _mm256_mul_ps(gradientScale, _mm256_maskload_ps(gradients + i, mask));
+        __m256 v = _mm256_fmadd_ps(momentum, _mm256_maskload_ps(velocity + i, mask), g);
+        __m256 w = _mm256_fmadd_ps(velocityRate, v, _mm256_maskload_ps(parameters + i, mask));
+        _mm256_maskstore_ps(velocity + i, mask, v);
+        _mm256_maskstore_ps(parameters + i, mask, _mm256_fmadd_ps(gradientRate, g, w));
+    }
+}
+
+SIMD_TARGET_AVX2 inline void AdamStepAVX2 (float* parameters, float* moments, float* squares, const float* gradients, size_t count, const OptimizerStepArgs& args)
+{
+    const __m256 gradientScale = _mm256_set1_ps(args.m_gradientScale);
+    const __m256 beta1 = _mm256_set1_ps(args.m_momentum);
+    const __m256 gradientWeight1 = _mm256_set1_ps(1.0f - args.m_momentum);
+    const __m256 beta2 = _mm256_set1_ps(args.m_beta2);
+    const __m256 gradientWeight2 = _mm256_set1_ps(1.0f - args.m_beta2);
+    const __m256 rate = _mm256_set1_ps(args.m_rate);
+    const __m256 epsilon = _mm256_set1_ps(args.m_epsilon);
+    for (size_t i = 0; i < count; i += 8)
+    {
+        __m256i mask = TailMaskAVX2(count - i);
+        __m256 g = _mm256_mul_ps(gradientScale, _mm256_maskload_ps(gradients + i, mask));
+        __m256 m = _mm256_fmadd_ps(beta1, _mm256_maskload_ps(moments + i, mask), _mm256_mul_ps(gradientWeight1, g));
+        __m256 s = _mm256_fmadd_ps(beta2, _mm256_maskload_ps(squares + i, mask), _mm256_mul_ps(gradientWeight2, _mm256_mul_ps(g, g)));
+        __m256 step = _mm256_div_ps(m, _mm256_add_ps(_mm256_sqrt_ps(s), epsilon));
+        _mm256_maskstore_ps(moments + i, mask, m);
+        _mm256_maskstore_ps(squares + i, mask, s);
+        _mm256_maskstore_ps(parameters + i, mask, _mm256_fnmadd_ps(rate, step, _mm256_maskload_ps(parameters + i, mask)));
+    }
+}
+
+SIMD_TARGET_AVX2 inline __m256 ExpAVX2 (__m256 x)
+{
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(c_expMin)), _mm256_set1_ps(c_expMax));
+
+    __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(c_log2e)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    x = _mm256_fnmadd_ps(n, _mm256_set1_ps(c_expC1), x);
+    x = _mm256_fnmadd_ps(n, _mm256_set1_ps(c_expC2), x);
+
+    __m256 y = _mm256_set1_ps(c_expP0);
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(c_expP1));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(c_expP2));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(c_expP3));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(c_expP4));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(c_expP5));
+    y = _mm256_fmadd_ps(y, _mm256_mul_ps(x, x), _mm256_add_ps(x, _mm256_set1_ps(1.0f)));
+
+    __m256i exponent = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(y, _mm256_castsi256_ps(exponent));
+}
+
+SIMD_TARGET_AVX2 inline void SigmoidAVX2 (float* values, const float* biases, size_t count)
+{
+    const __m256 one = _mm256_set1_ps(1.0f);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 z = _mm256_add_ps(_mm256_loadu_ps(values + i), _mm256_loadu_ps(biases + i));
+        __m256 e = ExpAVX2(_mm256_sub_ps(_mm256_setzero_ps(), z));
+        _mm256_storeu_ps(values + i, _mm256_div_ps(one, _mm256_add_ps(one, e)));
+    }
+    SigmoidScalar(values + i, biases + i, count - i);
+}
+
+//-------------------------------------------------------------------------------------------------
+// AVX-512
+
+/* GCC's AVX-512 headers use self-initialized "undefined" registers, which trigger false
+uninitialized warnings when the instruction set is only enabled through the target attribute */
+#if defined(__GNUC__) && !defined(__clang__)
+    #pragma GCC diagnostic push
+    #pragma GCC diagnostic ignored "-Wuninitialized"
+    #pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+SIMD_TARGET_AVX512 inline float DotProductAVX512 (const float* a, const float* b, size_t count)
+{
+    __m512 sum0 = _mm512_setzero_ps();
+    __m512 sum1 = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), sum0);
+        sum1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), sum1);
+    }
+    for (; i + 16 <= count; i += 16)
+        sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), sum0);
+
+    // The tail is handled with a masked load, which reads zeros for the missing elements
+    if (i < count)
+    {
+        __mmask16 mask = __mmask16((1u << (count - i)) - 1);
+        sum1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i), sum1);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(sum0, sum1));
+}
+
+SIMD_TARGET_AVX512 inline void MultiplyAddAVX512 (float* y, float a, const float* x, size_t count)
+{
+    __m512 scale = _mm512_set1_ps(a);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+        _mm512_storeu_ps(y + i, _mm512_fmadd_ps(scale, _mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i)));
+    if (i < count)
+    {
+        __mmask16 mask = __mmask16((1u << (count - i)) - 1);
+        __m512 result = _mm512_fmadd_ps(scale, _mm512_maskz_loadu_ps(mask, x + i), _mm512_maskz_loadu_ps(mask, y + i));
+        _mm512_mask_storeu_ps(y + i, mask, result);
+    }
+}
+
+SIMD_TARGET_AVX512 inline __mmask16 TailMaskAVX512 (size_t remaining)
+{
+    return remaining >= 16 ? __mmask16(0xFFFF) : __mmask16((1u << remaining) - 1);
+}
+
+// Blocks of 64 output columns stay in four registers while all rows are added, see SumScaledRowsAVX2()
+SIMD_TARGET_AVX512 inline void SumScaledRowsAVX512 (float* y, size_t count, const float* rows, size_t stride, const uint32_t* indices, const float* values, size_t rowCount)
+{
+    for (size_t j = 0; j < count; j += 64)
+    {
+        size_t remaining = count - j;
+        __mmask16 mask0 = TailMaskAVX512(remaining);
+        __mmask16 mask1 = TailMaskAVX512(remaining > 16 ? remaining - 16 : 0);
+        __mmask16 mask2 = TailMaskAVX512(remaining > 32 ? remaining - 32 : 0);
+        __mmask16 mask3 = TailMaskAVX512(remaining > 48 ? remaining - 48 : 0);
+        __m512 sum0 = _mm512_maskz_loadu_ps(mask0, y + j);
+        __m512 sum1 = _mm512_maskz_loadu_ps(mask1, y + j + 16);
+        __m512 sum2 = _mm512_maskz_loadu_ps(mask2, y + j + 32);
+        __m512 sum3 = _mm512_maskz_loadu_ps(mask3, y + j + 48);
+        for (size_t k = 0; k < rowCount; ++k)
+        {
+            const float* row = rows + (indices ? indices[k] : k) * stride + j;
+            __m512 value = _mm512_set1_ps(values[k]);
+            sum0 = _mm512_fmadd_ps(value, _mm512_maskz_loadu_ps(mask0, row), sum0);
+            if (mask1)
+            {
+                sum1 = _mm512_fmadd_ps(value, _mm512_maskz_loadu_ps(mask1, row + 16), sum1);
+                if (mask2)
+                {
+                    sum2 = _mm512_fmadd_ps(value, _mm512_maskz_loadu_ps(mask2, row + 32), sum2);
+                    sum3 = _mm512_fmadd_ps(value, _mm512_maskz_loadu_ps(mask3, row + 48), sum3);
+                }
+            }
+        }
+        _mm512_mask_storeu_ps(y + j, mask0, sum0);
+        _mm512_mask_storeu_ps(y + j + 16, mask1, sum1);
+        _mm512_mask_storeu_ps(y + j + 32, mask2, sum2);
+        _mm512_mask_storeu_ps(y + j + 48, mask3, sum3);
+    }
+}
+
+SIMD_TARGET_AVX512 inline void AddScaledRowsAVX512 (float* rows, size_t stride, const uint32_t* indices, const float* values, size_t rowCount, const float* x, size_t count)
+{
+    for (size_t k = 0; k < rowCount; ++k)
+        MultiplyAddAVX512(rows + (indices ? indices[k] : k) * stride, values[k], x, count);
+}
+
+SIMD_TARGET_AVX512 inline void MomentumStepAVX512 (float* parameters, float* velocity, const float* gradients, size_t count, const OptimizerStepArgs& args)
+{
+    const __m512 gradientScale = _mm512_set1_ps(args.m_gradientScale);
+    const __m512 momentum = _mm512_set1_ps(args.m_momentum);
+    const __m512 velocityRate = _mm512_set1_ps(MomentumVelocityRate(args));
+    const __m512 gradientRate = _mm512_set1_ps(MomentumGradientRate(args));
+    for (size_t i = 0; i < count; i += 16)
+    {
+        __mmask16 mask = TailMaskAVX512(count - i);
+        __m512 g = _mm512_mul_ps(gradientScale, _mm512_maskz_loadu_ps(mask, gradients + i));
+        __m512 v = _mm512_fmadd_ps(momentum, _mm512_maskz_loadu_ps(mask, velocity + i), g);
+        __m512 w = _mm512_fmadd_ps(velocityRate, v, _mm512_maskz_loadu_ps(mask, parameters + i));
+        _mm512_mask_storeu_ps(velocity + i, mask, v);
+        _mm512_mask_storeu_ps(parameters + i, mask, _mm512_fmadd_ps(gradientRate, g, w));
+    }
+}
+
+SIMD_TARGET_AVX512 inline void AdamStepAVX512 (float* parameters, float* moments, float* squares, const float* gradients, size_t count, const OptimizerStepArgs& args)
+{
+    const __m512 gradientScale = _mm512_set1_ps(args.m_gradientScale);
+    const __m512 beta1 = _mm512_set1_ps(args.m_momentum);
+    const __m512 gradientWeight1 = _mm512_set1_ps(1.0f - args.m_momentum);
+    const __m512 beta2 = _mm512_set1_ps(args.m_beta2);
+    const __m512 gradientWeight2 = _mm512_set1_ps(1.0f - args.m_beta2);
+    const __m512 rate = _mm512_set1_ps(args.m_rate);
+    const __m512 epsilon = _mm512_set1_ps(args.m_epsilon);
+    for (size_t i = 0; i < count; i += 16)
+    {
+        __mmask16 mask = TailMaskAVX512(count - i);
+        __m512 g = _mm512_mul_ps(gradientScale, _mm512_maskz_loadu_ps(mask, gradients + i));
+        __m512 m = _mm512_fmadd_ps(beta1, _mm512_maskz_loadu_ps(mask, moments + i), _mm512_mul_ps(gradientWeight1, g));
+        __m512 s = _mm512_fmadd_ps(beta2, _mm512_maskz_loadu_ps(mask, squares + i), _mm512_mul_ps(gradientWeight2, _mm512_mul_ps(g, g)));
+        __m512 step = _mm512_div_ps(m, _mm512_add_ps(_mm512_sqrt_ps(s), epsilon));
+        _mm512_mask_storeu_ps(moments + i, mask, m);
+        _mm512_mask_storeu_ps(squares + i, mask, s);
+        _mm512_mask_storeu_ps(parameters + i, mask, _mm512_fnmadd_ps(rate, step, _mm512_maskz_loadu_ps(mask, parameters + i)));
+    }
+}
+
+SIMD_TARGET_AVX512 inline __m512 ExpAVX512 (__m512 x)
+{
+    x = _mm512_min_ps(_mm512_max_ps(x, _mm512_set1_ps(c_expMin)), _mm512_set1_ps(c_expMax));
+
+    __m512 n = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps(c_log2e)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    x = _mm512_fnmadd_ps(n, _mm512_set1_ps(c_expC1), x);
+    x = _mm512_fnmadd_ps(n, _mm512_set1_ps(c_expC2), x);
+
+    __m512 y = _mm512_set1_ps(c_expP0);
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(c_expP1));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(c_expP2));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(c_expP3));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(c_expP4));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(c_expP5));
+    y = _mm512_fmadd_ps(y, _mm512_mul_ps(x, x), _mm512_add_ps(x, _mm512_set1_ps(1.0f)));
+
+    // y * 2^n
+    return _mm512_scalef_ps(y, n);
+}
+
+SIMD_TARGET_AVX512 inline void SigmoidAVX512 (float* values, const float* biases, size_t count)
+{
+    const __m512 one = _mm512_set1_ps(1.0f);
+    size_t i = 0;
+    for (; i < count; i += 16)
+    {
+        __mmask16 mask = (count - i >= 16) ? __mmask16(0xFFFF) : __mmask16((1u << (count - i)) - 1);
+        __m512 z = _mm512_add_ps(_mm512_maskz_loadu_ps(mask, values + i), _mm512_maskz_loadu_ps(mask, biases + i));
+        __m512 e = ExpAVX512(_mm512_sub_ps(_mm512_setzero_ps(), z));
+        _mm512_mask_storeu_ps(values + i, mask, _mm512_div_ps(one, _mm512_add_ps(one, e)));
+    }
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+    #pragma GCC diagnostic pop
+#endif
+
+//-------------------------------------------------------------------------------------------------
+// CPU detection
+
+struct CpuFeatures
+{
+    bool m_avx2 = false;
+    bool m_avx512 = false;
+};
+
+inline CpuFeatures DetectCpuFeatures ()
+{
+    CpuFeatures features;
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return features;
+
+    __cpuid(info, 1);
+    bool fma = (info[2] & (1 << 12)) != 0;
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    if (!osxsave)
+        return features;
+
+    // The OS has to save the YMM (and for AVX-512 also the opmask and ZMM) registers on a context switch
+    unsigned long long xcr0 = _xgetbv(0);
+    bool osAvx = (xcr0 & 0x6) == 0x6;
+    bool osAvx512 = (xcr0 & 0xE6) == 0xE6;
+
+    __cpuidex(info, 7, 0);
+    features.m_avx2 = osAvx && fma && (info[1] & (1 << 5)) != 0;
+    features.m_avx512 = features.m_avx2 && osAvx512 && (info[1] & (1 << 16)) != 0;
+#else
+    // These also check that the OS has enabled the registers
+    __builtin_cpu_init();
+    features.m_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    features.m_avx512 = features.m_avx2 && __builtin_cpu_supports("avx512f");
+#endif
+    return features;
+}
+
+#endif // SIMD_X86()
+
+#if SIMD_NEON()
+
+//-------------------------------------------------------------------------------------------------
+// NEON
+
+inline float DotProductNEON (const float* a, const float* b, size_t count)
+{
+    float32x4_t sum0 = vdupq_n_f32(0.0f);
+    float32x4_t sum1 = vdupq_n_f32(0.0f);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        sum0 = vfmaq_f32(sum0, vld1q_f32(a + i), vld1q_f32(b + i));
+        sum1 = vfmaq_f32(sum1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    for (; i + 4 <= count; i += 4)
+        sum0 = vfmaq_f32(sum0, vld1q_f32(a + i), vld1q_f32(b + i));
+
+    float sum = vaddvq_f32(vaddq_f32(sum0, sum1));
+    for (; i < count; ++i)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+inline void MultiplyAddNEON (float* y, float a, const float* x, size_t count)
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+        vst1q_f32(y + i, vfmaq_n_f32(vld1q_f32(y + i), vld1q_f32(x + i), a));
+    for (; i < count; ++i)
+        y[i] += a * x[i];
+}
+
+inline int32_t DotProductU8I8NEON (const uint8_t* a, const int8_t* b, size_t count)
+{
+    int32x4_t sum0 = vdupq_n_s32(0);
+    int32x4_t sum1 = vdupq_n_s32(0);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        // uint8 values fit into int16 after widening, so a signed multiply-accumulate is exact
+        int16x8_t a16 = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(a + i)));
+        int16x8_t b16 = vmovl_s8(vld1_s8(b + i));
+        sum0 = vmlal_s16(sum0, vget_low_s16(a16), vget_low_s16(b16));
+        sum1 = vmlal_s16(sum1, vget_high_s16(a16), vget_high_s16(b16));
+    }
+    return vaddvq_s32(vaddq_s32(sum0, sum1)) + DotProductU8I8Scalar(a + i, b + i, count - i);
+}
+
+// Blocks of 16 output columns stay in four registers while all rows are added, the remaining columns are scalar
+inline void SumScaledRowsNEON (float* y, size_t count, const float* rows, size_t stride, const uint32_t* indices, const float* values, size_t rowCount)
+{
+    size_t j = 0;
+    for (; j + 16 <= count; j += 16)
+    {
+        float32x4_t sum0 = vld1q_f32(y + j);
+        float32x4_t sum1 = vld1q_f32(y + j + 4);
+        float32x4_t sum2 = vld1q_f32(y + j + 8);
+        float32x4_t sum3 = vld1q_f32(y + j + 12);
+        for (size_t k = 0; k < rowCount; ++k)
+        {
+            const float* row = rows + (indices ? indices[k] : k) * stride + j;
+            sum0 = vfmaq_n_f32(sum0, vld1q_f32(row), values[k]);
+            sum1 = vfmaq_n_f32(sum1, vld1q_f32(row + 4), values[k]);
+            sum2 = vfmaq_n_f32(sum2, vld1q_f32(row + 8), values[k]);
+            sum3 = vfmaq_n_f32(sum3, vld1q_f32(row + 12), values[k]);
+        }
+        vst1q_f32(y + j, sum0);
+        vst1q_f32(y + j + 4, sum1);
+        vst1q_f32(y + j + 8, sum2);
+        vst1q_f32(y + j + 12, sum3);
+    }
+    if (j < count)
+        SumScaledRowsScalar(y + j, count - j, rows + j, stride, indices, values, rowCount);
+}
+
+inline void AddScaledRowsNEON (float* rows, size_t stride, const uint32_t* indices, const float* values, size_t rowCount, const float* x, size_t count)
+{
+    for (size_t k = 0; k < rowCount; ++k)
+        MultiplyAddNEON(rows + (indices ? indices[k] : k) * stride, values[k], x, count);
+}
+
+inline void MomentumStepNEON (float* parameters, float* velocity, const float* gradients, size_t count, const OptimizerStepArgs& args)
+{
+    const float velocityRate = MomentumVelocityRate(args);
+    const float gradientRate = MomentumGradientRate(args);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        float32x4_t g = vmulq_n_f32(vld1q_f32(gradients + i), args.m_gradientScale);
+        float32x4_t v = vfmaq_n_f32(g, vld1q_f32(velocity + i), args.m_momentum);
+        float32x4_t w = vfmaq_n_f32(vld1q_f32(parameters + i), v, velocityRate);
+        vst1q_f32(velocity + i, v);
+        vst1q_f32(parameters + i, vfmaq_n_f32(w, g, gradientRate));
+    }
+    MomentumStepScalar(parameters + i, velocity + i, gradients + i, count - i, args);
+}
+
+inline void AdamStepNEON (float* parameters, float* moments, float* squares, const float* gradients, size_t count, const OptimizerStepArgs& args)
+{
+    const float32x4_t epsilon = vdupq_n_f32(args.m_epsilon);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        float32x4_t g = vmulq_n_f32(vld1q_f32(gradients + i), args.m_gradientScale);
+        float32x4_t m = vfmaq_n_f32(vmulq_n_f32(g, 1.0f - args.m_momentum), vld1q_f32(moments + i), args.m_momentum);
+        float32x4_t s = vfmaq_n_f32(vmulq_n_f32(vmulq_f32(g, g), 1.0f - args.m_beta2), vld1q_f32(squares + i), args.m_beta2);
+        float32x4_t step = vdivq_f32(m, vaddq_f32(vsqrtq_f32(s), epsilon));
+        vst1q_f32(moments + i, m);
+        vst1q_f32(squares + i, s);
+        vst1q_f32(parameters + i, vfmsq_n_f32(vld1q_f32(parameters + i), step, args.m_rate));
+    }
+    AdamStepScalar(parameters + i, moments + i, squares + i, gradients + i, count - i, args);
+}
+
+inline float32x4_t ExpNEON (float32x4_t x)
+{
+    x = vminq_f32(vmaxq_f32(x, vdupq_n_f32(c_expMin)), vdupq_n_f32(c_expMax));
+
+    float32x4_t n = vrndnq_f32(vmulq_n_f32(x, c_log2e));
+    x = vfmsq_f32(x, n, vdupq_n_f32(c_expC1));
+    x = vfmsq_f32(x, n, vdupq_n_f32(c_expC2));
+
+    float32x4_t y = vdupq_n_f32(c_expP0);
+    y = vfmaq_f32(vdupq_n_f32(c_expP1), y, x);
+    y = vfmaq_f32(vdupq_n_f32(c_expP2), y, x);
+    y = vfmaq_f32(vdupq_n_f32(c_expP3), y, x);
+    y = vfmaq_f32(vdupq_n_f32(c_expP4), y, x);
+    y = vfmaq_f32(vdupq_n_f32(c_expP5), y, x);
+    y = vfmaq_f32(vaddq_f32(x, vdupq_n_f32(1.0f)), y, vmulq_f32(x, x));
+
+    int32x4_t exponent = vshlq_n_s32(vaddq_s32(vcvtq_s32_f32(n), vdupq_n_s32(127)), 23);
+    return vmulq_f32(y, vreinterpretq_f32_s32(exponent));
+}
+
+inline void SigmoidNEON (float* values, const float* biases, size_t count)
+{
+    const float32x4_t one = vdupq_n_f32(1.0f);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        float32x4_t z = vaddq_f32(vld1q_f32(values + i), vld1q_f32(biases + i));
+        float32x4_t e = ExpNEON(vnegq_f32(z));
+        vst1q_f32(values + i, vdivq_f32(one, vaddq_f32(one, e)));
+    }
+    SigmoidScalar(values + i, biases + i, count - i);
+}
+
+#endif // SIMD_NEON()
+
+//-------------------------------------------------------------------------------------------------
+// Runtime dispatch
+
+inline SimdKernels SelectSimdKernels ()
+{
+#if SIMD_X86()
+    CpuFeatures features = DetectCpuFeatures();
+    if (features.m_avx512)
+        return { "AVX-512", DotProductAVX512, MultiplyAddAVX512, SigmoidAVX512, DotProductU8I8AVX2, SumScaledRowsAVX512, AddScaledRowsAVX512, MomentumStepAVX512, AdamStepAVX512 };
+    if (features.m_avx2)
+        return { "AVX2", DotProductAVX2, MultiplyAddAVX2, SigmoidAVX2, DotProductU8I8AVX2, SumScaledRowsAVX2, AddScaledRowsAVX2, MomentumStepAVX2, AdamStepAVX2 };
+#elif SIMD_NEON()
+    return { "NEON", DotProductNEON, MultiplyAddNEON, SigmoidNEON, DotProductU8I8NEON, SumScaledRowsNEON, AddScaledRowsNEON, MomentumStepNEON, AdamStepNEON };
+#endif
+    return { "Scalar", DotProductScalar, MultiplyAddScalar, SigmoidScalar, DotProductU8I8Scalar, SumScaledRowsScalar, AddScaledRowsScalar, MomentumStepScalar, AdamStepScalar };
+}
+
+// The kernels for the CPU we are running on, they are selected on the first call
+inline const SimdKernels& GetSimdKernels ()
+{
+    static const SimdKernels kernels = SelectSimdKernels();
+    return kernels;
+}
@@ -0,0 +1,318 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <string>
+#include <vector>
+#include "timer.h"
+#include "data_loader.h"
+#include "neural_network.h"
+#include "early_stopping.h"
+#include "work_stealing.h"
+
+/* Trains every combination of the given hyperparameters and writes one table with the results of all of them:
+
+    sweep [--topologies <list>] [--batch-sizes <list>] [--optimizers <list>] [--learning-rates <list>] [--schedule <schedule>]
+          [--epochs <n>] [--patience <epochs>] [--threads <n>] [--output <file>]
+          [<training images> <training labels> <test images> <test labels>] [--training <images> <labels>] [--test <images> <labels>]
+
+The lists are separated by commas, e.g. --topologies 785-30-10,785-100:relu-10:softmax --optimizers sgd,adam:0.9:0.999.
+Without --learning-rates every optimizer trains with its DefaultLearningRate(). All runs start from the same seed, so
+they only differ in their hyperparameters, and are scored on the same validation split as recognition.cpp.
+
+The datasets are loaded once and only read by the runs, the images stay in the mapped files. Every run trains on a
+single thread and the runs are spread over all threads by a WorkStealingScheduler, so a sweep keeps all cores busy and
+needs the memory of one network per thread, not per run. */
+
+const char* c_sweepTopologies = "785-30-10,785-100-10";
+const char* c_sweepBatchSizes = "10,32";
+const char* c_sweepOptimizers = "sgd,adam";
+
+const size_t c_sweepEpochs = 10;
+const size_t c_sweepPatience = 3;
+const size_t c_validationImages = 10000;
+const uint32_t c_randomSeed = 1;
+
+const char* c_sweepFileName = "Sweep.csv";
+
+// One point of the grid
+struct SweepConfiguration
+{
+    NetworkTopology     m_topology;
+    size_t              m_miniBatchSize = 0;
+    OptimizerSettings   m_optimizer;
+    float               m_learningRate = 0.0f;
+};
+
+/* What a run found. Every result is written by the thread that ran it, each on its own cache line, so threads that
+finish at the same time do not invalidate each other's lines */
+struct alignas(c_cacheLineSize) SweepResult
+{
+    uint32_t    m_epochs = 0;
+    uint32_t    m_bestEpoch = 0;
+    float       m_trainingAccuracy = 0.0f;
+    float       m_validationAccuracy = 0.0f;
+    float       m_validationCost = 0.0f;
+    float       m_testAccuracy = 0.0f;
+    double      m_seconds = 0.0;
+};
+
+/* The network of a thread, reset for every run it takes, so its workspaces are reused. The hot members of a network
+(the epoch, the optimizer steps, the workspace pointers) are written all the time, padding it to whole cache lines keeps
+the networks of neighbouring threads apart */
+struct alignas(c_cacheLineSize) SweepWorker
+{
+    NeuralNetwork m_network;
+};
+
+// Splits a comma separated list, empty items are dropped
+std::vector<std::string> SplitList (const char* text)
+{
+    std::vector<std::string> items;
+    while (*text)
+    {
+        size_t length = strcspn(text, ",");
+        if (length > 0)
+            items.emplace_back(text, length);
+        text += length;
+        if (*text == ',')
+            ++text;
+    }
+    return items;
+}
+
+// Builds the grid, false if one of the lists has an invalid item
+bool BuildGrid (const char* topologies, const char* batchSizes, const char* optimizers, const char* learningRates,
+                const char* schedule, size_t epochs, std::vector<SweepConfiguration>& grid)
+{
+    std::vector<NetworkTopology> topologyList;
+    for (const std::string& text : SplitList(topologies))
+    {
+        topologyList.emplace_back();
+        if (!topologyList.back().Parse(text.c_str()))
+            return false;
+    }
+
+    std::vector<size_t> batchSizeList;
+    for (const std::string& text : SplitList(batchSizes))
+    {
+        char* end = nullptr;
+        unsigned long batchSize = strtoul(text.c_str(), &end, 10);
+        if (*end != 0 || batchSize == 0)
+        {
+            printf("'%s' is not a valid minibatch size.\n", text.c_str());
+            return false;
+        }
+        batchSizeList.push_back(batchSize);
+    }
+
+    // A cosine schedule decays over the epochs of the sweep unless it is given its own length
+    std::vector<OptimizerSettings> optimizerList;
+    for (const std::string& text : SplitList(optimizers))
+    {
+        OptimizerSettings settings;
+        settings.m_totalEpochs = float(epochs);
+        if (!settings.ParseOptimizer(text.c_str()) || !settings.ParseSchedule(schedule))
+            return false;
+        optimizerList.push_back(settings);
+    }
+
+    // 0 stands for the default rate of the optimizer
+    std::vector<float> learningRateList;
+    for (const std::string& text : SplitList(learningRates))
+    {
+        char* end = nullptr;
+        float learningRate = strtof(text.c_str(), &end);
+        if (*end != 0 || learningRate <= 0.0f)
+        {
+            printf("'%s' is not a valid learning rate.\n", text.c_str());
+            return false;
+        }
+        learningRateList.push_back(learningRate);
+    }
+    if (learningRateList.empty())
+        learningRateList.push_back(0.0f);
+
+    for (const NetworkTopology& topology : topologyList)
+        for (size_t batchSize : batchSizeList)
+            for (const OptimizerSettings& optimizer : optimizerList)
+                for (float learningRate : learningRateList)
+                {
+                    SweepConfiguration configuration;
+                    configuration.m_topology = topology;
+                    configuration.m_miniBatchSize = batchSize;
+                    configuration.m_optimizer = optimizer;
+                    configuration.m_learningRate = learningRate > 0.0f ? learningRate : DefaultLearningRate(optimizer.m_type);
+                    grid.push_back(configuration);
+                }
+
+    if (grid.empty())
+    {
+        printf("The sweep has no configurations, every list needs at least one item.\n");
+        return false;
+    }
+    return true;
+}
+
+// Trains one configuration on the calling thread until the epochs are done or the validation cost stops improving
+SweepResult RunConfiguration (NeuralNetwork& network, const SweepConfiguration& configuration, const MNISTData& trainingData,
+                              const MNISTData& validationData, const MNISTData& testData, size_t epochs, size_t patience)
+{
+    auto startTime = std::chrono::steady_clock::now();
+    network.Reset(configuration.m_topology, c_randomSeed);
+    network.SetOptimizer(configuration.m_optimizer);
+    network.SetThreadPool(nullptr);
+    network.SetPrefetchThreads(0);
+
+    SweepResult result;
+    EarlyStopping earlyStopping(patience);
+    for (size_t epoch = 0; epoch < epochs; ++epoch)
+    {
+        network.Train(trainingData, configuration.m_miniBatchSize, configuration.m_learningRate);
+        result.m_trainingAccuracy = network.TrainingStatistics().Accuracy();
+        if (earlyStopping.Update(network, network.Evaluate(validationData)))
+            break;
+    }
+    result.m_epochs = network.Epoch();
+
+    earlyStopping.RestoreBest(network);
+    result.m_bestEpoch = earlyStopping.BestEpoch();
+    result.m_validationAccuracy = earlyStopping.BestAccuracy();
+    result.m_validationCost = earlyStopping.BestCost();
+    result.m_testAccuracy = network.Evaluate(testData).m_accuracy;
+
+    std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - startTime;
+    result.m_seconds = seconds.count();
+    return result;
+}
+
+bool WriteResults (const char* fileName, const std::vector<SweepConfiguration>& grid, const std::vector<SweepResult>& results)
+{
+    FILE* file = fopen(fileName, "w+t");
+    if (!file)
+    {
+        printf("Could not open '%s' for writing!\n", fileName);
+        return false;
+    }
+
+    fprintf(file, "\"Topology\",\"Minibatch Size\",\"Optimizer\",\"Learning Rate\",\"Epochs\",\"Best Epoch\",\"Training Accuracy\",\"Validation Accuracy\",\"Validation Cost\",\"Test Accuracy\",\"Seconds\"\n");
+    for (size_t i = 0; i < grid.size(); ++i)
+    {
+        const SweepConfiguration& configuration = grid[i];
+        const SweepResult& result = results[i];
+        fprintf(file, "\"%s\",\"%zu\",\"%s\",\"%g\",\"%u\",\"%u\",\"%f\",\"%f\",\"%f\",\"%f\",\"%f\"\n",
+            configuration.m_topology.ToString().c_str(), configuration.m_miniBatchSize, configuration.m_optimizer.ToString().c_str(),
+            configuration.m_learningRate, result.m_epochs, result.m_bestEpoch, result.m_trainingAccuracy, result.m_validationAccuracy,
+            result.m_validationCost, result.m_testAccuracy, result.m_seconds);
+    }
+    fclose(file);
+    return true;
+}
+
+int main (int argc, char** argv)
+{
+    const char* topologies = c_sweepTopologies;
+    const char* batchSizes = c_sweepBatchSizes;
+    const char* optimizers = c_sweepOptimizers;
+    const char* learningRates = "";
+    const char* schedule = "constant";
+    const char* outputFileName = c_sweepFileName;
+    size_t epochs = c_sweepEpochs;
+    size_t patience = c_sweepPatience;
+    size_t threadCount = 0;
+    DatasetArguments datasets;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--topologies") == 0 && i + 1 < argc)
+            topologies = argv[++i];
+        else if (strcmp(argv[i], "--batch-sizes") == 0 && i + 1 < argc)
+            batchSizes = argv[++i];
+        else if (strcmp(argv[i], "--optimizers") == 0 && i + 1 < argc)
+            optimizers = argv[++i];
+        else if (strcmp(argv[i], "--learning-rates") == 0 && i + 1 < argc)
+            learningRates = argv[++i];
+        else if (strcmp(argv[i], "--schedule") == 0 && i + 1 < argc)
+            schedule = argv[++i];
+        else if (strcmp(argv[i], "--epochs") == 0 && i + 1 < argc)
+            epochs = size_t(std::max(atol(argv[++i]), 1L));
+        else if (strcmp(argv[i], "--patience") == 0 && i + 1 < argc)
+            patience = strtoul(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            threadCount = strtoul(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc)
+            outputFileName = argv[++i];
+        else if (!datasets.Parse(argc, argv, i))
+        {
+            printf("Unknown argument '%s'.\n", argv[i]);
+            return 1;
+        }
+    }
+
+    // The only copy of the data, every run reads it through const references
+    MNISTData trainingData;
+    MNISTData validationData;
+    MNISTData testData;
+    if (!datasets.Load(trainingData, testData))
+    {
+        printf("Could not load the MNIST data!\n");
+        return 1;
+    }
+    trainingData.SplitOff(std::min(c_validationImages, trainingData.NumImages() / 6), validationData);
+
+    std::vector<SweepConfiguration> grid;
+    if (!BuildGrid(topologies, batchSizes, optimizers, learningRates, schedule, epochs, grid))
+        return 4;
+
+    /* The runs with the most parameters and the smallest minibatches take the longest, they are dealt out first. The
+    threads that finish early steal the short runs that are left at the back of the other queues */
+    std::vector<size_t> order(grid.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&] (size_t a, size_t b)
+    {
+        size_t parametersA = grid[a].m_topology.ParameterCount();
+        size_t parametersB = grid[b].m_topology.ParameterCount();
+        if (parametersA != parametersB)
+            return parametersA > parametersB;
+        return grid[a].m_miniBatchSize < grid[b].m_miniBatchSize;
+    });
+
+    WorkStealingScheduler scheduler(threadCount);
+    std::vector<SweepWorker> workers(std::min(scheduler.ThreadCount(), grid.size()));
+    std::vector<SweepResult> results(grid.size());
+    printf("%zu training images, %zu validation images, %zu test images\n", trainingData.NumImages(), validationData.NumImages(), testData.NumImages());
+    printf("Sweeping %zu configurations for up to %zu epochs (patience %zu) on %zu threads\n\n", grid.size(), epochs, patience, workers.size());
+
+    std::mutex printMutex;
+    std::atomic<size_t> finished{ 0 };
+    {
+        Timer timer("The sweep time: ");
+        scheduler.Run(order, [&] (size_t index, size_t threadIndex)
+        {
+            const SweepConfiguration& configuration = grid[index];
+            results[index] = RunConfiguration(workers[threadIndex].m_network, configuration, trainingData, validationData, testData, epochs, patience);
+
+            std::lock_guard<std::mutex> lock(printMutex);
+            printf("[%zu/%zu] %s, minibatch %zu, %s, learning rate %g: validation accuracy %0.2f%% after epoch %u of %u (%0.1f seconds)\n",
+                ++finished, grid.size(), configuration.m_topology.ToString().c_str(), configuration.m_miniBatchSize,
+                configuration.m_optimizer.ToString().c_str(), configuration.m_learningRate, 100.0f*results[index].m_validationAccuracy,
+                results[index].m_bestEpoch, results[index].m_epochs, results[index].m_seconds);
+        });
+    }
+    printf("%zu runs were stolen by another thread\n\n", scheduler.Steals());
+
+    // The table is ranked by the validation accuracy, the test accuracy is only shown, not used to choose
+    std::vector<size_t> ranking = order;
+    std::stable_sort(ranking.begin(), ranking.end(), [&] (size_t a, size_t b) { return results[a].m_validationAccuracy > results[b].m_validationAccuracy; });
+    printf("%-28s %9s  %-36s %8s %7s %10s %8s\n", "Topology", "Minibatch", "Optimizer", "Rate", "Epochs", "Validation", "Test");
+    for (size_t index : ranking)
+    {
+        const SweepConfiguration& configuration = grid[index];
+        const SweepResult& result = results[index];
+        printf("%-28s %9zu  %-36s %8g %3u/%-3u %9.2f%% %7.2f%%\n", configuration.m_topology.ToString().c_str(), configuration.m_miniBatchSize,
+            configuration.m_optimizer.ToString().c_str(), configuration.m_learningRate, result.m_bestEpoch, result.m_epochs,
+            100.0f*result.m_validationAccuracy, 100.0f*result.m_testAccuracy);
+    }
+
+    if (!WriteResults(outputFileName, grid, results))
+        return 2;
+    printf("\nThe results of all runs are in '%s'\n", outputFileName);
+    return 0;
+}
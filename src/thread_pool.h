@@ -0,0 +1,139 @@
+#pragma once
+
+#include <stddef.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* A fixed set of worker threads that run indexed tasks. ParallelFor(count, task) calls task(0) ... task(count - 1)
+and returns when all of them are finished; the calling thread takes part in the work as well.
+The tasks are identified by their index, not by the thread that runs them, so anything that is
+indexed by the task (e.g. gradient shards) gives the same result no matter how the work was scheduled. */
+class ThreadPool
+{
+public:
+    // threadCount is the total number of threads including the caller, 0 means one thread per hardware core
+    explicit ThreadPool (size_t threadCount = 0)
+    {
+        if (threadCount == 0)
+            threadCount = std::max(1u, std::thread::hardware_concurrency());
+
+        for (size_t i = 1; i < threadCount; ++i)
+            m_workers.emplace_back([this] () { WorkerLoop(); });
+    }
+
+    ~ThreadPool ()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_wakeCondition.notify_all();
+        for (std::thread& worker : m_workers)
+            worker.join();
+    }
+
+    ThreadPool (const ThreadPool&) = delete;
+    ThreadPool& operator = (const ThreadPool&) = delete;
+
+    size_t ThreadCount () const { return m_workers.size() + 1; }
+
+    // Several threads may call this at the same time, their jobs are executed one after another
+    void ParallelFor (size_t count, const std::function<void(size_t)>& task)
+    {
+        if (m_workers.empty() || count <= 1)
+        {
+            for (size_t i = 0; i < count; ++i)
+                task(i);
+            return;
+        }
+
+        std::lock_guard<std::mutex> callerLock(m_callerMutex);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_task = &task;
+            m_taskCount = count;
+            m_nextIndex = 0;
+            m_pendingTasks = count;
+            ++m_generation;
+        }
+        m_wakeCondition.notify_all();
+
+        RunTasks(task, count);
+
+        // Wait until every task is done and no worker is still holding on to the task
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_doneCondition.wait(lock, [this] () { return m_pendingTasks == 0 && m_activeWorkers == 0; });
+        m_task = nullptr;
+    }
+
+private:
+
+    void RunTasks (const std::function<void(size_t)>& task, size_t count)
+    {
+        while (true)
+        {
+            size_t index = m_nextIndex.fetch_add(1);
+            if (index >= count)
+                break;
+
+            task(index);
+
+            if (m_pendingTasks.fetch_sub(1) == 1)
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_doneCondition.notify_all();
+            }
+        }
+    }
+
+    void WorkerLoop ()
+    {
+        size_t seenGeneration = 0;
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true)
+        {
+            m_wakeCondition.wait(lock, [&] () { return m_stop || m_generation != seenGeneration; });
+            if (m_stop)
+                return;
+
+            seenGeneration = m_generation;
+            const std::function<void(size_t)>* task = m_task;
+            if (!task)
+                continue;
+
+            size_t count = m_taskCount;
+            ++m_activeWorkers;
+            lock.unlock();
+
+            RunTasks(*task, count);
+
+            lock.lock();
+            if (--m_activeWorkers == 0)
+                m_doneCondition.notify_all();
+        }
+    }
+
+private:
+
+    std::vector<std::thread>                m_workers;
+
+    std::mutex                              m_callerMutex;
+    std::mutex                              m_mutex;
+    std::condition_variable                 m_wakeCondition;
+    std::condition_variable                 m_doneCondition;
+
+    // The current job, protected by m_mutex
+    const std::function<void(size_t)>*      m_task = nullptr;
+    size_t                                  m_taskCount = 0;
+    size_t                                  m_generation = 0;
+    size_t                                  m_activeWorkers = 0;
+    bool                                    m_stop = false;
+
+    std::atomic<size_t>                     m_nextIndex{ 0 };
+    std::atomic<size_t>                     m_pendingTasks{ 0 };
+};
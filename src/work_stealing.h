@@ -0,0 +1,106 @@
+#pragma once
+
+#include <stddef.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "aligned_allocator.h"
+
+/* Runs a set of long, independent tasks of uneven length, e.g. whole training runs, on a fixed number of threads.
+Every thread gets its own queue of task indices, dealt round-robin in the given order, and works through it from the
+front. A thread whose queue is empty steals from the back of another queue, so the threads only meet at the same end of
+a queue when it holds a single task. Unlike ThreadPool::ParallelFor() the task is told which thread runs it, so it can
+reuse memory that belongs to that thread. The calling thread is thread 0. */
+class WorkStealingScheduler
+{
+public:
+    // threadCount is the total number of threads including the caller, 0 means one thread per hardware core
+    explicit WorkStealingScheduler (size_t threadCount = 0)
+    {
+        if (threadCount == 0)
+            threadCount = std::max(1u, std::thread::hardware_concurrency());
+        m_queues = std::vector<WorkerQueue>(threadCount);
+    }
+
+    WorkStealingScheduler (const WorkStealingScheduler&) = delete;
+    WorkStealingScheduler& operator = (const WorkStealingScheduler&) = delete;
+
+    size_t ThreadCount () const { return m_queues.size(); }
+
+    // The number of tasks that were taken from the queue of another thread in the last Run()
+    size_t Steals () const { return m_steals; }
+
+    /* Calls task(taskIndex, threadIndex) for every index in order and returns when all of them are finished. The tasks
+    at the front of order are started first, so putting the longest ones there keeps a long task from starting last */
+    void Run (const std::vector<size_t>& order, const std::function<void(size_t, size_t)>& task)
+    {
+        const size_t threadCount = std::min(m_queues.size(), std::max<size_t>(order.size(), 1));
+        for (size_t i = 0; i < order.size(); ++i)
+            m_queues[i % threadCount].m_tasks.push_back(order[i]);
+        m_stealCounter = 0;
+
+        std::vector<std::thread> threads;
+        for (size_t threadIndex = 1; threadIndex < threadCount; ++threadIndex)
+            threads.emplace_back([&, threadIndex] () { WorkerLoop(task, threadIndex, threadCount); });
+        WorkerLoop(task, 0, threadCount);
+        for (std::thread& thread : threads)
+            thread.join();
+
+        m_steals = m_stealCounter;
+    }
+
+private:
+
+    void WorkerLoop (const std::function<void(size_t, size_t)>& task, size_t threadIndex, size_t threadCount)
+    {
+        size_t taskIndex = 0;
+        while (NextTask(threadIndex, threadCount, taskIndex))
+            task(taskIndex, threadIndex);
+    }
+
+    // The next task of the own queue, or one stolen from the others. No task is added while Run() is busy, so empty queues stay empty
+    bool NextTask (size_t threadIndex, size_t threadCount, size_t& taskIndex)
+    {
+        {
+            WorkerQueue& own = m_queues[threadIndex];
+            std::lock_guard<std::mutex> lock(own.m_mutex);
+            if (!own.m_tasks.empty())
+            {
+                taskIndex = own.m_tasks.front();
+                own.m_tasks.pop_front();
+                return true;
+            }
+        }
+
+        for (size_t offset = 1; offset < threadCount; ++offset)
+        {
+            WorkerQueue& victim = m_queues[(threadIndex + offset) % threadCount];
+            std::lock_guard<std::mutex> lock(victim.m_mutex);
+            if (!victim.m_tasks.empty())
+            {
+                taskIndex = victim.m_tasks.back();
+                victim.m_tasks.pop_back();
+                m_stealCounter.fetch_add(1);
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+
+    // Every queue has its own cache line, so taking a task only touches the line of the queue it comes from
+    struct alignas(c_cacheLineSize) WorkerQueue
+    {
+        std::mutex          m_mutex;
+        std::deque<size_t>  m_tasks;
+    };
+
+    std::vector<WorkerQueue>    m_queues;
+    std::atomic<size_t>         m_stealCounter{ 0 };
+    size_t                      m_steals = 0;
+};